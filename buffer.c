@@ -14,6 +14,7 @@ static void buffer_push (Buffer _buffer, const char *str);
 static void buffer_pop_len (Buffer _buffer, char *str, size_t len);
 static void buffer_pop_break (Buffer _buffer, char *str);
 static void buffer_peek (Buffer _buffer, char *str, size_t len);
+static void buffer_clear (Buffer _buffer);
 
 struct _t_buffer {
     GString *content;
@@ -27,7 +28,8 @@ const struct _buffer buffer = {
     .push = &buffer_push,
     .pop_len = &buffer_pop_len,
     .pop_break = &buffer_pop_break,
-    .peek = &buffer_peek
+    .peek = &buffer_peek,
+    .clear = &buffer_clear
 };
 
 Buffer buffer_init (size_t size)
@@ -133,4 +135,12 @@ void buffer_peek (Buffer _buffer, char *str, size_t len)
     pthread_mutex_lock(&_buffer->mutex);
     g_strlcpy(str, _buffer->content->str, len);
     pthread_mutex_unlock(&_buffer->mutex);
-}
\ No newline at end of file
+}
+void buffer_clear (Buffer _buffer)
+{
+    if (_buffer == NULL)
+        return;
+    pthread_mutex_lock(&_buffer->mutex);
+    g_string_truncate(_buffer->content, 0);
+    pthread_mutex_unlock(&_buffer->mutex);
+}
@@ -17,6 +17,7 @@ struct _buffer {
     void        (* pop_len) (Buffer buffer, char *str, size_t len);
     void        (* pop_break) (Buffer buffer, char *str);
     void        (* peek) (Buffer buffer, char *str, size_t len);
+    void        (* clear) (Buffer buffer);
 };
 extern const struct _buffer buffer;
 
@@ -0,0 +1,255 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#include "dedup.h"
+
+#include <glib.h>
+#include <string.h>
+
+//expiry granularity is window / DEDUP_BUCKETS
+#define DEDUP_BUCKETS 64
+//probe chains stay short below three quarters full, tombstones included
+#define DEDUP_LOAD_NUM 3
+#define DEDUP_LOAD_DEN 4
+
+enum slot_state {
+    SLOT_EMPTY,
+    SLOT_LIVE,
+    SLOT_TOMBSTONE
+};
+
+struct dedup_slot {
+    uint64_t hash;
+    SMSHandle handle;
+    uint64_t tick;
+    uint8_t state;
+    uint8_t id_len;
+    char id[DEDUP_CLIENT_ID_MAX_LEN];
+};
+
+struct _t_dedup {
+    GMutex mutex;
+    struct dedup_slot *slots;
+    size_t capacity;
+    size_t mask;
+    size_t live;
+    size_t tombstones;
+    gint64 bucket_width;    //microsecond
+    uint64_t tick;
+    GArray *buckets[DEDUP_BUCKETS];//slot indexes claimed during each tick of the window
+};
+
+static Dedup dedup_init (size_t capacity, uint32_t window);
+static void dedup_free (Dedup *index);
+static bool dedup_claim (Dedup index, const char *client_id, SMSHandle handle, SMSHandle *original);
+static size_t dedup_get_size (Dedup index);
+static uint64_t hash_id (const char *id, size_t len);
+static void advance (Dedup index, uint64_t tick);
+static void expire_bucket (Dedup index, uint64_t tick);
+static void evict_oldest (Dedup index);
+static void rebuild (Dedup index);
+static size_t probe (Dedup index, uint64_t hash, const char *id, size_t len, bool *found);
+
+const struct _dedup dedup = {
+    .init = &dedup_init,
+    .free = &dedup_free,
+    .claim = &dedup_claim,
+    .get_size = &dedup_get_size
+};
+
+Dedup dedup_init (size_t capacity, uint32_t window)
+{
+    Dedup index;
+    size_t size;
+
+    index = g_new0(struct _t_dedup, 1);
+    g_assert(index != NULL);
+    if (index == NULL)
+        return NULL;
+    for (size = 16; size < capacity; size <<= 1);
+    g_mutex_init(&index->mutex);
+    index->capacity = size;
+    index->mask = size - 1;
+    index->slots = g_new0(struct dedup_slot, size);
+    index->bucket_width = MAX((gint64)window * G_USEC_PER_SEC / DEDUP_BUCKETS, 1);
+    index->tick = (uint64_t)(g_get_monotonic_time() / index->bucket_width);
+    for (int i = 0; i < DEDUP_BUCKETS; i++)
+        index->buckets[i] = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+    return index;
+}
+
+void dedup_free (Dedup *index)
+{
+    if (index == NULL || (*index) == NULL)
+        return;
+    for (size_t i = 0; i < (*index)->capacity; i++)
+        if ((*index)->slots[i].state == SLOT_LIVE)
+            sms_handle.free(&(*index)->slots[i].handle);
+    for (int i = 0; i < DEDUP_BUCKETS; i++)
+        g_array_free((*index)->buckets[i], TRUE);
+    g_free((*index)->slots);
+    g_mutex_clear(&(*index)->mutex);
+    g_free(*index);
+    *index = NULL;
+}
+
+bool dedup_claim (Dedup index, const char *client_id, SMSHandle handle, SMSHandle *original)
+{
+    struct dedup_slot *slot;
+    uint64_t hash;
+    uint32_t at;
+    size_t len;
+    bool found;
+
+    if (index == NULL || client_id == NULL || handle == NULL)
+        return false;
+    len = strlen(client_id);
+    if (len == 0 || len > DEDUP_CLIENT_ID_MAX_LEN)
+        return false;
+    hash = hash_id(client_id, len);
+    g_mutex_lock(&index->mutex);
+    advance(index, (uint64_t)(g_get_monotonic_time() / index->bucket_width));
+    at = (uint32_t)probe(index, hash, client_id, len, &found);
+    if (found) {
+        if (original != NULL)
+            *original = sms_handle.ref(index->slots[at].handle);
+        g_mutex_unlock(&index->mutex);
+        return false;
+    }
+    if ((index->live + index->tombstones + 1) * DEDUP_LOAD_DEN > index->capacity * DEDUP_LOAD_NUM) {
+        if (index->tombstones > 0)
+            rebuild(index);
+        while ((index->live + 1) * DEDUP_LOAD_DEN > index->capacity * DEDUP_LOAD_NUM)
+            evict_oldest(index);
+        at = (uint32_t)probe(index, hash, client_id, len, &found);
+    }
+    slot = &index->slots[at];
+    if (slot->state == SLOT_TOMBSTONE)
+        index->tombstones--;
+    slot->state = SLOT_LIVE;
+    slot->hash = hash;
+    slot->tick = index->tick;
+    slot->id_len = (uint8_t)len;
+    memcpy(slot->id, client_id, len);
+    slot->handle = sms_handle.ref(handle);
+    index->live++;
+    g_array_append_val(index->buckets[index->tick % DEDUP_BUCKETS], at);
+    g_mutex_unlock(&index->mutex);
+    return true;
+}
+
+size_t dedup_get_size (Dedup index)
+{
+    size_t size;
+
+    if (index == NULL)
+        return 0;
+    g_mutex_lock(&index->mutex);
+    size = index->live;
+    g_mutex_unlock(&index->mutex);
+    return size;
+}
+
+//FNV-1a
+uint64_t hash_id (const char *id, size_t len)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)id[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+    return hash;
+}
+
+/*
+ * Linear probing. Returns the slot holding the id, or the slot it should be
+ * inserted at: the first tombstone on the chain, else the empty slot ending it.
+ */
+size_t probe (Dedup index, uint64_t hash, const char *id, size_t len, bool *found)
+{
+    struct dedup_slot *slot;
+    size_t i, insert_at;
+
+    insert_at = SIZE_MAX;
+    *found = false;
+    for (i = hash & index->mask;; i = (i + 1) & index->mask) {
+        slot = &index->slots[i];
+        if (slot->state == SLOT_EMPTY)
+            return insert_at != SIZE_MAX ? insert_at : i;
+        if (slot->state == SLOT_TOMBSTONE) {
+            if (insert_at == SIZE_MAX)
+                insert_at = i;
+            continue;
+        }
+        if (slot->hash == hash && slot->id_len == len && memcmp(slot->id, id, len) == 0) {
+            *found = true;
+            return i;
+        }
+    }
+}
+
+//a bucket is reused once per window, whatever it still holds from the last round has expired
+void advance (Dedup index, uint64_t tick)
+{
+    for (int i = 0; index->tick < tick && i < DEDUP_BUCKETS; i++) {
+        index->tick++;
+        expire_bucket(index, index->tick - DEDUP_BUCKETS);
+    }
+    index->tick = MAX(index->tick, tick);
+}
+
+void expire_bucket (Dedup index, uint64_t tick)
+{
+    struct dedup_slot *slot;
+    GArray *bucket;
+
+    bucket = index->buckets[tick % DEDUP_BUCKETS];
+    for (guint i = 0; i < bucket->len; i++) {
+        slot = &index->slots[g_array_index(bucket, uint32_t, i)];
+        //the slot may have been expired early and claimed again since
+        if (slot->state != SLOT_LIVE || slot->tick != tick)
+            continue;
+        sms_handle.free(&slot->handle);
+        slot->state = SLOT_TOMBSTONE;
+        index->live--;
+        index->tombstones++;
+    }
+    g_array_set_size(bucket, 0);
+}
+
+//the table is full of ids younger than the window, the oldest go first to keep memory bounded
+void evict_oldest (Dedup index)
+{
+    uint64_t tick;
+
+    for (int i = DEDUP_BUCKETS - 1; i >= 0; i--) {
+        tick = index->tick - (uint64_t)i;
+        if (index->buckets[tick % DEDUP_BUCKETS]->len > 0) {
+            expire_bucket(index, tick);
+            return;
+        }
+    }
+}
+
+void rebuild (Dedup index)
+{
+    struct dedup_slot *old;
+    uint32_t at;
+    bool found;
+
+    old = index->slots;
+    index->slots = g_new0(struct dedup_slot, index->capacity);
+    index->tombstones = 0;
+    for (int i = 0; i < DEDUP_BUCKETS; i++)
+        g_array_set_size(index->buckets[i], 0);
+    for (size_t i = 0; i < index->capacity; i++) {
+        if (old[i].state != SLOT_LIVE)
+            continue;
+        at = (uint32_t)probe(index, old[i].hash, old[i].id, old[i].id_len, &found);
+        index->slots[at] = old[i];
+        g_array_append_val(index->buckets[old[i].tick % DEDUP_BUCKETS], at);
+    }
+    g_free(old);
+}
@@ -0,0 +1,31 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_DEDUP_H
+#define GSMAPP_DEDUP_H
+
+#include "smshandle.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEDUP_CLIENT_ID_MAX_LEN 64
+
+typedef struct _t_dedup *Dedup;
+
+struct _dedup {
+    //capacity is rounded up to a power of two, entries expire window seconds after their claim
+    Dedup       (* init) (size_t capacity, uint32_t window);
+    void        (* free) (Dedup *index);
+
+    //true if client_id was free and now maps to handle, otherwise *original gets a new
+    //reference to the handle of the first submission within the window
+    bool        (* claim) (Dedup index, const char *client_id, SMSHandle handle, SMSHandle *original);
+    size_t      (* get_size) (Dedup index);
+};
+extern const struct _dedup dedup;
+
+#endif //GSMAPP_DEDUP_H
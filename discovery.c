@@ -0,0 +1,230 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#include "discovery.h"
+#include "driver.h"
+#include "logger.h"
+#include "serial.h"
+
+#include <glib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <glob.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DISCOVERY_SYNC_INTERVAL 500 //millisecond, between AT attempts while the modem autobauds
+#define DISCOVERY_BUFFER_SIZE 512
+
+struct probe {
+    struct discovery_result result;
+    int64_t deadline;
+    pthread_t thread;
+    bool found;
+};
+
+static size_t discovery_scan (const char **patterns, uint32_t timeout_ms, discovery_cb cb, void *user_data);
+static void *probe_port (void *data);
+static bool probe_command (SerialDevice device, const char *command, int64_t deadline, char *reply,
+                           size_t reply_len);
+static void keep_digits (char *reply);
+static bool match_vendor (struct discovery_result *result);
+
+static const char *default_patterns[] = {"/dev/ttyUSB*", "/dev/ttyACM*", NULL};
+
+const struct _discovery discovery = {
+    .scan = &discovery_scan
+};
+
+size_t discovery_scan (const char **patterns, uint32_t timeout_ms, discovery_cb cb, void *user_data)
+{
+    struct probe *probes;
+    GHashTable *imeis;
+    glob_t ports;
+    int64_t deadline;
+    size_t found;
+    int flags;
+
+    if (patterns == NULL)
+        patterns = default_patterns;
+    flags = 0;
+    memset(&ports, 0, sizeof(ports));
+    for (size_t i = 0; patterns[i] != NULL; i++) {
+        glob(patterns[i], flags, NULL, &ports);
+        flags = GLOB_APPEND;
+    }
+    if (ports.gl_pathc == 0) {
+        LOG_WARN("discovery: no serial ports found");
+        globfree(&ports);
+        return 0;
+    }
+    probes = g_new0(struct probe, ports.gl_pathc);
+    g_assert(probes != NULL);
+    if (probes == NULL) {
+        globfree(&ports);
+        return 0;
+    }
+    //one deadline for all, startup waits for the slowest port rather than the sum
+    deadline = g_get_monotonic_time() + (int64_t)timeout_ms * 1000;
+    for (size_t i = 0; i < ports.gl_pathc; i++) {
+        probes[i].result.port = ports.gl_pathv[i];
+        probes[i].deadline = deadline;
+        pthread_create(&probes[i].thread, NULL, probe_port, &probes[i]);
+    }
+    found = 0;
+    imeis = g_hash_table_new(g_str_hash, g_str_equal);
+    for (size_t i = 0; i < ports.gl_pathc; i++) {
+        pthread_join(probes[i].thread, NULL);
+        if (!probes[i].found)
+            continue;
+        if (probes[i].result.imei[0] != '\0') {
+            if (g_hash_table_contains(imeis, probes[i].result.imei)) {
+                LOG_DEBUG("discovery: %s is another port of modem %s", probes[i].result.port,
+                          probes[i].result.imei);
+                continue;
+            }
+            g_hash_table_add(imeis, probes[i].result.imei);
+        }
+        LOG_INFO("discovery: %s model=\"%s\" imei=%s imsi=%s", probes[i].result.port, probes[i].result.model,
+                 probes[i].result.imei, probes[i].result.imsi);
+        if (cb != NULL)
+            cb(&probes[i].result, user_data);
+        found++;
+    }
+    g_hash_table_destroy(imeis);
+    g_free(probes);
+    globfree(&ports);
+    return found;
+}
+
+void *probe_port (void *data)
+{
+    struct discovery_result *result;
+    struct probe *probe;
+    SerialDevice device;
+    int64_t attempt;
+    bool synced;
+
+    probe = data;
+    result = &probe->result;
+    device = serial.init(result->port);
+    if (device == NULL)
+        return NULL;
+    //every supported modem autobauds at 115200 8N1, a USB AT port ignores the rate
+    serial.set_baudrate(device, 115200);
+    serial.set_parity(device, PARITY_NONE);
+    serial.set_stopbits(device, 1);
+    serial.set_databits(device, 8);
+    serial.set_access_mode(device, ACCESS_READ_WRITE);
+    serial.set_handshake(device, HANDSHAKE_NONE);
+    serial.set_echo(device, false);
+    serial.open(device);
+    if (serial.get_file_descriptor(device) <= 0) {
+        LOG_DEBUG("discovery: cannot open %s: %s", result->port, strerror(errno));
+        serial.free(&device);
+        return NULL;
+    }
+    synced = false;
+    while (!synced && g_get_monotonic_time() < probe->deadline) {
+        attempt = MIN(probe->deadline, g_get_monotonic_time() + DISCOVERY_SYNC_INTERVAL * 1000);
+        synced = probe_command(device, "AT", attempt, NULL, 0);
+    }
+    if (synced) {
+        probe_command(device, "ATI", probe->deadline, result->identity, sizeof(result->identity));
+        probe_command(device, "AT+CGMM", probe->deadline, result->model, sizeof(result->model));
+        if (probe_command(device, "AT+CGSN", probe->deadline, result->imei, sizeof(result->imei)))
+            keep_digits(result->imei);
+        if (probe_command(device, "AT+CIMI", probe->deadline, result->imsi, sizeof(result->imsi)))
+            keep_digits(result->imsi);
+        else
+            result->imsi[0] = '\0';
+        probe->found = match_vendor(result);
+        if (!probe->found)
+            LOG_WARN("discovery: %s answers but \"%s\" is not a supported model", result->port,
+                     result->model[0] != '\0' ? result->model : result->identity);
+    }
+    serial.close(device);
+    serial.free(&device);
+    return NULL;
+}
+
+//true on OK, reply collects the information lines without the echo and URCs
+bool probe_command (SerialDevice device, const char *command, int64_t deadline, char *reply, size_t reply_len)
+{
+    char buffer[DISCOVERY_BUFFER_SIZE], line[DISCOVERY_BUFFER_SIZE], out[DISCOVERY_BUFFER_SIZE];
+    struct pollfd pfd;
+    size_t line_len, out_len;
+    int64_t remaining;
+    ssize_t len;
+
+    pfd.fd = serial.get_file_descriptor(device);
+    pfd.events = POLLIN;
+    snprintf(out, sizeof(out), "%s\r", command);
+    if (serial.write(device, (const uint8_t *)out, strlen(out)) <= 0)
+        return false;
+    if (reply != NULL && reply_len > 0)
+        reply[0] = '\0';
+    line_len = 0;
+    out_len = 0;
+    while (true) {
+        remaining = (deadline - g_get_monotonic_time()) / 1000;
+        if (remaining <= 0)
+            return false;
+        if (poll(&pfd, 1, (int)remaining) <= 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        len = read(pfd.fd, buffer, sizeof(buffer));
+        if (len <= 0)
+            return false;
+        for (ssize_t i = 0; i < len; i++) {
+            if (buffer[i] != '\r' && buffer[i] != '\n') {
+                if (line_len < sizeof(line) - 1)
+                    line[line_len++] = buffer[i];
+                continue;
+            }
+            if (line_len == 0)
+                continue;
+            line[line_len] = '\0';
+            line_len = 0;
+            if (strcmp(line, "OK") == 0)
+                return true;
+            if (strcmp(line, "ERROR") == 0 || g_str_has_prefix(line, "+CME ERROR") ||
+                g_str_has_prefix(line, "+CMS ERROR"))
+                return false;
+            if (strcmp(line, command) == 0 || line[0] == '+' || reply == NULL)
+                continue;
+            out_len += (size_t)snprintf(out + out_len, sizeof(out) - out_len, "%s%s",
+                                        out_len > 0 ? " " : "", line);
+            out_len = MIN(out_len, sizeof(out) - 1);
+            g_strlcpy(reply, out, reply_len);
+        }
+    }
+}
+
+//drops URCs such as "SMS Ready" that share the reply with a numeric answer
+void keep_digits (char *reply)
+{
+    char *start, *end;
+
+    for (start = reply; *start != '\0' && !isdigit((unsigned char)*start); start++);
+    for (end = start; isdigit((unsigned char)*end); end++);
+    memmove(reply, start, (size_t)(end - start));
+    reply[end - start] = '\0';
+}
+
+bool match_vendor (struct discovery_result *result)
+{
+    const struct gsm_driver *drv;
+
+    drv = driver.match((result->model[0] != '\0') ? result->model : result->identity);
+    if (drv == NULL)
+        return false;
+    result->vendor = drv->model;
+    return true;
+}
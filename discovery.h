@@ -0,0 +1,36 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_DISCOVERY_H
+#define GSMAPP_DISCOVERY_H
+
+#include "gsm.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DISCOVERY_REPLY_MAX_LEN 128
+
+struct discovery_result {
+    const char  *port;
+    enum gsm_vendor_model vendor;
+    char        identity[DISCOVERY_REPLY_MAX_LEN];  //ATI
+    char        model[DISCOVERY_REPLY_MAX_LEN];     //AT+CGMM
+    char        imei[DISCOVERY_REPLY_MAX_LEN];      //AT+CGSN
+    char        imsi[DISCOVERY_REPLY_MAX_LEN];      //AT+CIMI, empty without a SIM
+};
+
+//runs on the scanning thread once for every supported modem, in port order
+typedef void (* discovery_cb) (const struct discovery_result *result, void *user_data);
+
+struct _discovery {
+    //probes every port matching the NULL terminated glob patterns at once, NULL scans
+    ///dev/ttyUSB* and /dev/ttyACM*, and returns the number of modems reported to cb;
+    //a modem exposing several AT ports is reported once, on its first port
+    size_t (* scan) (const char **patterns, uint32_t timeout_ms, discovery_cb cb, void *user_data);
+};
+extern const struct _discovery discovery;
+
+#endif //GSMAPP_DISCOVERY_H
@@ -0,0 +1,150 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#include "driver.h"
+
+#include <glib.h>
+#include <string.h>
+
+static const struct gsm_driver *driver_lookup (enum gsm_vendor_model model);
+static const struct gsm_driver *driver_match (const char *model);
+static void driver_configure (const struct gsm_driver *drv, SerialDevice device);
+
+static const char *const ai_thinker_init[] = {"AT+CMEE=1", NULL};
+//GSM character set, the default IRA mangles text mode messages
+static const char *const simcom_init[] = {"AT+CMEE=1", "AT+CSCS=\"GSM\"", NULL};
+//URCs go to the AT port by default only on some firmware
+static const char *const quectel_init[] = {"AT+CMEE=1", "AT+QURCCFG=\"urcport\",\"usbat\"", NULL};
+
+/*
+ * Timeouts are the maximum response times of the vendor AT manuals, or
+ * measured ones where the manual gives none. Submissions wait for the
+ * network, everything else is answered by the modem itself.
+ */
+static const struct gsm_driver drivers[] = {
+    {
+        .model = GSM_AI_A7,
+        .name = "A7",
+        .match = "A7",
+        .baudrate = 115200,
+        .capabilities = GSM_CAP_TEXT | GSM_CAP_PDU,
+        .init = ai_thinker_init,
+        .reset_time = 10000,
+        .timeouts = {
+            [GSM_COMMAND_CMGF] = 100,
+            [GSM_COMMAND_CMGS] = 200,
+            [GSM_COMMAND_CMGW] = 200,
+            [GSM_COMMAND_CMSS] = 60000,
+            [GSM_COMMAND_CMGL] = 30000,
+            [GSM_COMMAND_CMGD] = 5000,
+            [GSM_COMMAND_CREG] = 200,
+            [GSM_COMMAND_CSQ] = 200,
+            [GSM_COMMAND_PAYLOAD] = 60000,
+            [GSM_COMMAND_OTHER] = 200,
+        },
+    },
+    {
+        .model = GSM_AI_A6,
+        .name = "A6",
+        .match = "A6",
+        .baudrate = 115200,
+        .capabilities = GSM_CAP_TEXT | GSM_CAP_PDU,
+        .init = ai_thinker_init,
+        .reset_time = 10000,
+        .timeouts = {
+            [GSM_COMMAND_CMGF] = 100,
+            [GSM_COMMAND_CMGS] = 200,
+            [GSM_COMMAND_CMGW] = 200,
+            [GSM_COMMAND_CMSS] = 60000,
+            [GSM_COMMAND_CMGL] = 30000,
+            [GSM_COMMAND_CMGD] = 5000,
+            [GSM_COMMAND_CREG] = 200,
+            [GSM_COMMAND_CSQ] = 200,
+            [GSM_COMMAND_PAYLOAD] = 60000,
+            [GSM_COMMAND_OTHER] = 200,
+        },
+    },
+    {
+        .model = GSM_SIMCOM_SIM800,
+        .name = "SIM800",
+        .match = "SIM800",
+        .baudrate = 115200,
+        .capabilities = GSM_CAP_TEXT | GSM_CAP_PDU,
+        .quirks = GSM_QUIRK_ECHO,
+        .init = simcom_init,
+        .reset_time = 5000,
+        .timeouts = {
+            [GSM_COMMAND_CMGF] = 300,
+            [GSM_COMMAND_CMGS] = 500,
+            [GSM_COMMAND_CMGW] = 500,
+            [GSM_COMMAND_CMSS] = 60000,
+            [GSM_COMMAND_CMGL] = 20000,
+            [GSM_COMMAND_CMGD] = 25000,     //deleting a full storage
+            [GSM_COMMAND_CREG] = 300,
+            [GSM_COMMAND_CSQ] = 300,
+            [GSM_COMMAND_PAYLOAD] = 60000,
+            [GSM_COMMAND_OTHER] = 500,
+        },
+    },
+    {
+        .model = GSM_QUECTEL_EC2X,
+        .name = "EC2x",
+        .match = "EC2",
+        .baudrate = 115200,
+        .capabilities = GSM_CAP_TEXT | GSM_CAP_PDU,
+        .quirks = GSM_QUIRK_ECHO,
+        .init = quectel_init,
+        .reset_time = 15000,    //the USB ports enumerate again
+        .timeouts = {
+            [GSM_COMMAND_CMGF] = 300,
+            [GSM_COMMAND_CMGS] = 300,
+            [GSM_COMMAND_CMGW] = 300,
+            [GSM_COMMAND_CMSS] = 120000,
+            [GSM_COMMAND_CMGL] = 30000,
+            [GSM_COMMAND_CMGD] = 5000,
+            [GSM_COMMAND_CREG] = 300,
+            [GSM_COMMAND_CSQ] = 300,
+            [GSM_COMMAND_PAYLOAD] = 120000,
+            [GSM_COMMAND_OTHER] = 300,
+        },
+    },
+};
+
+const struct _driver driver = {
+    .lookup = &driver_lookup,
+    .match = &driver_match,
+    .configure = &driver_configure
+};
+
+const struct gsm_driver *driver_lookup (enum gsm_vendor_model model)
+{
+    for (size_t i = 0; i < G_N_ELEMENTS(drivers); i++)
+        if (drivers[i].model == model)
+            return &drivers[i];
+    return NULL;
+}
+
+const struct gsm_driver *driver_match (const char *model)
+{
+    if (model == NULL)
+        return NULL;
+    for (size_t i = 0; i < G_N_ELEMENTS(drivers); i++)
+        if (strstr(model, drivers[i].match) != NULL)
+            return &drivers[i];
+    return NULL;
+}
+
+void driver_configure (const struct gsm_driver *drv, SerialDevice device)
+{
+    if (drv == NULL || device == NULL)
+        return;
+    serial.set_baudrate(device, drv->baudrate);
+    serial.set_parity(device, PARITY_NONE);
+    serial.set_stopbits(device, 1);
+    serial.set_databits(device, 8);
+    serial.set_access_mode(device, ACCESS_READ_WRITE);
+    //breakout boards rarely wire RTS/CTS, no model gets flow control by default
+    serial.set_handshake(device, HANDSHAKE_NONE);
+    serial.set_echo(device, false);
+}
@@ -0,0 +1,49 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_DRIVER_H
+#define GSMAPP_DRIVER_H
+
+#include "gsm.h"
+#include "serial.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum gsm_capability {
+    GSM_CAP_TEXT        = 1 << 0,   //AT+CMGF=1
+    GSM_CAP_PDU         = 1 << 1    //AT+CMGF=0, needed for UCS2 and concatenated messages
+};
+
+enum gsm_quirk {
+    GSM_QUIRK_ECHO      = 1 << 0    //comes out of every reset with echo on
+};
+
+struct gsm_driver {
+    enum gsm_vendor_model model;
+    const char  *name;
+    const char  *match;     //substring of the AT+CGMM reply, or of ATI when it has none
+    uint32_t    baudrate;   //the UART default of the module, nothing sends AT+IPR
+    uint32_t    capabilities;
+    uint32_t    quirks;
+    //sent after every open, before registration, NULL terminated
+    const char  *const *init;
+    //millisecond from AT+CFUN=1,1 until the modem answers on its port again
+    uint32_t    reset_time;
+    //millisecond, the longest the model takes for each command class to finish
+    uint32_t    timeouts[GSM_COMMAND_COUNT];
+};
+
+struct _driver {
+    //NULL for a model without a driver
+    const struct gsm_driver *(* lookup) (enum gsm_vendor_model model);
+    //the driver whose match is in the reply of a probed modem, NULL if none
+    const struct gsm_driver *(* match) (const char *model);
+    //line settings of the driver on a port that is not open yet
+    void (* configure) (const struct gsm_driver *driver, SerialDevice device);
+};
+extern const struct _driver driver;
+
+#endif //GSMAPP_DRIVER_H
@@ -0,0 +1,116 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#include "fleet.h"
+
+#include <glib.h>
+
+//pending messages per modem before front ends push back
+#define DEVICE_HIGH_WATER 16
+
+static void fleet_add (GSMDevice device);
+static void fleet_remove (GSMDevice device);
+static GSMDevice fleet_pick (void);
+static size_t fleet_get_size (void);
+static size_t fleet_get_queue_depth (void);
+static bool fleet_is_saturated (void);
+
+static GPtrArray *devices;
+static GMutex mutex_fleet;
+
+const struct _fleet fleet = {
+    .add = &fleet_add,
+    .remove = &fleet_remove,
+    .pick = &fleet_pick,
+    .get_size = &fleet_get_size,
+    .get_queue_depth = &fleet_get_queue_depth,
+    .is_saturated = &fleet_is_saturated
+};
+
+void fleet_add (GSMDevice device)
+{
+    if (device == NULL)
+        return;
+    g_mutex_lock(&mutex_fleet);
+    if (devices == NULL)
+        devices = g_ptr_array_new();
+    g_ptr_array_add(devices, device);
+    g_mutex_unlock(&mutex_fleet);
+}
+
+void fleet_remove (GSMDevice device)
+{
+    g_mutex_lock(&mutex_fleet);
+    if (devices != NULL)
+        g_ptr_array_remove(devices, device);
+    g_mutex_unlock(&mutex_fleet);
+}
+
+GSMDevice fleet_pick (void)
+{
+    GSMDevice device, best;
+    size_t depth, best_depth;
+    int rank, best_rank;
+
+    best = NULL;
+    best_depth = G_MAXSIZE;
+    best_rank = -1;
+    g_mutex_lock(&mutex_fleet);
+    for (guint i = 0; devices != NULL && i < devices->len; i++) {
+        device = g_ptr_array_index(devices, i);
+        depth = gsm.get_queue_depth(device);
+        //an unplugged modem only gets work when nothing else is there, it runs on reconnect;
+        //a throttled one only when every online modem is at its rate limit
+        rank = (gsm.is_online(device) ? 2 : 0) + (gsm.is_throttled(device) ? 0 : 1);
+        if (rank < best_rank)
+            continue;
+        if (rank > best_rank || depth < best_depth) {
+            best_rank = rank;
+            best = device;
+            best_depth = depth;
+        }
+    }
+    g_mutex_unlock(&mutex_fleet);
+    return best;
+}
+
+size_t fleet_get_size (void)
+{
+    size_t size;
+
+    g_mutex_lock(&mutex_fleet);
+    size = (devices != NULL) ? devices->len : 0;
+    g_mutex_unlock(&mutex_fleet);
+    return size;
+}
+
+size_t fleet_get_queue_depth (void)
+{
+    size_t depth;
+
+    depth = 0;
+    g_mutex_lock(&mutex_fleet);
+    for (guint i = 0; devices != NULL && i < devices->len; i++)
+        depth += gsm.get_queue_depth(g_ptr_array_index(devices, i));
+    g_mutex_unlock(&mutex_fleet);
+    return depth;
+}
+
+bool fleet_is_saturated (void)
+{
+    size_t size, online, depth;
+
+    size = 0;
+    online = 0;
+    depth = 0;
+    g_mutex_lock(&mutex_fleet);
+    for (guint i = 0; devices != NULL && i < devices->len; i++) {
+        depth += gsm.get_queue_depth(g_ptr_array_index(devices, i));
+        online += gsm.is_online(g_ptr_array_index(devices, i));
+        size++;
+    }
+    g_mutex_unlock(&mutex_fleet);
+    //unplugged modems add no capacity, their backlog counts against the others
+    return size > 0 && depth >= online * DEVICE_HIGH_WATER;
+}
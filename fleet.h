@@ -0,0 +1,27 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_FLEET_H
+#define GSMAPP_FLEET_H
+
+#include "gsm.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct _fleet {
+    void        (* add) (GSMDevice device);
+    void        (* remove) (GSMDevice device);
+
+    //least loaded online device, an offline one only if none is online, NULL when empty
+    GSMDevice   (* pick) (void);
+    size_t      (* get_size) (void);
+    size_t      (* get_queue_depth) (void);
+    //pending depth at or above the high-water mark of the online devices
+    bool        (* is_saturated) (void);
+};
+extern const struct _fleet fleet;
+
+#endif //GSMAPP_FLEET_H
@@ -5,6 +5,16 @@
 #include "gsm.h"
 #include "serial.h"
 #include "buffer.h"
+#include "pdu.h"
+#include "dedup.h"
+#include "receipt.h"
+#include "reassembly.h"
+#include "driver.h"
+#include "fleet.h"
+#include "metrics.h"
+#include "logger.h"
+#include "smartpointer.h"
+#include "transaction.h"
 
 
 #include <stdlib.h>
@@ -14,57 +24,332 @@
 #include <glib.h>
 #include <pthread.h>
 #include <time.h>
+#include <stdatomic.h>
+#include <stdarg.h>
 
 #define CMD_MAX_LEN 1024
 #define REPLY_MAX_LEN 4096
+#define SIGNAL_REFRESH_INTERVAL 30000 //millisecond
+#define CLIENT_ID_CAPACITY 16384
+#define CLIENT_ID_WINDOW 600 //second
+#define RECEIPT_CAPACITY 4096
+#define RECEIPT_WINDOW 259200 //second, the validity period networks use by default
+#define REASSEMBLY_CAPACITY 64 //concatenated messages in flight on one SIM
+#define REASSEMBLY_FRAGMENTS 256
+#define REASSEMBLY_TIMEOUT 300 //second
+#define RATE_LIMIT_POLL 10000 //microsecond, longest a throttled scheduler sleeps before looking again
+#define WATCHDOG_TIMEOUTS 3 //in a row, make a modem that still talks suspect
+#define WATCHDOG_RETRY 1000000 //microsecond, between attempts to open the port of a reset modem
+#define REGISTRATION_WAIT 120 //second, for a SIM still searching to report a network
+
+//network state packed in one word: stat:4 lac:16 ci:28 rssi:7 ber:7 valid:1
+#define NETWORK_STAT(X)  ((X) & 0x0F)
+#define NETWORK_LAC(X)   (((X) >> 4) & 0xFFFF)
+#define NETWORK_CI(X)    (((X) >> 20) & 0x0FFFFFFF)
+#define NETWORK_RSSI(X)  (((X) >> 48) & 0x7F)
+#define NETWORK_BER(X)   (((X) >> 55) & 0x7F)
+#define NETWORK_VALID    (UINT64_C(1) << 63)
+#define NETWORK_CELL_MASK UINT64_C(0x0000FFFFFFFFFFFF)
 #define UNUSED(X) (void *)(X)
 typedef struct task* Task;
+typedef struct transaction* Transaction;
+typedef struct bulk_sms* BulkSMS;
+struct token_bucket;
+
+enum watchdog_state {
+    WATCHDOG_IDLE,
+    WATCHDOG_PROBING,   //a bare AT is queued ahead of everything
+    WATCHDOG_RESETTING  //rebooted and closed, the port opens again at reset_until
+};
 
 static GSMDevice gsm_init(const char *port, enum gsm_vendor_model vendor);
 static void gsm_free(GSMDevice *gsm);
-static void send_sms(GSMDevice device, char *message, char *number);
+static SMSHandle send_sms(GSMDevice device, char *message, char *number);
+static SMSHandle send_sms_idempotent(GSMDevice device, const char *client_id, char *message, char *number);
+static SMSHandle send_sms_report(GSMDevice device, char *message, char *number);
+static bool submit_sms(GSMDevice device, SMSHandle handle, const char *message, const char *number,
+                       uint64_t wal_id, bool report);
+static Transaction submission_init (const char *message, const char *number, PduMessage pdu_message,
+                                    bool report);
+static void submission_free (gpointer context);
+static enum tx_await submit_text (GSMDevice device, Transaction tx);
+static enum tx_await submit_pdu (GSMDevice device, Transaction tx);
+static void send_sms_bulk(GSMDevice device, char *message, char **numbers, size_t n,
+                          gsm_bulk_result_cb result, void *user_data);
 static void register_sim (GSMDevice device);
+static void set_inbox_handler (GSMDevice device, gsm_inbox_cb handler, void *user_data);
+static void poll_inbox (GSMDevice device);
+static void set_report_handler (GSMDevice device, gsm_report_cb handler, void *user_data);
+static void set_message_indications (GSMDevice device);
+static bool get_network_state (GSMDevice device, struct gsm_network_state *state);
+static size_t get_queue_depth (GSMDevice device);
+static bool get_stats (GSMDevice device, struct gsm_stats *stats);
+static const char *get_command_name (enum gsm_command command);
+static const char *get_port (GSMDevice device);
+static void latency_snapshot (struct metrics_histogram *histogram, struct gsm_latency *latency);
+static void record_result (GSMDevice device, Task task);
+static void set_wal (GSMDevice device, Wal wal);
+static void set_store (GSMDevice device, Store inbox);
+static void set_trace (GSMDevice device, Trace t);
+static void resubmit_pending (uint64_t id, const char *number, const char *message, void *user_data);
+static void disconnect (GSMDevice device);
+static bool reconnect (GSMDevice device);
+static bool is_online (GSMDevice device);
+static void setup_modem (GSMDevice device);
+static void migrate_tasks (GSMDevice device);
+static void requeue_chain (GSMDevice device, Task head, GSMDevice target);
+static void set_rate_limit (GSMDevice device, const struct gsm_rate_limit *limit);
+static bool is_throttled (GSMDevice device);
+static gint64 take_tokens (GSMDevice device, guint tokens, gint64 now);
+static gint64 bucket_wait (struct token_bucket *bucket, double tokens, gint64 now);
+static bool promote_unmetered (GSMDevice device);
+static bool steer_chain (GSMDevice device);
+static bool close_port (GSMDevice device);
+static void watchdog_check (GSMDevice device, Task task);
+static void watchdog_probed (Task task);
+static void watchdog_reset (GSMDevice device);
+static void watchdog_recover (GSMDevice device);
 
 static gpointer scheduler_init(gpointer data);
-static void gsm_init_ai_a7_a6(GSMDevice device);
-static void read_serial(int fd, uint8_t *data, size_t len);
+static void read_serial(int fd, uint8_t *data, size_t len, void *user_data);
 static void write_cmd(GSMDevice device, const char *cmd);
 
-static void generic_process (Task task);
-static Task create_task (const char *cmd, uint32_t timeout, void (*cb)(Task));
+static Transaction transaction_init (enum tx_await (* run) (GSMDevice device, Transaction tx), size_t context_size,
+                                     GDestroyNotify free_context);
+static void transaction_free (Transaction tx);
+static Task transaction_step (Transaction tx);
+static void tx_command (Transaction tx, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static bool tx_ok (Transaction tx);
+static void start_transaction (GSMDevice device, Transaction tx);
+static bool resume_transaction (GSMDevice device, Task task);
+static bool follow_transaction (GSMDevice device, Transaction tx, enum tx_await await, bool continuing);
+static void park_transaction (GSMDevice device, Transaction tx);
+static bool wake_transactions (GSMDevice device, const char *line);
+static void expire_transactions (GSMDevice device);
+static void resume_parked (GSMDevice device, GQueue *woken);
+static enum tx_await register_run (GSMDevice device, Transaction tx);
+static bool is_registered (GSMDevice device);
+static enum tx_await bulk_run (GSMDevice device, Transaction tx);
+static void bulk_free (gpointer context);
+static enum tx_await inbox_drain (GSMDevice device, Transaction tx);
+static void inbox_line (GSMDevice device, const char *line);
+static void inbox_complete (const struct reassembly_message *message, void *user_data);
+static bool dispatch_urc (GSMDevice device, const char *line);
+static void urc_new_message (GSMDevice device, const char *line);
+static void urc_registration (GSMDevice device, const char *line);
+static void urc_signal (GSMDevice device, const char *line);
+static void urc_status_report (GSMDevice device, const char *line);
+static bool parse_text_report (const char *fields, struct pdu_status_report *report);
+static int64_t parse_text_time (const char *field);
+static void deliver_report (GSMDevice device, const struct pdu_status_report *report);
+static void track_report (GSMDevice device, Task task, const char *number);
+static void update_network_state (GSMDevice device, uint64_t mask, uint64_t value);
+static void refresh_signal (GSMDevice device);
+static Task create_task (const char *cmd, void (*cb)(Task));
+static enum gsm_command classify_command (const char *cmd);
+static void enqueue_chain (GSMDevice device, Task first);
+static GQueue *device_tasks (GSMDevice device);
+static bool pop_prompt (GSMDevice device, char *buf);
+static bool is_final_result (const char *line);
+static void complete_task (GSMDevice device, Task task);
+static void complete_handle (GSMDevice device, Task task);
+static int parse_reply_int (Task task, const char *prefix);
+
+struct command_metrics {
+    _Atomic uint64_t commands;
+    _Atomic uint64_t timeouts;
+    _Atomic uint64_t errors;
+    struct metrics_histogram queued;
+    struct metrics_histogram response;
+};
+
+//refills continuously at rate up to capacity, a capacity of 0 never runs dry
+struct token_bucket {
+    double rate;        //tokens per microsecond
+    double capacity;
+    double tokens;
+    gint64 refill_time; //microsecond
+};
+
+struct device_metrics {
+    _Atomic uint64_t bytes_tx;
+    _Atomic uint64_t bytes_rx;
+    _Atomic uint64_t resets;
+    struct command_metrics commands[GSM_COMMAND_COUNT];
+    _Atomic uint64_t error_codes[GSM_STATS_ERROR_CODES];
+};
 
 struct gsm_device{
     char *port;
     SerialDevice serial;
-    enum gsm_vendor_model vendor;
+    const struct gsm_driver *driver;
 
     GMutex mutex;
+    GMutex port_mutex;                  //opening and closing the port, hotplug and the watchdog both do it
     pthread_t thread;
-    gint *fd;
     Buffer buffer;
+    gint concat_ref;
+
+    gsm_inbox_cb inbox_handler;
+    void *inbox_user_data;
+    gint inbox_pending;
+    gint inbox_index;
+    Reassembly reassembly;      //reader thread only, like inbox_index
+    Store store;
+
+    gsm_report_cb report_handler;
+    void *report_user_data;
+    bool report_pdu_pending;    //a PDU mode +CDS: <length> came, the next line is its PDU
+
+    _Atomic uint64_t network_state;
+    gint64 signal_time;
+    gint sms_pending;
+    Wal wal;
+    struct device_metrics *metrics;
+    GQueue *tasks;
+    GQueue *parked;                     //transactions waiting for an URC, guarded by mutex
+    _Atomic int64_t parked_until;       //microsecond, the first of their timeouts, G_MAXINT64 with none
+    gint online;
+    struct token_bucket rate_second;    //guarded by mutex, like the queue
+    struct token_bucket rate_day;
+    _Atomic int64_t throttled_until;    //microsecond, read without the lock by the fleet
+
+    _Atomic int64_t rx_time;            //microsecond, the last byte from the modem
+    guint timeouts;                     //in a row; scheduler thread only, like the watchdog state
+    enum watchdog_state watchdog;
+    _Atomic int64_t reset_until;        //microsecond, reconnect leaves a rebooting modem alone until then
 };
 
 struct task {
-    GString *request;
+    char *request;
     void (* cb) (Task task);
-    guint32 timeout; //millisecond
+    void (* on_line) (GSMDevice device, const char *line);
+    gpointer context;
+    Transaction transaction; //resumed once this step completes
+    guint tokens; //messages the chain sends, charged to the rate limit before its first step
+    SMSHandle handle;
+    uint64_t wal_id;
+    uint64_t wal_lsn; //journal position to sync before the chain goes out
+    enum gsm_command command;
+    guint32 timeout; //millisecond, from the driver of the device the task is queued on
+    gint64 queued_time; //microsecond
+    gint64 write_time; //microsecond
     guint64 sent_time;
     GString *reply;
     Task next;
     bool is_reply_ok;
     bool is_sent;
+    bool is_done;
+    bool is_cancelled;
+    bool expect_prompt;
+    bool is_committed; //a payload of the chain reached the modem, it can not move anymore
+    bool is_step; //lives in its transaction, request and reply included
+};
+
+/*
+ * A flow of commands run as a coroutine, see transaction.h. Each command it
+ * awaits goes out as one of its two step tasks; the step resumes it when it
+ * completes and the next one goes out at once, before anything else queued.
+ * One holding a handle ends on a command, the handle resolves with that last
+ * step. Nothing is allocated per step, everything lives in its arena.
+ */
+struct transaction {
+    arena_ptr_t storage;    //holds the transaction, its context and their strings
+    uint16_t resume;
+    enum tx_await (* run) (GSMDevice device, Transaction tx);
+    gpointer context;
+    GDestroyNotify free_context; //releases what the context holds outside storage
+    char command[CMD_MAX_LEN]; //sent by the next await
+    struct task steps[2];   //the step in flight and the one that just completed take turns
+    guint slot;
+    void (* on_line) (GSMDevice device, const char *line); //streams the replies of the next command
+    Task step;          //the command that just completed, NULL when resumed without one
+    char *urc;          //the line that ended an URC await, NULL when it timed out, in storage
+    const char *urc_prefix;
+    gint64 deadline;    //microsecond, of the URC await
+    SMSHandle handle;
+    uint64_t wal_id;
+    uint64_t wal_lsn;   //synced before its first command
+    guint sends;        //messages it sends, all charged to the rate limit before its first command
+    guint unpaid;
+    bool is_committed;  //a payload reached the modem, it can not start over elsewhere
 };
 
-GHashTable *task_scheduler;
-GHashTable *task_devices;
-GMutex mutex_scheduler;
-GMutex mutex_devices;
+//the PDU parts are encoded one at a time, right before they go out
+struct submission {
+    PduMessage pdu;         //NULL in text mode
+    size_t part;
+    bool report;
+    char *message;
+    char *number;
+};
+
+//message stored once with AT+CMGW and sent to every recipient with AT+CMSS
+struct bulk_sms {
+    PduMessage pdu;         //NULL in text mode
+    char *message;
+    size_t part_count;
+    gint *index;
+    char **numbers;
+    size_t n;
+    size_t part;
+    size_t recipient;
+    int reference;
+    bool failed;
+    gsm_bulk_result_cb result;
+    void *user_data;
+};
+
+static const char *command_names[GSM_COMMAND_COUNT] = {
+    [GSM_COMMAND_CMGF] = "cmgf",
+    [GSM_COMMAND_CMGS] = "cmgs",
+    [GSM_COMMAND_CMGW] = "cmgw",
+    [GSM_COMMAND_CMSS] = "cmss",
+    [GSM_COMMAND_CMGL] = "cmgl",
+    [GSM_COMMAND_CMGD] = "cmgd",
+    [GSM_COMMAND_CREG] = "creg",
+    [GSM_COMMAND_CSQ] = "csq",
+    [GSM_COMMAND_PAYLOAD] = "payload",
+    [GSM_COMMAND_OTHER] = "other",
+};
+
+static const struct urc_handler {
+    const char *prefix;
+    void (* handle) (GSMDevice device, const char *line);
+} urc_handlers[] = {
+    {"+CMTI:", urc_new_message},
+    {"+CREG:", urc_registration},
+    {"+CSQ:", urc_signal},
+    {"+CDS:", urc_status_report},
+};
+
+Dedup client_ids;
+ReceiptIndex receipts;
 
 const struct _gsm gsm = {
     .init = &gsm_init,
     .free = &gsm_free,
     .send_sms = &send_sms,
-    .register_sim = register_sim
+    .send_sms_idempotent = &send_sms_idempotent,
+    .send_sms_report = &send_sms_report,
+    .send_sms_bulk = &send_sms_bulk,
+    .register_sim = register_sim,
+    .set_inbox_handler = &set_inbox_handler,
+    .poll_inbox = &poll_inbox,
+    .set_report_handler = &set_report_handler,
+    .get_network_state = &get_network_state,
+    .get_queue_depth = &get_queue_depth,
+    .get_stats = &get_stats,
+    .get_command_name = &get_command_name,
+    .get_port = &get_port,
+    .set_wal = &set_wal,
+    .set_store = &set_store,
+    .set_trace = &set_trace,
+    .disconnect = &disconnect,
+    .reconnect = &reconnect,
+    .is_online = &is_online,
+    .set_rate_limit = &set_rate_limit,
+    .is_throttled = &is_throttled
 };
 
 void task_free (Task *task)
@@ -98,36 +383,44 @@ void task_destroy(gpointer value)
     task = (Task)value;
     if (task == NULL)
         return;
+    if (task->handle != NULL)
+        sms_handle.free(&task->handle);
+    //the transaction keeps the memory for a later step
+    if (task->is_step)
+        return;
     if (task->reply != NULL)
-        g_free(task->reply);
-    if (task->request != NULL)
-        g_free(task->request);
+        g_string_free(task->reply, true);
+    g_free(task->request);
     g_free(task);
 }
 
-void hash_key_destroy (gpointer value)
+GQueue *device_tasks (GSMDevice device)
 {
-    if (value != NULL)
-        g_free(value);
+    return device->tasks;
 }
 
-void hash_value_destroy (gpointer value)
+bool pop_prompt (GSMDevice device, char *buf)
 {
-    GQueue *tasks;
+    GQueue  *tasks;
+    Task    task;
+    bool    expected;
 
-    tasks = (GQueue *)value;
+    //the "> " prompt is not followed by a line break, so pop_break never returns it
+    buffer.peek(device->buffer, buf, 3);
+    if (buf[0] != '>')
+        return false;
+    tasks = device_tasks(device);
     if (tasks == NULL)
-        return;
-    g_queue_free_full(tasks, task_destroy);
-}
-
-void hash_device_destroy (gpointer value)
-{
-    GSMDevice device;
-
-    device = (GSMDevice)value;
-    if (device != NULL)
-        gsm_free(&device);
+        return false;
+    g_mutex_lock(&device->mutex);
+    task = (Task)g_queue_peek_head(tasks);
+    expected = (task != NULL && task->is_sent && !task->is_done && task->expect_prompt);
+    g_mutex_unlock(&device->mutex);
+    if (!expected)
+        return false;
+    buffer.pop_len(device->buffer, buf, strnlen(buf, 2));
+    g_strlcpy(buf, ">", REPLY_MAX_LEN);
+    return true;
 }
 
 void *buffer_process (void *device_pointer)
@@ -136,6 +429,8 @@ void *buffer_process (void *device_pointer)
     GQueue  *tasks;
     Task    task;
     char    buf[REPLY_MAX_LEN];
+    char    line[REPLY_MAX_LEN];
+    void    (* on_line) (GSMDevice device, const char *line);
 
     if (device == NULL)
         return NULL;
@@ -144,84 +439,393 @@ void *buffer_process (void *device_pointer)
     while (true){
         memset(buf,0,REPLY_MAX_LEN);
         buffer.pop_break(device->buffer, buf);
-        if (strnlen(buf,REPLY_MAX_LEN))
-            printf("buffer_process2: %s\n",buf);
-        if (strnlen(buf,REPLY_MAX_LEN) == 0){
+        if (strnlen(buf,REPLY_MAX_LEN) == 0 && !pop_prompt(device, buf)){
+            //concatenated messages whose last parts never came go out from here
+            reassembly.expire(device->reassembly, g_get_monotonic_time());
             g_usleep(1000 * 1);
             continue;
         }
-        g_mutex_lock(&mutex_scheduler);
-        tasks = (GQueue *)g_hash_table_lookup(task_scheduler, device->fd);
-        g_mutex_unlock(&mutex_scheduler);
+        LOG_TRACE("rx line %s: %s", device->port, buf);
+        g_strlcpy(line, buf, REPLY_MAX_LEN);
+        g_strstrip(line);
+        if (strnlen(line, REPLY_MAX_LEN) == 0)
+            continue;
+        if (dispatch_urc(device, line))
+            continue;
+        tasks = device_tasks(device);
         if (tasks == NULL)
             continue;
         g_mutex_lock(&device->mutex);
         task = (Task)g_queue_peek_head(tasks);
-        if (task == NULL) {
+        if (task == NULL || !task->is_sent || task->is_done) {
             g_mutex_unlock(&device->mutex);
-            g_usleep(1000 * 10);
             continue;
         }
-        if (!task->is_sent){
+        //streaming tasks consume intermediate lines as they arrive instead of buffering them
+        if (task->on_line != NULL && !is_final_result(line)) {
+            on_line = task->on_line;
             g_mutex_unlock(&device->mutex);
-            g_usleep(1000 * 10);
+            on_line(device, line);
             continue;
         }
         if (task->reply == NULL)
             task->reply = g_string_new(buf);
         else
             g_string_append(task->reply,buf);
+        if (task->expect_prompt && line[0] == '>') {
+            task->is_done = true;
+            task->is_reply_ok = true;
+        } else if (is_final_result(line)) {
+            task->is_done = true;
+            task->is_reply_ok = (strcmp(line, "OK") == 0);
+        }
         g_mutex_unlock(&device->mutex);
-        g_string_ascii_up(task->reply);
-        task->is_reply_ok = (g_strstr_len(task->reply->str,
-                                          (gssize)task->reply->len,"OK") != NULL);
-        if (task->cb != NULL)
-            task->cb(task);
-
     }
     return NULL;
 }
 
+void complete_task (GSMDevice device, Task task)
+{
+    Transaction tx;
+    bool running;
+
+    if (task->cb != NULL)
+        task->cb(task);
+    record_result(device, task);
+    //a transaction looks at the step itself and goes on, its handle resolves when it ends
+    tx = task->transaction;
+    running = tx != NULL && resume_transaction(device, task);
+    if (task->handle != NULL && !running)
+        complete_handle(device, task);
+    //a failed step leaves the modem in an unknown state for the rest of the chain
+    if (!task->is_reply_ok) {
+        g_mutex_lock(&device->mutex);
+        for (Task next = task->next; next != NULL; next = next->next)
+            next->is_cancelled = true;
+        g_mutex_unlock(&device->mutex);
+    }
+    watchdog_check(device, task);
+    task_destroy(task);
+    //after the step, it lives in the transaction
+    if (tx != NULL && !running)
+        transaction_free(tx);
+}
+
+//the transaction, a zeroed context of context_size bytes and their strings share one arena
+Transaction transaction_init (enum tx_await (* run) (GSMDevice device, Transaction tx), size_t context_size,
+                              GDestroyNotify free_context)
+{
+    arena_ptr_t storage;
+    Transaction tx;
+
+    storage = smartpointer.arena_ptr_make(0);
+    tx = smartpointer.arena_alloc(storage, sizeof(struct transaction));
+    g_assert(tx != NULL);
+    if (tx == NULL) {
+        arena_ptr_destroy(&storage);
+        return NULL;
+    }
+    memset(tx, 0, sizeof(struct transaction));
+    tx->storage = storage;
+    tx->run = run;
+    if (context_size > 0) {
+        tx->context = smartpointer.arena_alloc(storage, context_size);
+        g_assert(tx->context != NULL);
+        if (tx->context == NULL) {
+            arena_ptr_destroy(&storage);
+            return NULL;
+        }
+        memset(tx->context, 0, context_size);
+    }
+    tx->free_context = free_context;
+    return tx;
+}
+
+void transaction_free (Transaction tx)
+{
+    arena_ptr_t storage;
+
+    if (tx->free_context != NULL)
+        tx->free_context(tx->context);
+    if (tx->handle != NULL)
+        sms_handle.free(&tx->handle);
+    for (size_t i = 0; i < G_N_ELEMENTS(tx->steps); i++)
+        if (tx->steps[i].reply != NULL)
+            g_string_free(tx->steps[i].reply, true);
+    storage = tx->storage;
+    arena_ptr_destroy(&storage);
+}
+
+//the step that completed before the previous one is done with, its slot and reply buffer are reused
+Task transaction_step (Transaction tx)
+{
+    GString *reply;
+    Task task;
+
+    tx->slot ^= 1;
+    task = &tx->steps[tx->slot];
+    reply = task->reply;
+    memset(task, 0, sizeof(struct task));
+    if (reply != NULL)
+        g_string_truncate(reply, 0);
+    task->reply = reply;
+    task->request = tx->command;
+    task->command = classify_command(tx->command);
+    task->is_step = true;
+    return task;
+}
+
+void tx_command (Transaction tx, const char *format, ...)
+{
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(tx->command, sizeof(tx->command), format, args);
+    va_end(args);
+    g_assert(len >= 0 && (size_t)len < sizeof(tx->command));
+}
+
+//the command just awaited got OK, or the prompt it waited for
+bool tx_ok (Transaction tx)
+{
+    return tx->step != NULL && tx->step->is_reply_ok;
+}
+
+//runs up to the first await on the calling thread
+void start_transaction (GSMDevice device, Transaction tx)
+{
+    enum tx_await await;
+
+    if (tx == NULL)
+        return;
+    tx->unpaid = tx->sends;
+    tx->step = NULL;
+    await = tx->run(device, tx);
+    if (!follow_transaction(device, tx, await, false))
+        transaction_free(tx);
+}
+
+//scheduler thread, task has just left the queue; false once the transaction is over
+bool resume_transaction (GSMDevice device, Task task)
+{
+    Transaction tx;
+    enum tx_await await;
+
+    tx = task->transaction;
+    tx->step = task;
+    await = tx->run(device, tx);
+    tx->step = NULL;
+    return follow_transaction(device, tx, await, true);
+}
+
+/*
+ * Queues the command the transaction awaits, or parks it until its URC.
+ * A command right after one that completed goes ahead of everything, the
+ * way the steps of a chain follow each other; otherwise it waits its turn.
+ */
+bool follow_transaction (GSMDevice device, Transaction tx, enum tx_await await, bool continuing)
+{
+    Task task;
+
+    if (await == TX_DONE)
+        return false;
+    if (await == TX_AWAIT_URC) {
+        park_transaction(device, tx);
+        return true;
+    }
+    task = transaction_step(tx);
+    task->transaction = tx;
+    task->expect_prompt = (await == TX_AWAIT_PROMPT);
+    task->on_line = tx->on_line;
+    tx->on_line = NULL;
+    task->is_committed = tx->is_committed;
+    if (tx->handle != NULL)
+        task->handle = sms_handle.ref(tx->handle);
+    task->wal_id = tx->wal_id;
+    task->wal_lsn = tx->wal_lsn;
+    tx->wal_lsn = 0;
+    if (!continuing || await == TX_AWAIT_TURN) {
+        enqueue_chain(device, task);
+        return true;
+    }
+    task->timeout = device->driver->timeouts[task->command];
+    task->queued_time = g_get_monotonic_time();
+    g_mutex_lock(&device->mutex);
+    g_queue_push_head(device->tasks, task);
+    g_mutex_unlock(&device->mutex);
+    return true;
+}
+
+//the transaction set urc_prefix and deadline, it holds no place in the queue meanwhile
+void park_transaction (GSMDevice device, Transaction tx)
+{
+    g_mutex_lock(&device->mutex);
+    g_queue_push_tail(device->parked, tx);
+    if (tx->deadline < atomic_load_explicit(&device->parked_until, memory_order_relaxed))
+        atomic_store_explicit(&device->parked_until, tx->deadline, memory_order_relaxed);
+    g_mutex_unlock(&device->mutex);
+}
+
+//reader thread, true when line was for a waiting transaction
+bool wake_transactions (GSMDevice device, const char *line)
+{
+    GQueue woken = G_QUEUE_INIT;
+    GList *link, *next;
+    Transaction tx;
+    gint64 until;
+
+    if (atomic_load_explicit(&device->parked_until, memory_order_relaxed) == G_MAXINT64)
+        return false;
+    until = G_MAXINT64;
+    g_mutex_lock(&device->mutex);
+    for (link = device->parked->head; link != NULL; link = next) {
+        next = link->next;
+        tx = (Transaction)link->data;
+        if (g_str_has_prefix(line, tx->urc_prefix)) {
+            g_queue_unlink(device->parked, link);
+            g_queue_push_tail_link(&woken, link);
+            tx->urc = smartpointer.arena_strdup(tx->storage, line);
+            g_assert(tx->urc != NULL);
+        } else {
+            until = MIN(until, tx->deadline);
+        }
+    }
+    atomic_store_explicit(&device->parked_until, until, memory_order_relaxed);
+    g_mutex_unlock(&device->mutex);
+    if (g_queue_is_empty(&woken))
+        return false;
+    resume_parked(device, &woken);
+    return true;
+}
+
+//scheduler thread, resumes the transactions whose URC did not come in time
+void expire_transactions (GSMDevice device)
+{
+    GQueue woken = G_QUEUE_INIT;
+    GList *link, *next;
+    Transaction tx;
+    gint64 now, until;
+
+    now = g_get_monotonic_time();
+    until = G_MAXINT64;
+    g_mutex_lock(&device->mutex);
+    for (link = device->parked->head; link != NULL; link = next) {
+        next = link->next;
+        tx = (Transaction)link->data;
+        if (tx->deadline <= now) {
+            g_queue_unlink(device->parked, link);
+            g_queue_push_tail_link(&woken, link);
+        } else {
+            until = MIN(until, tx->deadline);
+        }
+    }
+    atomic_store_explicit(&device->parked_until, until, memory_order_relaxed);
+    g_mutex_unlock(&device->mutex);
+    resume_parked(device, &woken);
+}
+
+//what they await next waits behind the work queued meanwhile
+void resume_parked (GSMDevice device, GQueue *woken)
+{
+    enum tx_await await;
+    Transaction tx;
+
+    while ((tx = (Transaction)g_queue_pop_head(woken)) != NULL) {
+        await = tx->run(device, tx);
+        tx->urc = NULL;
+        if (!follow_transaction(device, tx, await, false))
+            transaction_free(tx);
+    }
+}
+
 void *scheduler_task (void *device_pointer)
 {
     GSMDevice device = (GSMDevice)device_pointer;
     GQueue  *tasks;
     Task    task;
+    uint64_t lsn;
+    gint64  now, wait;
+    bool    promoted;
+    struct command_metrics *command;
 
     if (device == NULL)
         return NULL;
     while (true) {
-        g_mutex_lock(&mutex_scheduler);
-        tasks = (GQueue *)g_hash_table_lookup(task_scheduler, device->fd);
-        g_mutex_unlock(&mutex_scheduler);
-        if (tasks == NULL)
+        if (device->watchdog == WATCHDOG_RESETTING)
+            watchdog_recover(device);
+        if (g_get_monotonic_time() >= atomic_load_explicit(&device->parked_until, memory_order_relaxed))
+            expire_transactions(device);
+        tasks = device_tasks(device);
+        if (tasks == NULL) {
+            g_usleep(1000 * 10);
             continue;
+        }
         g_mutex_lock(&device->mutex);
         task = (Task)g_queue_peek_head(tasks);
         if (task == NULL) {
             g_mutex_unlock(&device->mutex);
+            if (g_atomic_int_get(&device->online))
+                refresh_signal(device);
             g_usleep(1000 * 10);
             continue;
         }
-        if (task->is_sent) {
-            //remove sent task after timeout
+        //nothing new goes out while the port is gone, the task waits for reconnect
+        if (!task->is_sent && !g_atomic_int_get(&device->online)) {
             g_mutex_unlock(&device->mutex);
+            g_usleep(1000 * 10);
             continue;
         }
-        if (!task->is_sent) {
-            struct timespec t;
-            Task tmp;
-
-            write_cmd(device, task->request->str);
-            if (clock_gettime(CLOCK_REALTIME,&t) == 0)
-                task->sent_time = t.tv_nsec / 1000000;//ms
-            task->is_sent = true;
+        //a throttled chain waits at its first step, unmetered work behind it goes first
+        if (!task->is_sent && !task->is_cancelled && task->tokens > 0) {
+            wait = take_tokens(device, task->tokens, g_get_monotonic_time());
+            if (wait > 0) {
+                promoted = promote_unmetered(device);
+                g_mutex_unlock(&device->mutex);
+                if (!promoted && !steer_chain(device))
+                    g_usleep((gulong)MIN(wait, RATE_LIMIT_POLL));
+                continue;
+            }
+            task->tokens = 0;
+        }
+        //a journaled message reaches the modem only once its submission is durable
+        if (!task->is_sent && task->wal_lsn != 0) {
+            lsn = task->wal_lsn;
+            task->wal_lsn = 0;
             g_mutex_unlock(&device->mutex);
-            while (true){
-                g_usleep(100);
-                
+            wal.sync(device->wal, lsn);
+            continue;
+        }
+        if (!task->is_sent && !task->is_cancelled) {
+            now = g_get_monotonic_time();
+            command = &device->metrics->commands[task->command];
+            atomic_fetch_add_explicit(&command->commands, 1, memory_order_relaxed);
+            metrics.record(&command->queued, (uint64_t)(now - task->queued_time));
+            write_cmd(device, task->request);
+            if (task->handle != NULL)
+                sms_handle.mark_sent(task->handle);
+            if (task->command == GSM_COMMAND_PAYLOAD) {
+                for (Task next = task; next != NULL; next = next->next)
+                    next->is_committed = true;
+                if (task->transaction != NULL)
+                    task->transaction->is_committed = true;
             }
+            task->write_time = now;
+            task->sent_time = now / 1000;//ms
+            task->is_sent = true;
+            g_mutex_unlock(&device->mutex);
+            continue;
+        }
+        if (task->is_sent && !task->is_done &&
+            g_get_monotonic_time() / 1000 - task->sent_time < task->timeout) {
+            g_mutex_unlock(&device->mutex);
+            g_usleep(1000);
+            continue;
         }
+        //final result, timeout or cancellation: the task leaves the queue
+        g_queue_pop_head(tasks);
+        g_mutex_unlock(&device->mutex);
+        complete_task(device, task);
     }
     return NULL;
 }
@@ -229,17 +833,9 @@ void *scheduler_task (void *device_pointer)
 gpointer scheduler_init(gpointer data)
 {
     UNUSED(data);
-    printf("scheduler_init\n");
-    task_scheduler = g_hash_table_new_full (g_int_hash,
-                                           g_int_equal,
-                                           (GDestroyNotify) hash_key_destroy,
-                                           (GDestroyNotify) hash_value_destroy);
-    task_devices = g_hash_table_new_full(g_int_hash,
-                                         g_int_equal,
-                                         (GDestroyNotify)hash_key_destroy,
-                                         (GDestroyNotify) hash_device_destroy);
-    g_mutex_init(&mutex_scheduler);
-    g_mutex_init(&mutex_devices);
+    LOG_DEBUG("scheduler_init");
+    client_ids = dedup.init(CLIENT_ID_CAPACITY, CLIENT_ID_WINDOW);
+    receipts = receipt.init(RECEIPT_CAPACITY, RECEIPT_WINDOW);
     return NULL;
 }
 
@@ -248,52 +844,403 @@ GSMDevice gsm_init(const char *port, enum gsm_vendor_model vendor)
     struct gsm_device *gsm_dev = calloc(sizeof (struct gsm_device), 1);
     if (gsm_dev != NULL) {
         gsm_dev->port = strdup(port);
+        gsm_dev->metrics = g_new0(struct device_metrics, 1);
         gsm_dev->serial = serial.init(port);
         if (gsm_dev->serial == NULL) {
             gsm_free(&gsm_dev);
             return NULL;
         }
-        switch (vendor) {
-            case GSM_AI_A6:
-            case GSM_AI_A7:
-                gsm_init_ai_a7_a6(gsm_dev);
-                break;
+        gsm_dev->driver = driver.lookup(vendor);
+        if (gsm_dev->driver == NULL) {
+            LOG_ERROR("gsm %s: no driver for model 0x%04x", port, (unsigned)vendor);
+            gsm_free(&gsm_dev);
+            return NULL;
         }
-        gsm_dev->vendor = vendor;
-        serial.open(gsm_dev->serial);
-        serial.enable_async(gsm_dev->serial,read_serial);
+        driver.configure(gsm_dev->driver, gsm_dev->serial);
         static GOnce once = G_ONCE_INIT;
         g_once(&once, scheduler_init, NULL);
         g_mutex_init(&gsm_dev->mutex);
-        gsm_dev->fd = g_new(gint,1);
-        if (gsm_dev->fd == NULL) {
-            gsm_free(&gsm_dev);
-            exit(EXIT_FAILURE);
-        }
-        *gsm_dev->fd = serial.get_file_descriptor (gsm_dev->serial);
-        if (task_devices != NULL) {
-            g_mutex_lock(&mutex_devices);
-            g_hash_table_insert(task_devices, gsm_dev->fd,gsm_dev);
-            g_mutex_unlock(&mutex_devices);
-        }
+        g_mutex_init(&gsm_dev->port_mutex);
+        gsm_dev->tasks = g_queue_new();
+        gsm_dev->parked = g_queue_new();
+        gsm_dev->parked_until = G_MAXINT64;
         gsm_dev->buffer = buffer.init(REPLY_MAX_LEN);
+        gsm_dev->reassembly = reassembly.init(REASSEMBLY_CAPACITY, REASSEMBLY_FRAGMENTS,
+                                              REASSEMBLY_TIMEOUT, inbox_complete, gsm_dev);
+        serial.open(gsm_dev->serial);
+        //a port that is not there yet starts offline until reconnect opens it
+        gsm_dev->online = (serial.get_file_descriptor(gsm_dev->serial) > 0);
+        //the reader hands its chunks straight to this device, it must be complete by now
+        serial.enable_async(gsm_dev->serial, read_serial, gsm_dev);
         pthread_create(&gsm_dev->thread,NULL,scheduler_task,gsm_dev);
         pthread_create(&gsm_dev->thread,NULL,buffer_process,gsm_dev);
+        if (gsm_dev->online)
+            setup_modem(gsm_dev);
+        else
+            LOG_WARN("gsm %s: cannot open, waiting for the port", port);
     }
     return gsm_dev;
 }
 
-void gsm_init_ai_a7_a6(GSMDevice device)
+void setup_modem (GSMDevice device)
+{
+    Task head, tail;
+
+    head = NULL;
+    tail = NULL;
+    if (device->driver->quirks & GSM_QUIRK_ECHO)
+        head = tail = create_task("ATE0",NULL);
+    for (size_t i = 0; device->driver->init[i] != NULL; i++) {
+        if (tail == NULL)
+            head = tail = create_task(device->driver->init[i],NULL);
+        else
+            tail = tail->next = create_task(device->driver->init[i],NULL);
+    }
+    if (head != NULL)
+        enqueue_chain(device, head);
+    //registration and cell changes are pushed as +CREG URCs from now on
+    enqueue_chain(device, create_task("AT+CREG=2",NULL));
+    register_sim(device);
+    device->report_pdu_pending = false;
+    if (device->inbox_handler != NULL || device->report_handler != NULL)
+        set_message_indications(device);
+    if (device->inbox_handler != NULL)
+        poll_inbox(device);
+}
+
+bool is_online (GSMDevice device)
+{
+    if (device == NULL)
+        return false;
+    return g_atomic_int_get(&device->online) != 0;
+}
+
+void disconnect (GSMDevice device)
+{
+    if (device == NULL)
+        return;
+    if (close_port(device))
+        LOG_WARN("gsm %s: port gone", device->port);
+}
+
+//false if it was closed already
+bool close_port (GSMDevice device)
+{
+    g_mutex_lock(&device->port_mutex);
+    if (!g_atomic_int_compare_and_exchange(&device->online, 1, 0)) {
+        g_mutex_unlock(&device->port_mutex);
+        return false;
+    }
+    serial.disable_async(device->serial);
+    serial.close(device->serial);
+    g_mutex_unlock(&device->port_mutex);
+    migrate_tasks(device);
+    return true;
+}
+
+bool reconnect (GSMDevice device)
+{
+    if (device == NULL)
+        return false;
+    //the loop and the scheduler thread may both try, the second one finds it online
+    g_mutex_lock(&device->port_mutex);
+    if (g_atomic_int_get(&device->online)) {
+        g_mutex_unlock(&device->port_mutex);
+        return true;
+    }
+    if (g_get_monotonic_time() < atomic_load_explicit(&device->reset_until, memory_order_relaxed)) {
+        g_mutex_unlock(&device->port_mutex);
+        return false;
+    }
+    serial.open(device->serial);
+    if (serial.get_file_descriptor(device->serial) <= 0) {
+        g_mutex_unlock(&device->port_mutex);
+        return false;
+    }
+    //whatever was half received from the old port means nothing now
+    buffer.clear(device->buffer);
+    serial.enable_async(device->serial, read_serial, device);
+    g_atomic_int_set(&device->online, 1);
+    g_mutex_unlock(&device->port_mutex);
+    LOG_INFO("gsm %s: port back", device->port);
+    //the modem rebooted with its defaults
+    setup_modem(device);
+    return true;
+}
+
+/*
+ * Submissions that have not written a payload yet move to the least loaded
+ * online device. A chain that already sent a part stays, its in-flight step
+ * expires now with an unknown outcome rather than risking a second copy.
+ * Bulk and inbox work refers to this SIM's storage and waits for reconnect.
+ */
+void migrate_tasks (GSMDevice device)
+{
+    GQueue moved = G_QUEUE_INIT;
+    GSMDevice target;
+    GList *link, *next;
+    Task task, prev, head;
+    bool moving;
+
+    target = fleet.pick();
+    if (target == NULL || target == device || !is_online(target))
+        target = NULL;
+    prev = NULL;
+    moving = false;
+    g_mutex_lock(&device->mutex);
+    for (link = device->tasks->head; link != NULL; link = next) {
+        next = link->next;
+        task = link->data;
+        //chains are queued back to back, a task starts one unless its predecessor links to it
+        if (prev == NULL || prev->next != task)
+            //a payload waiting for its prompt belongs to the dead port
+            moving = target != NULL && task->handle != NULL && !task->is_committed && !task->is_cancelled &&
+                     task->command != GSM_COMMAND_PAYLOAD;
+        prev = task;
+        if (moving) {
+            g_queue_unlink(device->tasks, link);
+            g_queue_push_tail_link(&moved, link);
+        } else if (task->is_sent && !task->is_done) {
+            task->timeout = 0;
+        }
+    }
+    g_mutex_unlock(&device->mutex);
+    while (!g_queue_is_empty(&moved)) {
+        head = g_queue_pop_head(&moved);
+        for (task = head; task->next != NULL; task = task->next)
+            g_queue_pop_head(&moved);
+        target = fleet.pick();
+        if (target == NULL || !is_online(target))
+            target = device;
+        requeue_chain(device, head, target);
+    }
+}
+
+//head is the step of a submission, already out of the queue of device
+void requeue_chain (GSMDevice device, Task head, GSMDevice target)
+{
+    Transaction tx;
+
+    tx = head->transaction;
+    head->transaction = NULL;
+    //not synced yet, the first step on the new port waits for it
+    tx->wal_lsn = head->wal_lsn;
+    task_destroy(head);
+    g_atomic_int_add(&device->sms_pending, -1);
+    g_atomic_int_inc(&target->sms_pending);
+    //nothing it sent so far matters, it starts over on the new modem and sets the message mode there
+    tx->resume = 0;
+    start_transaction(target, tx);
+    LOG_DEBUG("gsm %s: submission moved to %s", device->port, target->port);
+}
+
+/*
+ * A command that expired without a byte from the modem since it was written,
+ * or a run of expired commands, makes the modem suspect. A bare AT goes out
+ * ahead of everything queued; answered at all, the modem is fine. Otherwise
+ * it is rebooted and its port closed, which moves its waiting submissions to
+ * healthy devices. A wedged modem is left at most the timeout of the stuck
+ * command plus one short probe. Runs on the scheduler thread.
+ */
+void watchdog_check (GSMDevice device, Task task)
+{
+    Task probe;
+
+    if (!task->is_sent || device->watchdog != WATCHDOG_IDLE || !is_online(device))
+        return;
+    if (task->is_done) {
+        device->timeouts = 0;
+        return;
+    }
+    if (atomic_load_explicit(&device->rx_time, memory_order_relaxed) >= task->write_time &&
+        ++device->timeouts < WATCHDOG_TIMEOUTS)
+        return;
+    LOG_WARN("gsm %s: %s timed out, probing the modem", device->port, get_command_name(task->command));
+    device->watchdog = WATCHDOG_PROBING;
+    device->timeouts = 0;
+    probe = create_task("AT", watchdog_probed);
+    probe->context = device;
+    probe->timeout = device->driver->timeouts[GSM_COMMAND_OTHER];
+    probe->queued_time = g_get_monotonic_time();
+    //the queue head is the rest of the expired chain, cancelled already
+    g_mutex_lock(&device->mutex);
+    g_queue_push_head(device->tasks, probe);
+    g_mutex_unlock(&device->mutex);
+}
+
+void watchdog_probed (Task task)
+{
+    GSMDevice device;
+
+    device = (GSMDevice)task->context;
+    //even an ERROR shows the command interpreter is alive
+    if (task->is_done) {
+        LOG_INFO("gsm %s: modem answers", device->port);
+        device->watchdog = WATCHDOG_IDLE;
+        return;
+    }
+    watchdog_reset(device);
+}
+
+void watchdog_reset (GSMDevice device)
+{
+    gint64 until;
+
+    //unplugged while probing, hotplug brings it back
+    if (!is_online(device)) {
+        device->watchdog = WATCHDOG_IDLE;
+        return;
+    }
+    LOG_ERROR("gsm %s: modem stalled, resetting it", device->port);
+    atomic_fetch_add_explicit(&device->metrics->resets, 1, memory_order_relaxed);
+    //a modem that still reads its port reboots, one that does not gets a fresh port at least
+    write_cmd(device, "AT+CFUN=1,1");
+    until = g_get_monotonic_time() + (gint64)device->driver->reset_time * 1000;
+    atomic_store_explicit(&device->reset_until, until, memory_order_relaxed);
+    device->watchdog = WATCHDOG_RESETTING;
+    close_port(device);
+}
+
+void watchdog_recover (GSMDevice device)
+{
+    gint64 now;
+
+    now = g_get_monotonic_time();
+    if (now < atomic_load_explicit(&device->reset_until, memory_order_relaxed))
+        return;
+    //true as well when hotplug opened it first
+    if (reconnect(device)) {
+        device->watchdog = WATCHDOG_IDLE;
+        return;
+    }
+    //a USB modem takes its time to come back
+    atomic_store_explicit(&device->reset_until, now + WATCHDOG_RETRY, memory_order_relaxed);
+}
+
+void set_rate_limit (GSMDevice device, const struct gsm_rate_limit *limit)
 {
+    gint64 now;
+
     if (device == NULL)
         return;
-    serial.set_baudrate(device->serial, 115200);
-    serial.set_parity(device->serial, PARITY_NONE);
-    serial.set_stopbits(device->serial, 1);
-    serial.set_databits(device->serial, 8);
-    serial.set_access_mode(device->serial, ACCESS_READ_WRITE);
-    serial.set_handshake(device->serial, HANDSHAKE_NONE);
-    serial.set_echo(device->serial,false);
+    now = g_get_monotonic_time();
+    g_mutex_lock(&device->mutex);
+    memset(&device->rate_second, 0, sizeof(struct token_bucket));
+    memset(&device->rate_day, 0, sizeof(struct token_bucket));
+    if (limit != NULL && limit->per_second > 0) {
+        device->rate_second.rate = limit->per_second / G_USEC_PER_SEC;
+        device->rate_second.capacity = MAX(limit->burst, 1);
+    }
+    if (limit != NULL && limit->per_day > 0) {
+        device->rate_day.rate = (double)limit->per_day / (86400.0 * G_USEC_PER_SEC);
+        device->rate_day.capacity = limit->per_day;
+    }
+    //a new limit starts with a full allowance
+    device->rate_second.tokens = device->rate_second.capacity;
+    device->rate_second.refill_time = now;
+    device->rate_day.tokens = device->rate_day.capacity;
+    device->rate_day.refill_time = now;
+    atomic_store_explicit(&device->throttled_until, 0, memory_order_relaxed);
+    g_mutex_unlock(&device->mutex);
+}
+
+bool is_throttled (GSMDevice device)
+{
+    if (device == NULL)
+        return false;
+    return g_get_monotonic_time() < atomic_load_explicit(&device->throttled_until, memory_order_relaxed);
+}
+
+//0 when the tokens were taken, otherwise microseconds until they are there; called with the lock
+gint64 take_tokens (GSMDevice device, guint tokens, gint64 now)
+{
+    gint64 wait;
+
+    wait = MAX(bucket_wait(&device->rate_second, tokens, now), bucket_wait(&device->rate_day, tokens, now));
+    if (wait == 0) {
+        //a chain longer than the burst runs once the bucket is full and leaves it in debt
+        device->rate_second.tokens -= tokens;
+        device->rate_day.tokens -= tokens;
+    }
+    atomic_store_explicit(&device->throttled_until,
+                          now + MAX(bucket_wait(&device->rate_second, 1, now),
+                                    bucket_wait(&device->rate_day, 1, now)),
+                          memory_order_relaxed);
+    return wait;
+}
+
+gint64 bucket_wait (struct token_bucket *bucket, double tokens, gint64 now)
+{
+    if (bucket->capacity <= 0)
+        return 0;
+    bucket->tokens = MIN(bucket->capacity, bucket->tokens + (double)(now - bucket->refill_time) * bucket->rate);
+    bucket->refill_time = now;
+    tokens = MIN(tokens, bucket->capacity);
+    if (bucket->tokens >= tokens)
+        return 0;
+    return (gint64)((tokens - bucket->tokens) / bucket->rate) + 1;
+}
+
+/*
+ * Moves the first chain that sends nothing in front of the throttled head,
+ * so registration, signal and inbox work keep going while messages wait.
+ * Chains are queued back to back and every one of them sets its own mode.
+ */
+bool promote_unmetered (GSMDevice device)
+{
+    GQueue chain = G_QUEUE_INIT;
+    GList *link, *next;
+    Task task, prev;
+    bool found;
+
+    prev = NULL;
+    found = false;
+    for (link = device->tasks->head; link != NULL; link = next) {
+        next = link->next;
+        task = link->data;
+        if (prev == NULL || prev->next != task) {
+            if (found)
+                break;
+            found = (prev != NULL && task->tokens == 0 && !task->is_sent);
+        }
+        prev = task;
+        if (found) {
+            g_queue_unlink(device->tasks, link);
+            g_queue_push_tail_link(&chain, link);
+        }
+    }
+    if (!found)
+        return false;
+    while ((link = g_queue_pop_tail_link(&chain)) != NULL)
+        g_queue_push_head_link(device->tasks, link);
+    return true;
+}
+
+//hands a throttled submission to a device that can send it now
+bool steer_chain (GSMDevice device)
+{
+    GSMDevice target;
+    GList *link;
+    Task head;
+
+    target = fleet.pick();
+    if (target == NULL || target == device || !is_online(target) || is_throttled(target))
+        return false;
+    g_mutex_lock(&device->mutex);
+    head = g_queue_peek_head(device->tasks);
+    //the same rules as a migration, only untouched submissions move
+    if (head == NULL || head->is_sent || head->is_cancelled || head->is_committed || head->handle == NULL ||
+        head->tokens == 0 || head->command == GSM_COMMAND_PAYLOAD) {
+        g_mutex_unlock(&device->mutex);
+        return false;
+    }
+    for (Task task = head; task != NULL; task = task->next) {
+        link = g_queue_pop_head_link(device->tasks);
+        g_list_free_1(link);
+    }
+    g_mutex_unlock(&device->mutex);
+    requeue_chain(device, head, target);
+    return true;
 }
 
 void gsm_free(GSMDevice *gsm_device)
@@ -302,6 +1249,8 @@ void gsm_free(GSMDevice *gsm_device)
         if ((*gsm_device)->port != NULL)
             free((*gsm_device)->port);
         (*gsm_device)->port = NULL;
+        g_free((*gsm_device)->metrics);
+        reassembly.free(&(*gsm_device)->reassembly);
         if ((*gsm_device)->serial != NULL){
             serial.close((*gsm_device)->serial);
             serial.free(&((*gsm_device)->serial));
@@ -311,111 +1260,902 @@ void gsm_free(GSMDevice *gsm_device)
     gsm_device = NULL;
 }
 
-void send_sms(GSMDevice device, char *message, char *number)
+SMSHandle send_sms(GSMDevice device, char *message, char *number)
 {
-    Task task1, task2, task3;
-    GQueue *tasks;
-    GString *cmgs, *msg;
+    SMSHandle handle;
+
+    g_assert(device != NULL);
+    if (device == NULL)
+        return NULL;
+    handle = sms_handle.init();
+    if (!submit_sms(device, handle, message, number, 0, false))
+        sms_handle.free(&handle);
+    return handle;
+}
+
+SMSHandle send_sms_report(GSMDevice device, char *message, char *number)
+{
+    SMSHandle handle;
+
+    g_assert(device != NULL);
+    if (device == NULL)
+        return NULL;
+    handle = sms_handle.init();
+    if (!submit_sms(device, handle, message, number, 0, true))
+        sms_handle.free(&handle);
+    return handle;
+}
+
+SMSHandle send_sms_idempotent(GSMDevice device, const char *client_id, char *message, char *number)
+{
+    struct sms_completion completion = {0};
+    SMSHandle handle, original;
 
     g_assert(device != NULL);
     if (device == NULL)
+        return NULL;
+    if (client_id == NULL)
+        return send_sms(device, message, number);
+    handle = sms_handle.init();
+    original = NULL;
+    //a retry gets the first submission's handle, resolved or not, and nothing is sent again
+    if (!dedup.claim(client_ids, client_id, handle, &original)) {
+        sms_handle.free(&handle);
+        return original;
+    }
+    if (!submit_sms(device, handle, message, number, 0, false)) {
+        completion.result = SMS_RESULT_FAILED;
+        completion.reference = -1;
+        completion.error = -1;
+        sms_handle.complete(handle, &completion);
+    }
+    return handle;
+}
+
+bool submit_sms(GSMDevice device, SMSHandle handle, const char *message, const char *number,
+                uint64_t wal_id, bool report)
+{
+    PduMessage pdu_message;
+    Transaction tx;
+    uint64_t lsn;
+
+    //a model without text mode sends everything as PDU, and so does a message asking for a report
+    if (!report && pdu.fits_text_mode(message) && (device->driver->capabilities & GSM_CAP_TEXT)) {
+        tx = submission_init(message, number, NULL, false);
+    } else if (device->driver->capabilities & GSM_CAP_PDU) {
+        pdu_message = pdu.init(message, number, (uint8_t)g_atomic_int_add(&device->concat_ref, 1));
+        if (pdu_message == NULL)
+            return false;
+        if (report)
+            pdu.request_report(pdu_message);
+        tx = submission_init(message, number, pdu_message, report);
+    } else {
+        return false;
+    }
+    if (tx == NULL)
+        return false;
+    LOG_DEBUG("send sms %s to %s: %s", device->port, number, message);
+    //recovered messages keep the id they were journaled with
+    lsn = 0;
+    if (device->wal != NULL && wal_id == 0)
+        wal_id = wal.append_submit(device->wal, device->port, number, message, &lsn);
+    tx->wal_lsn = lsn;
+    tx->wal_id = wal_id;
+    tx->handle = sms_handle.ref(handle);
+    g_atomic_int_inc(&device->sms_pending);
+    start_transaction(device, tx);
+    return true;
+}
+
+//takes pdu_message, NULL sends the message in text mode
+Transaction submission_init (const char *message, const char *number, PduMessage pdu_message, bool report)
+{
+    struct submission *sub;
+    Transaction tx;
+
+    tx = transaction_init(pdu_message == NULL ? submit_text : submit_pdu, sizeof(struct submission),
+                          submission_free);
+    g_assert(tx != NULL);
+    if (tx == NULL) {
+        pdu.free(&pdu_message);
+        return NULL;
+    }
+    sub = (struct submission *)tx->context;
+    sub->pdu = pdu_message;
+    sub->report = report;
+    tx->sends = pdu_message == NULL ? 1 : (guint)pdu.get_part_count(pdu_message);
+    sub->number = smartpointer.arena_strdup(tx->storage, number);
+    if (pdu_message == NULL)
+        sub->message = smartpointer.arena_strdup(tx->storage, message);
+    g_assert(sub->number != NULL && (pdu_message != NULL || sub->message != NULL));
+    if (sub->number == NULL || (pdu_message == NULL && sub->message == NULL)) {
+        transaction_free(tx);
+        return NULL;
+    }
+    return tx;
+}
+
+void submission_free (gpointer context)
+{
+    struct submission *sub = (struct submission *)context;
+
+    if (sub->pdu != NULL)
+        pdu.free(&sub->pdu);
+}
+
+enum tx_await submit_text (GSMDevice device, Transaction tx)
+{
+    struct submission *sub = (struct submission *)tx->context;
+
+    (void)device;
+    TX_BEGIN(tx);
+    tx_command(tx, "AT+CMGF=1");
+    TX_AWAIT(tx, TX_AWAIT_FINAL);
+    if (!tx_ok(tx))
+        TX_EXIT(tx);
+    tx_command(tx, "AT+CMGS=\"%s\"", sub->number);
+    TX_AWAIT(tx, TX_AWAIT_PROMPT);
+    if (!tx_ok(tx))
+        TX_EXIT(tx);
+    tx_command(tx, "%s\x1A", sub->message);
+    TX_AWAIT(tx, TX_AWAIT_FINAL);
+    TX_END(tx);
+}
+
+enum tx_await submit_pdu (GSMDevice device, Transaction tx)
+{
+    struct submission *sub = (struct submission *)tx->context;
+    char hex[PDU_HEX_MAX_LEN];
+
+    TX_BEGIN(tx);
+    tx_command(tx, "AT+CMGF=0");
+    TX_AWAIT(tx, TX_AWAIT_FINAL);
+    if (!tx_ok(tx))
+        TX_EXIT(tx);
+    //the recipient header is encoded once, a part is built on the stack for its length and again for its payload
+    for (sub->part = 0; sub->part < pdu.get_part_count(sub->pdu); sub->part++) {
+        tx_command(tx, "AT+CMGS=%zu", pdu.get_part(sub->pdu, sub->part, hex));
+        TX_AWAIT(tx, TX_AWAIT_PROMPT);
+        if (!tx_ok(tx))
+            TX_EXIT(tx);
+        pdu.get_part(sub->pdu, sub->part, hex);
+        tx_command(tx, "%s\x1A", hex);
+        TX_AWAIT(tx, TX_AWAIT_FINAL);
+        if (!tx_ok(tx))
+            TX_EXIT(tx);
+        //the +CMGS reply carries the reference its report will come back with
+        if (sub->report)
+            track_report(device, tx->step, sub->number);
+    }
+    TX_END(tx);
+}
+
+void set_wal (GSMDevice device, Wal wal_log)
+{
+    if (device == NULL)
+        return;
+    device->wal = wal_log;
+    //messages journaled for this port before a crash are sent again
+    wal.take_pending(wal_log, device->port, resubmit_pending, device);
+}
+
+void set_store (GSMDevice device, Store inbox)
+{
+    if (device == NULL)
+        return;
+    device->store = inbox;
+}
+
+void set_trace (GSMDevice device, Trace t)
+{
+    if (device == NULL)
+        return;
+    if (t == NULL) {
+        serial.set_trace(device->serial, NULL, 0);
+        return;
+    }
+    serial.set_trace(device->serial, t, trace.add_channel(t, device->port));
+}
+
+void resubmit_pending (uint64_t id, const char *number, const char *message, void *user_data)
+{
+    SMSHandle handle;
+
+    handle = sms_handle.init();
+    //the journal does not keep whether a report was asked for, it is sent again without one
+    submit_sms((GSMDevice)user_data, handle, message, number, id, false);
+    sms_handle.free(&handle);
+}
+
+size_t get_queue_depth (GSMDevice device)
+{
+    if (device == NULL)
+        return 0;
+    return (size_t)g_atomic_int_get(&device->sms_pending);
+}
+
+void complete_handle (GSMDevice device, Task task)
+{
+    struct sms_completion completion = {0};
+
+    //every step holds the handle, it resolves on the last step or the first failure
+    if (task->is_reply_ok && task->next != NULL)
+        return;
+    completion.reference = -1;
+    completion.error = -1;
+    if (task->is_reply_ok) {
+        completion.result = SMS_RESULT_SENT;
+        completion.reference = parse_reply_int(task, "+CMGS:");
+    } else if (task->is_cancelled) {
+        completion.result = SMS_RESULT_CANCELLED;
+    } else if (!task->is_done) {
+        completion.result = SMS_RESULT_TIMEOUT;
+    } else {
+        completion.result = SMS_RESULT_FAILED;
+        completion.error = parse_reply_int(task, "+CMS ERROR:");
+        if (completion.error < 0)
+            completion.error = parse_reply_int(task, "+CME ERROR:");
+    }
+    if (sms_handle.complete(task->handle, &completion)) {
+        g_atomic_int_add(&device->sms_pending, -1);
+        if (task->wal_id != 0)
+            wal.append_complete(device->wal, task->wal_id, completion.result);
+    }
+}
+
+void send_sms_bulk(GSMDevice device, char *message, char **numbers, size_t n,
+                   gsm_bulk_result_cb result, void *user_data)
+{
+    BulkSMS bulk;
+    Transaction tx;
+
+    g_assert(device != NULL);
+    if (device == NULL || message == NULL || numbers == NULL || n == 0)
+        return;
+    tx = transaction_init(bulk_run, sizeof(struct bulk_sms), bulk_free);
+    g_assert(tx != NULL);
+    if (tx == NULL)
+        return;
+    bulk = (BulkSMS)tx->context;
+    bulk->n = n;
+    bulk->result = result;
+    bulk->user_data = user_data;
+    bulk->numbers = smartpointer.arena_alloc(tx->storage, n * sizeof(char *));
+    g_assert(bulk->numbers != NULL);
+    if (bulk->numbers == NULL) {
+        transaction_free(tx);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        bulk->numbers[i] = smartpointer.arena_strdup(tx->storage, numbers[i]);
+        g_assert(bulk->numbers[i] != NULL);
+        if (bulk->numbers[i] == NULL) {
+            transaction_free(tx);
+            return;
+        }
+    }
+    LOG_DEBUG("send bulk sms %s to %zu recipients: %s", device->port, n, message);
+    if (pdu.fits_text_mode(message) && (device->driver->capabilities & GSM_CAP_TEXT)) {
+        bulk->message = smartpointer.arena_strdup(tx->storage, message);
+        bulk->part_count = 1;
+        g_assert(bulk->message != NULL);
+        if (bulk->message == NULL) {
+            transaction_free(tx);
+            return;
+        }
+    } else {
+        bulk->pdu = pdu.init(message, numbers[0], (uint8_t)g_atomic_int_add(&device->concat_ref, 1));
+        if (bulk->pdu == NULL) {
+            transaction_free(tx);
+            return;
+        }
+        bulk->part_count = pdu.get_part_count(bulk->pdu);
+    }
+    bulk->index = smartpointer.arena_alloc(tx->storage, bulk->part_count * sizeof(gint));
+    g_assert(bulk->index != NULL);
+    if (bulk->index == NULL) {
+        transaction_free(tx);
         return;
-    cmgs = g_string_new("");
-    if (cmgs == NULL)
-        return;
-    g_string_append_printf(cmgs, "AT+CMGS=\"%s\"", number);
-    printf("SendSMS(%s,%s) %i\n", message, number,*device->fd);
-    task1 = create_task("AT+CMGF=1",100,NULL);
-    task2 = create_task(cmgs->str,200,generic_process);
-    task1->next = task2;
-    g_free(cmgs);
-    msg = g_string_new(message);
-    if (msg == NULL)
-        return;
-    g_string_append_c(msg,(gchar)0x1A);
-    task3 = create_task(msg->str,200,NULL);
-    task2->next = task3;
-    g_free(msg);
-    g_mutex_lock(&mutex_scheduler);
-    tasks = g_hash_table_lookup(task_scheduler,device->fd);
-    g_mutex_unlock(&mutex_scheduler);
+    }
+    for (size_t i = 0; i < bulk->part_count; i++)
+        bulk->index[i] = -1;
+    start_transaction(device, tx);
+}
+
+void bulk_free (gpointer context)
+{
+    BulkSMS bulk = (BulkSMS)context;
+
+    if (bulk->pdu != NULL)
+        pdu.free(&bulk->pdu);
+}
+
+/*
+ * Every recipient takes its turn behind the work queued meanwhile and is
+ * charged to the rate limit on its own; the stored parts go once every
+ * recipient had its turn.
+ */
+enum tx_await bulk_run (GSMDevice device, Transaction tx)
+{
+    BulkSMS bulk = (BulkSMS)tx->context;
+    char hex[PDU_HEX_MAX_LEN];
+
+    (void)device;
+    TX_BEGIN(tx);
+    tx_command(tx, bulk->pdu == NULL ? "AT+CMGF=1" : "AT+CMGF=0");
+    TX_AWAIT(tx, TX_AWAIT_FINAL);
+    for (bulk->part = 0; tx_ok(tx) && bulk->part < bulk->part_count; bulk->part++) {
+        if (bulk->pdu == NULL)
+            tx_command(tx, "AT+CMGW=\"%s\"", bulk->numbers[0]);
+        else
+            tx_command(tx, "AT+CMGW=%zu", pdu.get_part(bulk->pdu, bulk->part, hex));
+        TX_AWAIT(tx, TX_AWAIT_PROMPT);
+        if (!tx_ok(tx))
+            break;
+        if (bulk->pdu == NULL) {
+            tx_command(tx, "%s\x1A", bulk->message);
+        } else {
+            pdu.get_part(bulk->pdu, bulk->part, hex);
+            tx_command(tx, "%s\x1A", hex);
+        }
+        TX_AWAIT(tx, TX_AWAIT_FINAL);
+        if (tx_ok(tx))
+            bulk->index[bulk->part] = parse_reply_int(tx->step, "+CMGW:");
+    }
+    //recipients are independent, a failed AT+CMSS does not stop the others
+    for (bulk->recipient = 0; bulk->recipient < bulk->n; bulk->recipient++) {
+        bulk->failed = false;
+        bulk->reference = -1;
+        for (bulk->part = 0; bulk->part < bulk->part_count; bulk->part++) {
+            if (bulk->index[bulk->part] < 0) {
+                bulk->failed = true;
+                continue;
+            }
+            tx_command(tx, "AT+CMSS=%d,\"%s\"", bulk->index[bulk->part], bulk->numbers[bulk->recipient]);
+            TX_AWAIT(tx, TX_AWAIT_TURN);
+            bulk->reference = tx_ok(tx) ? parse_reply_int(tx->step, "+CMSS:") : -1;
+            if (bulk->reference < 0)
+                bulk->failed = true;
+        }
+        //reported once, with the reference of the last part
+        if (bulk->result != NULL)
+            bulk->result(bulk->numbers[bulk->recipient], bulk->failed ? -1 : bulk->reference,
+                         bulk->user_data);
+    }
+    for (bulk->part = 0; bulk->part < bulk->part_count; bulk->part++) {
+        if (bulk->index[bulk->part] < 0)
+            continue;
+        tx_command(tx, "AT+CMGD=%d", bulk->index[bulk->part]);
+        TX_AWAIT(tx, TX_AWAIT_TURN);
+    }
+    TX_END(tx);
+}
+
+void enqueue_chain (GSMDevice device, Task first)
+{
+    gint64 now;
+
+    now = g_get_monotonic_time();
+    //every message the chain sends is charged up front, a moved chain is charged where it runs;
+    //a transaction pays what it declared with the first command it queues
+    first->tokens = 0;
+    if (first->transaction != NULL) {
+        first->tokens = first->transaction->unpaid;
+        first->transaction->unpaid = 0;
+    }
+    for (Task task = first; task != NULL; task = task->next) {
+        if (task != first)
+            task->tokens = 0;
+        if (task->command == GSM_COMMAND_CMGS || task->command == GSM_COMMAND_CMSS)
+            first->tokens++;
+    }
     g_mutex_lock(&device->mutex);
-    if (tasks == NULL) {
-        tasks = g_queue_new();
-        g_assert(tasks != NULL);
-        g_mutex_lock(&mutex_scheduler);
-        g_hash_table_insert(task_scheduler, device->fd, tasks);
-        g_mutex_unlock(&mutex_scheduler);
-    }
-    g_queue_push_tail(tasks,task1);
-    g_queue_push_tail(tasks,task2);
-    g_queue_push_tail(tasks,task3);
+    for (Task task = first; task != NULL; task = task->next) {
+        task->timeout = device->driver->timeouts[task->command];
+        task->queued_time = now;
+        g_queue_push_tail(device->tasks,task);
+    }
     g_mutex_unlock(&device->mutex);
 }
 
-void read_serial(int fd, uint8_t *data, size_t len)
+void read_serial(int fd, uint8_t *data, size_t len, void *user_data)
 {
     GSMDevice device;
-    gint *local_fd;
 
-    printf("read_serial:[%s]\n",data);
-    g_assert(task_devices != NULL);
-
-    if (!task_devices)
-        return;
-    local_fd = g_new(gint,1);
-    *local_fd = fd;
-    g_mutex_lock(&mutex_devices);
-    device = g_hash_table_lookup(task_devices, local_fd);
-    g_mutex_unlock(&mutex_devices);
-    g_free(local_fd);
+    (void)fd;
+    device = (GSMDevice)user_data;
     if (device == NULL)
         return;
+    //len includes the slot serial leaves for the terminator
+    LOG_TRACE("rx chunk %s: %.*s", device->port, (int)len - 1, (const char *)data);
     if (device->buffer == NULL)
         return;
+    atomic_fetch_add_explicit(&device->metrics->bytes_rx, len - 1, memory_order_relaxed);
+    atomic_store_explicit(&device->rx_time, g_get_monotonic_time(), memory_order_relaxed);
     if (strnlen((const char *)data,len) == len)
         data[len - 1] = '\0';//insure null terminating string
     buffer.push(device->buffer,(const char *)data);
 }
 
+void set_inbox_handler (GSMDevice device, gsm_inbox_cb handler, void *user_data)
+{
+    if (device == NULL)
+        return;
+    device->inbox_user_data = user_data;
+    device->inbox_handler = handler;
+    if (handler == NULL)
+        return;
+    //store new messages and announce them with +CMTI
+    set_message_indications(device);
+    poll_inbox(device);
+}
+
+void set_report_handler (GSMDevice device, gsm_report_cb handler, void *user_data)
+{
+    if (device == NULL)
+        return;
+    device->report_user_data = user_data;
+    device->report_handler = handler;
+    set_message_indications(device);
+}
+
+void set_message_indications (GSMDevice device)
+{
+    char cnmi[CMD_MAX_LEN];
+
+    //+CMTI for stored messages, +CDS for status reports routed straight to the host
+    snprintf(cnmi, CMD_MAX_LEN, "AT+CNMI=2,%d,0,%d,0",
+             device->inbox_handler != NULL ? 1 : 0, device->report_handler != NULL ? 1 : 0);
+    enqueue_chain(device, create_task(cnmi,NULL));
+}
+
+void poll_inbox (GSMDevice device)
+{
+    if (device == NULL || device->inbox_handler == NULL)
+        return;
+    //one queued drain is enough, a +CMTI during the listing queues the next one
+    if (!g_atomic_int_compare_and_exchange(&device->inbox_pending, 0, 1))
+        return;
+    start_transaction(device, transaction_init(inbox_drain, 0, NULL));
+}
+
+enum tx_await inbox_drain (GSMDevice device, Transaction tx)
+{
+    TX_BEGIN(tx);
+    tx_command(tx, "AT+CMGF=0");
+    TX_AWAIT(tx, TX_AWAIT_FINAL);
+    if (!tx_ok(tx)) {
+        g_atomic_int_set(&device->inbox_pending, 0);
+        TX_EXIT(tx);
+    }
+    //the listing goes out next, a +CMTI from here on is for a message it may miss
+    device->inbox_index = -1;
+    g_atomic_int_set(&device->inbox_pending, 0);
+    tx_command(tx, "AT+CMGL=4");
+    tx->on_line = inbox_line;
+    TX_AWAIT(tx, TX_AWAIT_FINAL);
+    if (!tx_ok(tx))
+        TX_EXIT(tx);
+    //listing marks every message read, delete them all in one go
+    tx_command(tx, "AT+CMGD=1,1");
+    TX_AWAIT(tx, TX_AWAIT_FINAL);
+    TX_END(tx);
+}
+
 void register_sim (GSMDevice device)
 {
-//    write_cmd(device, "ATE0\r\n", true);
-//    uv_sleep(500);
-    write_cmd(device, "AT+CREG?");
+    if (device == NULL)
+        return;
+    device->signal_time = g_get_monotonic_time() / 1000;
+    start_transaction(device, transaction_init(register_run, 0, NULL));
+}
+
+//replies are picked up by the +CREG/+CSQ URC handlers; the signal reads 99 until there is a network
+enum tx_await register_run (GSMDevice device, Transaction tx)
+{
+    TX_BEGIN(tx);
+    tx_command(tx, "AT+CREG?");
+    TX_AWAIT(tx, TX_AWAIT_FINAL);
+    tx->deadline = g_get_monotonic_time() + (gint64)REGISTRATION_WAIT * G_USEC_PER_SEC;
+    while (!is_registered(device)) {
+        tx->urc_prefix = "+CREG:";
+        TX_AWAIT(tx, TX_AWAIT_URC);
+        if (tx->urc == NULL)
+            break;
+    }
+    tx_command(tx, "AT+CSQ");
+    TX_AWAIT(tx, TX_AWAIT_FINAL);
+    TX_END(tx);
+}
+
+bool is_registered (GSMDevice device)
+{
+    struct gsm_network_state state;
+
+    if (!get_network_state(device, &state))
+        return false;
+    return state.registration == GSM_REG_HOME || state.registration == GSM_REG_ROAMING;
+}
+
+bool get_network_state (GSMDevice device, struct gsm_network_state *state)
+{
+    uint64_t packed;
+
+    if (device == NULL || state == NULL)
+        return false;
+    packed = atomic_load_explicit(&device->network_state, memory_order_acquire);
+    state->registration = (enum gsm_registration)NETWORK_STAT(packed);
+    state->lac = (uint16_t)NETWORK_LAC(packed);
+    state->ci = (uint32_t)NETWORK_CI(packed);
+    state->rssi = (uint8_t)NETWORK_RSSI(packed);
+    state->ber = (uint8_t)NETWORK_BER(packed);
+    return (packed & NETWORK_VALID) != 0;
+}
+
+void update_network_state (GSMDevice device, uint64_t mask, uint64_t value)
+{
+    uint64_t packed;
+
+    packed = atomic_load_explicit(&device->network_state, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&device->network_state, &packed,
+                                                  (packed & ~mask) | value | NETWORK_VALID,
+                                                  memory_order_release, memory_order_relaxed))
+        ;
+}
+
+void refresh_signal (GSMDevice device)
+{
+    gint64 now;
+
+    //there is no portable signal URC, re-read CSQ only while the line is idle
+    now = g_get_monotonic_time() / 1000;
+    if (now - device->signal_time < SIGNAL_REFRESH_INTERVAL)
+        return;
+    device->signal_time = now;
+    enqueue_chain(device, create_task("AT+CSQ",NULL));
 }
 
 void write_cmd(GSMDevice device, const char *cmd)
 {
-    printf("cmd= %s, len= %zu\n", cmd, strnlen(cmd, CMD_MAX_LEN));
+    LOG_TRACE("tx %s: %s", device->port, cmd);
+    atomic_fetch_add_explicit(&device->metrics->bytes_tx, strnlen(cmd, CMD_MAX_LEN) + 2,
+                              memory_order_relaxed);
     serial.write(device->serial,(const uint8_t *)cmd, strnlen(cmd, CMD_MAX_LEN));
     serial.write(device->serial,(const uint8_t *)"\r\n", 2);
 }
 
-void generic_process (Task task)
+int parse_reply_int (Task task, const char *prefix)
 {
-    printf("generic_process\n");
-    if (task == NULL)
-        return;
+    const char *found;
+
     if (task->reply == NULL)
+        return -1;
+    found = g_strstr_len(task->reply->str, (gssize)task->reply->len, prefix);
+    if (found == NULL)
+        return -1;
+    return (int)strtol(found + strlen(prefix), NULL, 10);
+}
+
+void inbox_line (GSMDevice device, const char *line)
+{
+    struct pdu_deliver message;
+
+    //PDU mode listing: +CMGL: <index>,<stat>,[<alpha>],<length> followed by the PDU line
+    if (g_str_has_prefix(line, "+CMGL:")) {
+        device->inbox_index = (gint)strtol(line + strlen("+CMGL:"), NULL, 10);
+        return;
+    }
+    if (device->inbox_index < 0)
+        return;
+    device->inbox_index = -1;
+    if (!pdu.decode(line, &message)) {
+        LOG_WARN("inbox %s: undecodable pdu %s", device->port, line);
+        return;
+    }
+    reassembly.add(device->reassembly, &message, g_get_monotonic_time());
+}
+
+void inbox_complete (const struct reassembly_message *message, void *user_data)
+{
+    GSMDevice device = (GSMDevice)user_data;
+
+    //only queued here, the store writes its batches on its own thread
+    if (device->store != NULL)
+        store.append(device->store, device->port, message);
+    if (device->inbox_handler != NULL)
+        device->inbox_handler(device, message, device->inbox_user_data);
+}
+
+bool dispatch_urc (GSMDevice device, const char *line)
+{
+    struct pdu_status_report report;
+
+    if (device->report_pdu_pending) {
+        device->report_pdu_pending = false;
+        if (pdu.decode_status_report(line, &report))
+            deliver_report(device, &report);
+        else
+            LOG_WARN("report %s: undecodable pdu %s", device->port, line);
+        return true;
+    }
+    for (size_t i = 0; i < G_N_ELEMENTS(urc_handlers); i++) {
+        if (g_str_has_prefix(line, urc_handlers[i].prefix)) {
+            urc_handlers[i].handle(device, line);
+            //transactions waiting for it see it after the state it updates
+            wake_transactions(device, line);
+            return true;
+        }
+    }
+    //a line no handler knows is an URC only to a transaction waiting for it
+    return wake_transactions(device, line);
+}
+
+void urc_new_message (GSMDevice device, const char *line)
+{
+    (void)line;
+    poll_inbox(device);
+}
+
+void urc_registration (GSMDevice device, const char *line)
+{
+    gchar **fields;
+    guint count, first;
+    uint64_t value, mask;
+
+    //unsolicited: <stat>[,"<lac>","<ci>"], solicited adds a leading <n>
+    fields = g_strsplit(line + strlen("+CREG:"), ",", 6);
+    count = g_strv_length(fields);
+    first = (count >= 2 && strchr(fields[1], '"') == NULL) ? 1 : 0;
+    if (count <= first) {
+        g_strfreev(fields);
+        return;
+    }
+    mask = 0x0F;
+    value = (uint64_t)strtoul(fields[first], NULL, 10) & 0x0F;
+    if (count >= first + 3) {
+        mask = NETWORK_CELL_MASK;
+        value |= ((uint64_t)strtoul(g_strstrip(fields[first + 1]) + 1, NULL, 16) & 0xFFFF) << 4;
+        value |= ((uint64_t)strtoul(g_strstrip(fields[first + 2]) + 1, NULL, 16) & 0x0FFFFFFF) << 20;
+    }
+    g_strfreev(fields);
+    update_network_state(device, mask, value);
+}
+
+void urc_signal (GSMDevice device, const char *line)
+{
+    unsigned long rssi, ber;
+    char *end;
+
+    rssi = strtoul(line + strlen("+CSQ:"), &end, 10);
+    ber = (*end == ',') ? strtoul(end + 1, NULL, 10) : 99;
+    update_network_state(device, UINT64_C(0x3FFF) << 48,
+                         ((uint64_t)(rssi & 0x7F) << 48) | ((uint64_t)(ber & 0x7F) << 55));
+}
+
+void urc_status_report (GSMDevice device, const char *line)
+{
+    struct pdu_status_report report;
+    const char *fields;
+    char *end;
+
+    //PDU mode: +CDS: <length> and the PDU on the next line
+    fields = line + strlen("+CDS:");
+    strtoul(fields, &end, 10);
+    if (end != fields && *g_strstrip(end) == '\0') {
+        device->report_pdu_pending = true;
+        return;
+    }
+    //text mode: +CDS: <fo>,<mr>,[<ra>],[<tora>],<scts>,<dt>,<st>
+    if (!parse_text_report(fields, &report)) {
+        LOG_WARN("report %s: unparsable %s", device->port, line);
         return;
-    if (g_strstr_len(task->request->str, task->request->len,"CMGS") != NULL){
-        task->is_reply_ok = (g_strstr_len(task->reply->str,
-                                          task->reply->len,">") != NULL);
     }
+    deliver_report(device, &report);
+}
+
+bool parse_text_report (const char *fields, struct pdu_status_report *report)
+{
+    GPtrArray *field;
+    GString *current;
+    bool quoted, parsed;
+
+    memset(report, 0, sizeof (struct pdu_status_report));
+    //the time stamps have commas of their own, split outside quotes only
+    field = g_ptr_array_new_with_free_func(g_free);
+    current = g_string_new(NULL);
+    quoted = false;
+    for (const char *c = fields; *c != '\0'; c++) {
+        if (*c == '"')
+            quoted = !quoted;
+        else if (*c == ',' && !quoted) {
+            g_ptr_array_add(field, g_strstrip(g_strdup(current->str)));
+            g_string_truncate(current, 0);
+        } else
+            g_string_append_c(current, *c);
+    }
+    g_ptr_array_add(field, g_strstrip(g_string_free(current, false)));
+    parsed = (field->len >= 7);
+    if (parsed) {
+        report->reference = (uint8_t)strtoul(g_ptr_array_index(field, 1), NULL, 10);
+        g_strlcpy(report->recipient, g_ptr_array_index(field, 2), PDU_NUMBER_MAX_LEN);
+        report->timestamp = parse_text_time(g_ptr_array_index(field, 4));
+        report->discharge_time = parse_text_time(g_ptr_array_index(field, 5));
+        report->status = (uint8_t)strtoul(g_ptr_array_index(field, 6), NULL, 10);
+    }
+    g_ptr_array_free(field, true);
+    return parsed;
+}
+
+//yy/MM/dd,hh:mm:ss±zz with the zone in quarter hours
+int64_t parse_text_time (const char *field)
+{
+    struct tm tm = {0};
+    char sign;
+    int zone;
+
+    if (sscanf(field, "%d/%d/%d,%d:%d:%d%c%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &sign, &zone) != 8)
+        return 0;
+    tm.tm_year += 100;
+    tm.tm_mon -= 1;
+    zone *= (sign == '-') ? -15 * 60 : 15 * 60;
+    return (int64_t)timegm(&tm) - zone;
+}
+
+void deliver_report (GSMDevice device, const struct pdu_status_report *report)
+{
+    SMSHandle handle;
+    bool final;
+
+    //0x20-0x3F: the service centre is still trying, another report follows
+    final = (report->status < 0x20 || report->status >= 0x40);
+    handle = receipt.resolve(receipts, device, report->reference, report->recipient, final);
+    if (handle == NULL)
+        LOG_DEBUG("report %s: no submission for reference %u to %s", device->port,
+                  (unsigned)report->reference, report->recipient);
+    if (device->report_handler != NULL)
+        device->report_handler(device, handle, report, device->report_user_data);
+    if (handle != NULL)
+        sms_handle.free(&handle);
+}
+
+void track_report (GSMDevice device, Task task, const char *number)
+{
+    int reference;
+
+    if (!task->is_reply_ok || task->handle == NULL)
+        return;
+    reference = parse_reply_int(task, "+CMGS:");
+    if (reference < 0 || reference > 255)
+        return;
+    receipt.track(receipts, device, (uint8_t)reference, number, task->handle);
+}
+
+bool is_final_result (const char *line)
+{
+    return strcmp(line, "OK") == 0 ||
+           strcmp(line, "ERROR") == 0 ||
+           g_str_has_prefix(line, "+CMS ERROR") ||
+           g_str_has_prefix(line, "+CME ERROR");
 }
 
-Task create_task (const char *cmd, uint32_t timeout, void (*cb)(Task))
+Task create_task (const char *cmd, void (*cb)(Task))
 {
     Task task;
 
-    task = malloc(sizeof (struct task));
+    task = g_new0(struct task, 1);
     g_assert(task !=NULL);
     if (task == NULL)
         return task;
-    task->request = g_string_new(cmd);
-    task->timeout = timeout;
+    task->request = g_strdup(cmd);
+    task->command = classify_command(cmd);
     task->cb = cb;
     task->next = NULL;
     return task;
-}
\ No newline at end of file
+}
+enum gsm_command classify_command (const char *cmd)
+{
+    static const struct {
+        const char *prefix;
+        enum gsm_command command;
+    } prefixes[] = {
+        {"AT+CMGF", GSM_COMMAND_CMGF},
+        {"AT+CMGS", GSM_COMMAND_CMGS},
+        {"AT+CMGW", GSM_COMMAND_CMGW},
+        {"AT+CMSS", GSM_COMMAND_CMSS},
+        {"AT+CMGL", GSM_COMMAND_CMGL},
+        {"AT+CMGD", GSM_COMMAND_CMGD},
+        {"AT+CREG", GSM_COMMAND_CREG},
+        {"AT+CSQ", GSM_COMMAND_CSQ},
+    };
+    size_t len;
+
+    //text and PDUs after the prompt are terminated by Ctrl-Z
+    len = strlen(cmd);
+    if (len > 0 && cmd[len - 1] == 0x1A)
+        return GSM_COMMAND_PAYLOAD;
+    for (size_t i = 0; i < G_N_ELEMENTS(prefixes); i++)
+        if (g_str_has_prefix(cmd, prefixes[i].prefix))
+            return prefixes[i].command;
+    return GSM_COMMAND_OTHER;
+}
+
+void record_result (GSMDevice device, Task task)
+{
+    struct command_metrics *command;
+    int code;
+
+    if (!task->is_sent)
+        return;
+    command = &device->metrics->commands[task->command];
+    if (!task->is_done) {
+        atomic_fetch_add_explicit(&command->timeouts, 1, memory_order_relaxed);
+        return;
+    }
+    metrics.record(&command->response, (uint64_t)(g_get_monotonic_time() - task->write_time));
+    if (task->is_reply_ok)
+        return;
+    atomic_fetch_add_explicit(&command->errors, 1, memory_order_relaxed);
+    code = parse_reply_int(task, "+CMS ERROR:");
+    if (code < 0)
+        code = parse_reply_int(task, "+CME ERROR:");
+    if (code >= 0)
+        atomic_fetch_add_explicit(&device->metrics->error_codes[MIN(code, GSM_STATS_ERROR_CODES - 1)], 1,
+                                  memory_order_relaxed);
+}
+
+void latency_snapshot (struct metrics_histogram *histogram, struct gsm_latency *latency)
+{
+    latency->count = atomic_load_explicit(&histogram->total, memory_order_relaxed);
+    latency->sum = atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+    latency->p50 = metrics.get_percentile(histogram, 50.0);
+    latency->p90 = metrics.get_percentile(histogram, 90.0);
+    latency->p99 = metrics.get_percentile(histogram, 99.0);
+    latency->p999 = metrics.get_percentile(histogram, 99.9);
+    latency->max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+}
+
+bool get_stats (GSMDevice device, struct gsm_stats *stats)
+{
+    struct command_metrics *command;
+    GQueue *tasks;
+
+    if (device == NULL || stats == NULL)
+        return false;
+    stats->bytes_tx = atomic_load_explicit(&device->metrics->bytes_tx, memory_order_relaxed);
+    stats->bytes_rx = atomic_load_explicit(&device->metrics->bytes_rx, memory_order_relaxed);
+    stats->resets = atomic_load_explicit(&device->metrics->resets, memory_order_relaxed);
+    stats->sms_pending = get_queue_depth(device);
+    stats->commands_queued = 0;
+    tasks = device_tasks(device);
+    if (tasks != NULL) {
+        g_mutex_lock(&device->mutex);
+        stats->commands_queued = g_queue_get_length(tasks);
+        g_mutex_unlock(&device->mutex);
+    }
+    for (int i = 0; i < GSM_COMMAND_COUNT; i++) {
+        command = &device->metrics->commands[i];
+        stats->commands[i].commands = atomic_load_explicit(&command->commands, memory_order_relaxed);
+        stats->commands[i].timeouts = atomic_load_explicit(&command->timeouts, memory_order_relaxed);
+        stats->commands[i].errors = atomic_load_explicit(&command->errors, memory_order_relaxed);
+        latency_snapshot(&command->queued, &stats->commands[i].queued);
+        latency_snapshot(&command->response, &stats->commands[i].response);
+    }
+    for (int i = 0; i < GSM_STATS_ERROR_CODES; i++)
+        stats->error_codes[i] = atomic_load_explicit(&device->metrics->error_codes[i], memory_order_relaxed);
+    return true;
+}
+
+const char *get_command_name (enum gsm_command command)
+{
+    if (command < 0 || command >= GSM_COMMAND_COUNT)
+        return "unknown";
+    return command_names[command];
+}
+
+const char *get_port (GSMDevice device)
+{
+    if (device == NULL)
+        return NULL;
+    return device->port;
+}
@@ -6,11 +6,105 @@
 #ifndef GSMAPP_GSM_H
 #define GSMAPP_GSM_H
 
+#include "smshandle.h"
+#include "pdu.h"
+#include "reassembly.h"
+#include "store.h"
+#include "wal.h"
+#include "trace.h"
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
 typedef struct gsm_device *GSMDevice;
 
+enum gsm_registration {
+    GSM_REG_NOT_REGISTERED = 0,
+    GSM_REG_HOME = 1,
+    GSM_REG_SEARCHING = 2,
+    GSM_REG_DENIED = 3,
+    GSM_REG_UNKNOWN = 4,
+    GSM_REG_ROAMING = 5
+};
+
+struct gsm_network_state {
+    enum gsm_registration registration;
+    uint16_t    lac;
+    uint32_t    ci;
+    uint8_t     rssi;   //0-31, 99 unknown
+    uint8_t     ber;    //0-7, 99 unknown
+};
+
+enum gsm_command {
+    GSM_COMMAND_CMGF,
+    GSM_COMMAND_CMGS,
+    GSM_COMMAND_CMGW,
+    GSM_COMMAND_CMSS,
+    GSM_COMMAND_CMGL,
+    GSM_COMMAND_CMGD,
+    GSM_COMMAND_CREG,
+    GSM_COMMAND_CSQ,
+    GSM_COMMAND_PAYLOAD,    //message text or PDU sent after the "> " prompt
+    GSM_COMMAND_OTHER,
+    GSM_COMMAND_COUNT
+};
+
+#define GSM_STATS_ERROR_CODES 1024
+
+//microsecond
+struct gsm_latency {
+    uint64_t    count;
+    uint64_t    sum;
+    uint64_t    p50;
+    uint64_t    p90;
+    uint64_t    p99;
+    uint64_t    p999;
+    uint64_t    max;
+};
+
+struct gsm_command_stats {
+    uint64_t    commands;
+    uint64_t    timeouts;
+    uint64_t    errors;
+    struct gsm_latency queued;  //enqueue to written on the serial port
+    struct gsm_latency response;//written to final result
+};
+
+struct gsm_stats {
+    uint64_t    bytes_tx;
+    uint64_t    bytes_rx;
+    size_t      sms_pending;
+    size_t      commands_queued;
+    uint64_t    resets;     //by the watchdog, for a modem that stopped answering
+    struct gsm_command_stats commands[GSM_COMMAND_COUNT];
+    //+CMS ERROR codes, or +CME ERROR when there was none, the last slot counts everything above
+    uint64_t    error_codes[GSM_STATS_ERROR_CODES];
+};
+
+//messages a SIM may send, a limit of 0 is off
+struct gsm_rate_limit {
+    double      per_second;
+    uint32_t    burst;      //sent back to back after a quiet period, at least 1
+    uint32_t    per_day;
+};
+
+//reference is the message reference of the last part, or -1 when the recipient failed
+typedef void (* gsm_bulk_result_cb) (const char *number, int reference, void *user_data);
+//runs on the device reader thread once for every message drained from storage, concatenated parts
+//joined; one whose parts did not all come within five minutes is handed over with what it has
+typedef void (* gsm_inbox_cb) (GSMDevice device, const struct reassembly_message *message, void *user_data);
+//runs on the device reader thread for every +CDS, handle is the submission the report belongs to
+//or NULL when it is not known anymore; it is only valid during the call
+typedef void (* gsm_report_cb) (GSMDevice device, SMSHandle handle, const struct pdu_status_report *report,
+                                void *user_data);
+
+//every model has a driver describing it, see driver.h
 enum gsm_vendor_model {
     GSM_AI_A7 = 0x0100,
-    GSM_AI_A6
+    GSM_AI_A6,
+    GSM_SIMCOM_SIM800 = 0x0200,
+    GSM_QUECTEL_EC2X = 0x0300
 };
 
 struct _gsm{
@@ -18,7 +112,47 @@ struct _gsm{
     void        (* free) (GSMDevice *device);
 
     void (*register_sim) (GSMDevice device);
-    void (*send_sms) (GSMDevice device,char *message, char *number);
+    //lock-free snapshot kept current by +CREG URCs, false until the first report
+    bool (*get_network_state) (GSMDevice device, struct gsm_network_state *state);
+    //submitted messages whose handle has not resolved yet
+    size_t (*get_queue_depth) (GSMDevice device);
+    //percentiles are approximate to within 1/16 of the value
+    bool (*get_stats) (GSMDevice device, struct gsm_stats *stats);
+    const char *(*get_command_name) (enum gsm_command command);
+    const char *(*get_port) (GSMDevice device);
+    //the caller owns a reference to the returned handle, release it with sms_handle.free
+    SMSHandle (*send_sms) (GSMDevice device,char *message, char *number);
+    //client_id deduplicates retries for ten minutes across every device, a repeated id
+    //returns the original handle and its result; NULL if client_id is longer than 64 bytes
+    SMSHandle (*send_sms_idempotent) (GSMDevice device, const char *client_id, char *message,
+                                      char *number);
+    //like send_sms, sent as PDU asking the network for a status report of every part; the
+    //reports come to the report handler for three days
+    SMSHandle (*send_sms_report) (GSMDevice device, char *message, char *number);
+    //journal later submissions to wal and resend what it still holds for this port
+    void (*set_wal) (GSMDevice device, Wal wal);
+    //every message received from now on is appended to inbox before the inbox handler sees it
+    void (*set_store) (GSMDevice device, Store inbox);
+    //record the serial traffic of this device to t as its own channel, NULL stops recording
+    void (*set_trace) (GSMDevice device, Trace t);
+    //closes the port of a modem that went away, submissions not yet written move to other
+    //online devices and everything else waits for reconnect; the watchdog does the same to a
+    //modem that stops answering, after rebooting it with AT+CFUN=1,1
+    void (*disconnect) (GSMDevice device);
+    //reopens the port and sets the modem up again, false while it can not be opened yet
+    bool (*reconnect) (GSMDevice device);
+    bool (*is_online) (GSMDevice device);
+    //submissions over the limit go to an unthrottled device of the fleet or wait their turn,
+    //other commands are not held up by them; NULL removes the limit
+    void (*set_rate_limit) (GSMDevice device, const struct gsm_rate_limit *limit);
+    //true while a new message would wait for the rate limit
+    bool (*is_throttled) (GSMDevice device);
+    void (*send_sms_bulk) (GSMDevice device, char *message, char **numbers, size_t n,
+                           gsm_bulk_result_cb result, void *user_data);
+    void (*set_inbox_handler) (GSMDevice device, gsm_inbox_cb handler, void *user_data);
+    void (*poll_inbox) (GSMDevice device);
+    //routes status reports to handler as +CDS instead of storing them, NULL stops them
+    void (*set_report_handler) (GSMDevice device, gsm_report_cb handler, void *user_data);
 };
 extern const struct _gsm gsm;
 
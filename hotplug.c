@@ -0,0 +1,208 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#include "hotplug.h"
+#include "logger.h"
+
+#include <glib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define HOTPLUG_SETTLE 250 //millisecond, udev creates the node before it fixes its permissions
+#define HOTPLUG_POLL_INTERVAL 2000 //millisecond, covers missed events and late permissions
+
+struct watched_port {
+    GSMDevice device;
+    char *directory;
+    char *name;
+    ino_t inode;    //of the node the device has open, 0 while it is offline
+};
+
+struct _t_hotplug {
+    uv_loop_t *loop;
+    uv_timer_t settle;
+    uv_timer_t poll;
+    GPtrArray *ports;
+    GHashTable *watches;    //directory -> uv_fs_event_t
+    int closing;
+};
+
+static Hotplug hotplug_init (uv_loop_t *loop);
+static void hotplug_free (Hotplug *hp);
+static void hotplug_add_device (Hotplug hp, GSMDevice device);
+static void watch_directory (Hotplug hp, const char *directory);
+static void on_fs_event (uv_fs_event_t *handle, const char *filename, int events, int status);
+static void on_settle (uv_timer_t *timer);
+static void on_poll (uv_timer_t *timer);
+static void check_ports (Hotplug hp);
+static void free_port (gpointer data);
+static void on_watch_close (uv_handle_t *handle);
+static void on_hotplug_close (uv_handle_t *handle);
+
+const struct _hotplug hotplug = {
+    .init = &hotplug_init,
+    .free = &hotplug_free,
+    .add_device = &hotplug_add_device
+};
+
+Hotplug hotplug_init (uv_loop_t *loop)
+{
+    Hotplug hp;
+
+    hp = g_new0(struct _t_hotplug, 1);
+    g_assert(hp != NULL);
+    if (hp == NULL)
+        return NULL;
+    hp->loop = loop;
+    hp->ports = g_ptr_array_new_with_free_func(free_port);
+    hp->watches = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    uv_timer_init(loop, &hp->settle);
+    hp->settle.data = hp;
+    uv_timer_init(loop, &hp->poll);
+    hp->poll.data = hp;
+    uv_timer_start(&hp->poll, on_poll, HOTPLUG_POLL_INTERVAL, HOTPLUG_POLL_INTERVAL);
+    return hp;
+}
+
+void hotplug_free (Hotplug *hp)
+{
+    GHashTableIter iter;
+    gpointer handle;
+
+    if (hp == NULL || (*hp) == NULL)
+        return;
+    g_hash_table_iter_init(&iter, (*hp)->watches);
+    while (g_hash_table_iter_next(&iter, NULL, &handle)) {
+        uv_fs_event_stop(handle);
+        uv_close(handle, on_watch_close);
+    }
+    g_hash_table_destroy((*hp)->watches);
+    g_ptr_array_free((*hp)->ports, TRUE);
+    (*hp)->closing = 2;
+    uv_close((uv_handle_t *)&(*hp)->settle, on_hotplug_close);
+    uv_close((uv_handle_t *)&(*hp)->poll, on_hotplug_close);
+    *hp = NULL;
+}
+
+void hotplug_add_device (Hotplug hp, GSMDevice device)
+{
+    struct watched_port *port;
+    struct stat st;
+
+    if (hp == NULL || device == NULL)
+        return;
+    port = g_new0(struct watched_port, 1);
+    g_assert(port != NULL);
+    if (port == NULL)
+        return;
+    port->device = device;
+    port->directory = g_path_get_dirname(gsm.get_port(device));
+    port->name = g_path_get_basename(gsm.get_port(device));
+    if (gsm.is_online(device) && stat(gsm.get_port(device), &st) == 0)
+        port->inode = st.st_ino;
+    g_ptr_array_add(hp->ports, port);
+    watch_directory(hp, port->directory);
+    //a device that started without its port is picked up right away
+    uv_timer_start(&hp->settle, on_settle, HOTPLUG_SETTLE, 0);
+}
+
+void watch_directory (Hotplug hp, const char *directory)
+{
+    uv_fs_event_t *handle;
+    int status;
+
+    if (g_hash_table_contains(hp->watches, directory))
+        return;
+    handle = g_new0(uv_fs_event_t, 1);
+    g_assert(handle != NULL);
+    if (handle == NULL)
+        return;
+    uv_fs_event_init(hp->loop, handle);
+    handle->data = hp;
+    status = uv_fs_event_start(handle, on_fs_event, directory, 0);
+    if (status != 0) {
+        //the directory comes with the first modem, the poll retries it
+        LOG_DEBUG("hotplug: cannot watch %s: %s", directory, uv_strerror(status));
+        uv_close((uv_handle_t *)handle, on_watch_close);
+        return;
+    }
+    g_hash_table_insert(hp->watches, g_strdup(directory), handle);
+}
+
+void on_fs_event (uv_fs_event_t *handle, const char *filename, int events, int status)
+{
+    struct watched_port *port;
+    Hotplug hp;
+
+    (void)events;
+    hp = handle->data;
+    if (status != 0 || filename == NULL)
+        return;
+    ///dev sees every pty and disk, only the names of our ports matter
+    for (guint i = 0; i < hp->ports->len; i++) {
+        port = g_ptr_array_index(hp->ports, i);
+        if (strcmp(port->name, filename) == 0) {
+            uv_timer_start(&hp->settle, on_settle, HOTPLUG_SETTLE, 0);
+            return;
+        }
+    }
+}
+
+void on_settle (uv_timer_t *timer)
+{
+    check_ports(timer->data);
+}
+
+void on_poll (uv_timer_t *timer)
+{
+    Hotplug hp;
+
+    hp = timer->data;
+    for (guint i = 0; i < hp->ports->len; i++)
+        watch_directory(hp, ((struct watched_port *)g_ptr_array_index(hp->ports, i))->directory);
+    check_ports(hp);
+}
+
+void check_ports (Hotplug hp)
+{
+    struct watched_port *port;
+    struct stat st;
+    bool present;
+
+    for (guint i = 0; i < hp->ports->len; i++) {
+        port = g_ptr_array_index(hp->ports, i);
+        present = (stat(gsm.get_port(port->device), &st) == 0);
+        //a quick replug gives the same name to a new node, the open one is dead
+        if (gsm.is_online(port->device) && (!present || st.st_ino != port->inode)) {
+            gsm.disconnect(port->device);
+            port->inode = 0;
+        }
+        if (!gsm.is_online(port->device) && present && gsm.reconnect(port->device))
+            port->inode = st.st_ino;
+    }
+}
+
+void free_port (gpointer data)
+{
+    struct watched_port *port;
+
+    port = data;
+    g_free(port->directory);
+    g_free(port->name);
+    g_free(port);
+}
+
+void on_watch_close (uv_handle_t *handle)
+{
+    g_free(handle);
+}
+
+void on_hotplug_close (uv_handle_t *handle)
+{
+    Hotplug hp;
+
+    hp = handle->data;
+    if (--hp->closing == 0)
+        g_free(hp);
+}
@@ -0,0 +1,26 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_HOTPLUG_H
+#define GSMAPP_HOTPLUG_H
+
+#include "gsm.h"
+
+#include "uv.h"
+
+typedef struct _t_hotplug *Hotplug;
+
+struct _hotplug {
+    Hotplug     (* init) (uv_loop_t *loop);
+    void        (* free) (Hotplug *hotplug);
+
+    //watches the directory of the device port, the device goes offline when its port
+    //disappears or is replaced and comes back once the port can be opened again;
+    ///dev/serial/by-id paths keep a modem matched across USB re-enumeration
+    void        (* add_device) (Hotplug hotplug, GSMDevice device);
+};
+extern const struct _hotplug hotplug;
+
+#endif //GSMAPP_HOTPLUG_H
@@ -0,0 +1,200 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#include "logfile.h"
+#include "logger.h"
+
+#include <glib.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static uint32_t logfile_crc32 (const uint8_t *data, size_t len);
+static size_t logfile_frame (uint8_t *record, size_t body_len);
+static size_t logfile_scan (const uint8_t *data, size_t len, size_t body_min, logfile_record_cb cb,
+                            void *user_data);
+static bool logfile_list (const char *dir, const char *suffix, uint64_t **seqs, size_t *n);
+static char *logfile_path (const char *dir, uint64_t seq, const char *suffix);
+static int logfile_create (const char *dir, const char *path);
+static bool logfile_write (int fd, const char *path, const uint8_t *data, size_t len);
+static bool logfile_map (const char *path, size_t min_len, uint8_t **map, size_t *map_len);
+
+const struct _logfile logfile = {
+    .crc32 = &logfile_crc32,
+    .frame = &logfile_frame,
+    .scan = &logfile_scan,
+    .list = &logfile_list,
+    .path = &logfile_path,
+    .create = &logfile_create,
+    .write = &logfile_write,
+    .map = &logfile_map
+};
+
+static uint32_t crc_table[256];
+
+static gpointer crc_table_init (gpointer data)
+{
+    uint32_t crc;
+
+    (void)data;
+    for (uint32_t i = 0; i < 256; i++) {
+        crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        crc_table[i] = crc;
+    }
+    return NULL;
+}
+
+uint32_t logfile_crc32 (const uint8_t *data, size_t len)
+{
+    static GOnce once = G_ONCE_INIT;
+    uint32_t crc;
+
+    g_once(&once, crc_table_init, NULL);
+    crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++)
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static gint compare_u64 (gconstpointer a, gconstpointer b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+size_t logfile_frame (uint8_t *record, size_t body_len)
+{
+    uint32_t len, crc;
+
+    len = (uint32_t)body_len;
+    crc = logfile_crc32(record + LOGFILE_FRAME_LEN, body_len);
+    memcpy(record, &len, sizeof(len));
+    memcpy(record + 4, &crc, sizeof(crc));
+    return LOGFILE_FRAME_LEN + body_len;
+}
+
+size_t logfile_scan (const uint8_t *data, size_t len, size_t body_min, logfile_record_cb cb, void *user_data)
+{
+    const uint8_t *body;
+    uint32_t body_len, crc;
+    size_t off;
+
+    off = 0;
+    while (len - off >= LOGFILE_FRAME_LEN) {
+        memcpy(&body_len, data + off, 4);
+        memcpy(&crc, data + off + 4, 4);
+        if (body_len < body_min || body_len > len - off - LOGFILE_FRAME_LEN)
+            break;
+        body = data + off + LOGFILE_FRAME_LEN;
+        if (logfile_crc32(body, body_len) != crc || !cb(body, body_len, off, user_data))
+            break;
+        off += LOGFILE_FRAME_LEN + body_len;
+    }
+    return off;
+}
+
+bool logfile_list (const char *dir, const char *suffix, uint64_t **seqs, size_t *n)
+{
+    struct dirent *dirent;
+    GArray *found;
+    uint64_t seq;
+    char tail[8];
+    DIR *dp;
+
+    dp = opendir(dir);
+    if (dp == NULL)
+        return false;
+    found = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+    while ((dirent = readdir(dp)) != NULL) {
+        if (sscanf(dirent->d_name, "%16" SCNx64 "%7s", &seq, tail) == 2 && strcmp(tail, suffix) == 0)
+            g_array_append_val(found, seq);
+    }
+    closedir(dp);
+    g_array_sort(found, compare_u64);
+    *n = found->len;
+    *seqs = (uint64_t *)g_array_free(found, FALSE);
+    return true;
+}
+
+char *logfile_path (const char *dir, uint64_t seq, const char *suffix)
+{
+    return g_strdup_printf("%s/%016" PRIx64 "%s", dir, seq, suffix);
+}
+
+int logfile_create (const char *dir, const char *path)
+{
+    int fd, dir_fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERROR("logfile: cannot create %s: %s", path, strerror(errno));
+        return -1;
+    }
+    //the new file name has to survive a crash as well
+    dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return fd;
+}
+
+bool logfile_write (int fd, const char *path, const uint8_t *data, size_t len)
+{
+    size_t done;
+    ssize_t ret;
+
+    for (done = 0; done < len; done += (size_t)ret) {
+        ret = write(fd, data + done, len - done);
+        if (ret < 0 && errno == EINTR) {
+            ret = 0;
+            continue;
+        }
+        if (ret < 0) {
+            LOG_ERROR("logfile: write to %s failed: %s", path, strerror(errno));
+            return false;
+        }
+    }
+    if (fdatasync(fd) != 0) {
+        LOG_ERROR("logfile: fdatasync %s failed: %s", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool logfile_map (const char *path, size_t min_len, uint8_t **map, size_t *map_len)
+{
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < min_len) {
+        close(fd);
+        return false;
+    }
+    data = NULL;
+    if (st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+    }
+    close(fd);
+    *map = data;
+    *map_len = (size_t)st.st_size;
+    return true;
+}
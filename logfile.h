@@ -0,0 +1,45 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_LOGFILE_H
+#define GSMAPP_LOGFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//u32 body length | u32 crc32 of body | body, host byte order
+#define LOGFILE_FRAME_LEN 8
+
+//offset is where the record starts in the segment, return false to end the valid prefix before it
+typedef bool (* logfile_record_cb) (const uint8_t *body, size_t len, size_t offset, void *user_data);
+
+/*
+ * Append-only segment files shared by the journal and the inbox store.
+ * Records carry their length and a CRC-32 of their body, segments are named
+ * by a 16 digit hex sequence number, and a batch goes out with one write and
+ * one fdatasync. What the records mean is up to the caller.
+ */
+struct _logfile {
+    uint32_t    (* crc32) (const uint8_t *data, size_t len);
+    //fills the header in front of the body_len bytes at record + LOGFILE_FRAME_LEN, returns the record length
+    size_t      (* frame) (uint8_t *record, size_t body_len);
+    //hands cb every intact record with at least body_min bytes, returns the length of that valid prefix
+    size_t      (* scan) (const uint8_t *data, size_t len, size_t body_min, logfile_record_cb cb,
+                          void *user_data);
+
+    //sequence numbers of the segments in dir with the suffix, in order, freed with g_free
+    bool        (* list) (const char *dir, const char *suffix, uint64_t **seqs, size_t *n);
+    char       *(* path) (const char *dir, uint64_t seq, const char *suffix);
+    //an empty segment open for appending, its name durable as well; -1 on failure
+    int         (* create) (const char *dir, const char *path);
+    //the whole batch and its fdatasync, false leaves an unknown part of it behind
+    bool        (* write) (int fd, const char *path, const uint8_t *data, size_t len);
+    //read only, at least the first min_len bytes; an empty file maps to NULL
+    bool        (* map) (const char *path, size_t min_len, uint8_t **map, size_t *map_len);
+};
+extern const struct _logfile logfile;
+
+#endif //GSMAPP_LOGFILE_H
@@ -0,0 +1,363 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#include "logger.h"
+
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define LOG_RING_SLOTS 256 //per thread, power of two
+#define LOG_LINE_MAX 240
+#define LOG_DRAIN_INTERVAL 10000 //microsecond
+
+struct log_record {
+    int64_t time;       //wall clock, microsecond
+    struct log_site *site;
+    uint32_t suppressed;
+    uint8_t level;
+    uint16_t len;
+    char text[LOG_LINE_MAX];
+};
+
+//single producer, its own thread, and a single consumer, the writer
+struct log_ring {
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    _Atomic bool orphaned;  //the thread exited, freed once drained
+    long tid;
+    struct log_ring *next;
+    struct log_record records[LOG_RING_SLOTS];
+};
+
+static bool logger_open (const char *path);
+static void logger_set_level (int level);
+static void logger_flush (void);
+static uint64_t logger_get_dropped (void);
+static void logger_write (struct log_site *site, int level, const char *format, ...);
+static gpointer logger_start (gpointer data);
+static struct log_ring *thread_ring (void);
+static void on_thread_exit (void *data);
+static void *log_writer (void *data);
+static void drain (GString *out);
+static void report_suppressed (GString *out);
+static void format_record (GString *out, const struct log_record *record, long tid);
+static void write_all (int fd, const char *data, size_t len);
+
+const struct _logger logger = {
+    .open = &logger_open,
+    .set_level = &logger_set_level,
+    .flush = &logger_flush,
+    .get_dropped = &logger_get_dropped,
+    .write = &logger_write
+};
+
+_Atomic int logger_threshold = LOG_LEVEL_INFO;
+
+static const char *level_names[] = {"trace", "debug", "info", "warn", "error"};
+
+static GOnce once_logger = G_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread struct log_ring *local_ring;
+static GMutex mutex_rings;
+static GCond cond_flushed;
+static struct log_ring *rings;
+static uint64_t flush_requested;
+static uint64_t flush_done;
+static GMutex mutex_output;
+static int log_fd = STDERR_FILENO;
+static _Atomic uint64_t dropped;
+static _Atomic(struct log_site *) suppressed_sites;
+
+gpointer logger_start (gpointer data)
+{
+    pthread_t writer;
+
+    (void)data;
+    pthread_key_create(&ring_key, on_thread_exit);
+    pthread_create(&writer, NULL, log_writer, NULL);
+    pthread_detach(writer);
+    atexit(logger_flush);
+    return NULL;
+}
+
+bool logger_open (const char *path)
+{
+    int fd, old;
+
+    g_once(&once_logger, logger_start, NULL);
+    fd = STDERR_FILENO;
+    if (path != NULL) {
+        fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            LOG_ERROR("logger: cannot open %s: %s", path, strerror(errno));
+            return false;
+        }
+    }
+    logger_flush();
+    g_mutex_lock(&mutex_output);
+    old = log_fd;
+    log_fd = fd;
+    g_mutex_unlock(&mutex_output);
+    if (old != STDERR_FILENO)
+        close(old);
+    return true;
+}
+
+void logger_set_level (int level)
+{
+    atomic_store_explicit(&logger_threshold, (int)level, memory_order_relaxed);
+}
+
+uint64_t logger_get_dropped (void)
+{
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+void logger_flush (void)
+{
+    uint64_t ticket;
+
+    g_once(&once_logger, logger_start, NULL);
+    g_mutex_lock(&mutex_rings);
+    ticket = ++flush_requested;
+    while (flush_done < ticket)
+        g_cond_wait(&cond_flushed, &mutex_rings);
+    g_mutex_unlock(&mutex_rings);
+}
+
+struct log_ring *thread_ring (void)
+{
+    struct log_ring *ring;
+
+    if (local_ring != NULL)
+        return local_ring;
+    g_once(&once_logger, logger_start, NULL);
+    ring = g_new0(struct log_ring, 1);
+    ring->tid = syscall(SYS_gettid);
+    pthread_setspecific(ring_key, ring);
+    g_mutex_lock(&mutex_rings);
+    ring->next = rings;
+    rings = ring;
+    g_mutex_unlock(&mutex_rings);
+    local_ring = ring;
+    return ring;
+}
+
+void on_thread_exit (void *data)
+{
+    struct log_ring *ring;
+
+    ring = data;
+    atomic_store_explicit(&ring->orphaned, true, memory_order_release);
+}
+
+void logger_write (struct log_site *site, int level, const char *format, ...)
+{
+    struct log_record *record;
+    struct log_ring *ring;
+    uint64_t head, tail;
+    int64_t second, now;
+    va_list args;
+    int len;
+
+    now = g_get_monotonic_time() / G_USEC_PER_SEC;
+    second = atomic_load_explicit(&site->second, memory_order_relaxed);
+    if (second != now &&
+        atomic_compare_exchange_strong_explicit(&site->second, &second, now,
+                                                memory_order_relaxed, memory_order_relaxed))
+        atomic_store_explicit(&site->count, 0, memory_order_relaxed);
+    if (atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed) >= LOG_RATE_BURST) {
+        atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+        if (!atomic_exchange_explicit(&site->listed, true, memory_order_relaxed)) {
+            site->level = (int)level;
+            site->next = atomic_load_explicit(&suppressed_sites, memory_order_relaxed);
+            while (!atomic_compare_exchange_weak_explicit(&suppressed_sites, &site->next, site,
+                                                          memory_order_release, memory_order_relaxed));
+        }
+        return;
+    }
+
+    ring = thread_ring();
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    //a full ring drops the record rather than wait for the writer
+    if (tail - head >= LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+    record = &ring->records[tail & (LOG_RING_SLOTS - 1)];
+    record->time = g_get_real_time();
+    record->site = site;
+    record->level = (uint8_t)level;
+    record->suppressed = atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+    va_start(args, format);
+    len = vsnprintf(record->text, LOG_LINE_MAX, format, args);
+    va_end(args);
+    record->len = (uint16_t)CLAMP(len, 0, LOG_LINE_MAX - 1);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+void *log_writer (void *data)
+{
+    struct log_site site = {.file = __FILE__, .line = __LINE__, .level = LOG_LEVEL_WARN};
+    struct log_record record = {0};
+    uint64_t ticket, lost, reported;
+    GString *out;
+
+    (void)data;
+    out = g_string_sized_new(64 * 1024);
+    reported = 0;
+    while (true) {
+        g_mutex_lock(&mutex_rings);
+        ticket = flush_requested;
+        drain(out);
+        g_mutex_unlock(&mutex_rings);
+        report_suppressed(out);
+        lost = atomic_load_explicit(&dropped, memory_order_relaxed);
+        if (lost != reported) {
+            record.time = g_get_real_time();
+            record.site = &site;
+            record.level = LOG_LEVEL_WARN;
+            record.len = (uint16_t)snprintf(record.text, LOG_LINE_MAX, "logger: %" G_GUINT64_FORMAT
+                                            " records dropped, rings full", lost - reported);
+            format_record(out, &record, syscall(SYS_gettid));
+            reported = lost;
+        }
+        if (out->len > 0) {
+            g_mutex_lock(&mutex_output);
+            write_all(log_fd, out->str, out->len);
+            g_mutex_unlock(&mutex_output);
+            g_string_truncate(out, 0);
+        }
+        g_mutex_lock(&mutex_rings);
+        if (flush_done < ticket) {
+            flush_done = ticket;
+            g_cond_broadcast(&cond_flushed);
+        }
+        g_mutex_unlock(&mutex_rings);
+        if (ticket == flush_requested)
+            g_usleep(LOG_DRAIN_INTERVAL);
+    }
+    return NULL;
+}
+
+//mutex_rings held
+void drain (GString *out)
+{
+    struct log_ring *ring, **link;
+    struct log_record *record;
+    uint64_t head, tail;
+    bool orphaned;
+
+    for (link = &rings; (ring = *link) != NULL;) {
+        orphaned = atomic_load_explicit(&ring->orphaned, memory_order_acquire);
+        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        for (; head != tail; head++) {
+            record = &ring->records[head & (LOG_RING_SLOTS - 1)];
+            format_record(out, record, ring->tid);
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+        if (orphaned) {
+            *link = ring->next;
+            g_free(ring);
+            continue;
+        }
+        link = &ring->next;
+    }
+}
+
+//sites that went quiet after hitting the rate limit still get their count reported
+void report_suppressed (GString *out)
+{
+    struct log_site *site, *next;
+    struct log_record record = {0};
+    uint32_t count;
+    int64_t now;
+
+    now = g_get_monotonic_time() / G_USEC_PER_SEC;
+    site = atomic_exchange_explicit(&suppressed_sites, NULL, memory_order_acquire);
+    for (; site != NULL; site = next) {
+        next = site->next;
+        //still inside the second that tripped the limit, look again on the next pass
+        if (atomic_load_explicit(&site->second, memory_order_relaxed) == now) {
+            site->next = atomic_load_explicit(&suppressed_sites, memory_order_relaxed);
+            while (!atomic_compare_exchange_weak_explicit(&suppressed_sites, &site->next, site,
+                                                          memory_order_release, memory_order_relaxed));
+            continue;
+        }
+        atomic_store_explicit(&site->listed, false, memory_order_relaxed);
+        count = atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+        if (count == 0)
+            continue;
+        record.time = g_get_real_time();
+        record.site = site;
+        record.level = (uint8_t)site->level;
+        record.suppressed = count;
+        record.len = (uint16_t)g_strlcpy(record.text, "repeated message suppressed", LOG_LINE_MAX);
+        format_record(out, &record, 0);
+    }
+}
+
+//logfmt: ts=... level=... tid=... src=file:line msg="..."
+void format_record (GString *out, const struct log_record *record, long tid)
+{
+    const char *file;
+    struct tm tm;
+    time_t seconds;
+    char stamp[32];
+    unsigned char c;
+
+    seconds = (time_t)(record->time / G_USEC_PER_SEC);
+    gmtime_r(&seconds, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    file = strrchr(record->site->file, '/');
+    file = (file != NULL) ? file + 1 : record->site->file;
+    g_string_append_printf(out, "ts=%s.%06dZ level=%s tid=%ld src=%s:%d msg=\"", stamp,
+                           (int)(record->time % G_USEC_PER_SEC), level_names[record->level], tid,
+                           file, record->site->line);
+    for (uint16_t i = 0; i < record->len; i++) {
+        c = (unsigned char)record->text[i];
+        if (c == '"' || c == '\\') {
+            g_string_append_c(out, '\\');
+            g_string_append_c(out, (gchar)c);
+        } else if (c == '\n') {
+            g_string_append(out, "\\n");
+        } else if (c == '\r') {
+            g_string_append(out, "\\r");
+        } else if (c < 0x20 || c == 0x7F) {
+            g_string_append_printf(out, "\\x%02x", c);
+        } else {
+            g_string_append_c(out, (gchar)c);
+        }
+    }
+    g_string_append_c(out, '"');
+    if (record->suppressed > 0)
+        g_string_append_printf(out, " suppressed=%u", record->suppressed);
+    g_string_append_c(out, '\n');
+}
+
+void write_all (int fd, const char *data, size_t len)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = write(fd, data, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return;
+        data += ret;
+        len -= (size_t)ret;
+    }
+}
@@ -0,0 +1,79 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_LOGGER_H
+#define GSMAPP_LOGGER_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+//plain numbers, the preprocessor compares them with LOG_COMPILE_LEVEL and sees enum constants as 0
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_WARN  3
+#define LOG_LEVEL_ERROR 4
+
+//levels below this are compiled out, arguments included; a level name or its number
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+//a call site logs at most this many records per second, the rest are counted and reported
+#define LOG_RATE_BURST 20
+
+struct log_site {
+    const char *file;
+    int line;
+    _Atomic int64_t second;
+    _Atomic uint32_t count;
+    _Atomic uint32_t suppressed;
+    //queued for the writer to report the suppressed count if the site stays quiet
+    _Atomic bool listed;
+    int level;
+    struct log_site *next;
+};
+
+struct _logger {
+    //NULL writes to stderr, otherwise the file is opened for append
+    bool        (* open) (const char *path);
+    void        (* set_level) (int level);
+    //waits until everything logged so far is written
+    void        (* flush) (void);
+    //records lost because a thread's ring was full
+    uint64_t    (* get_dropped) (void);
+
+    //formats on the calling thread into its own ring, never blocks; use the LOG_* macros
+    void        (* write) (struct log_site *site, int level, const char *format, ...)
+                    __attribute__((format(printf, 3, 4)));
+};
+extern const struct _logger logger;
+extern _Atomic int logger_threshold;
+
+#define LOG_AT(LEVEL, ...) do { \
+    static struct log_site log_site_ = {.file = __FILE__, .line = __LINE__}; \
+    if ((int)(LEVEL) >= atomic_load_explicit(&logger_threshold, memory_order_relaxed)) \
+        logger.write(&log_site_, (LEVEL), __VA_ARGS__); \
+} while (0)
+
+#if LOG_COMPILE_LEVEL < LOG_LEVEL_TRACE || LOG_COMPILE_LEVEL > LOG_LEVEL_ERROR
+#error "LOG_COMPILE_LEVEL must be one of LOG_LEVEL_TRACE .. LOG_LEVEL_ERROR"
+#endif
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) do { } while (0)
+#endif
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do { } while (0)
+#endif
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif //GSMAPP_LOGGER_H
@@ -1,11 +1,24 @@
+#include "discovery.h"
+#include "fleet.h"
 #include "gsm.h"
+#include "hotplug.h"
+#include "logger.h"
+#include "metrics.h"
+#include "server.h"
+#include "shmring.h"
+#include "smpp.h"
 #include "smartpointer.h"
+#include "trace.h"
 #include "version.h"
 
 #include "uv.h"
 
+#include <glib.h>
+
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 struct testsmart{
     char *name;
@@ -51,10 +64,113 @@ void print_version() {
     printf("Build Time: %s\n", __TIME__);
 }
 
+void print_network_state(uv_timer_t *timer) {
+    static struct gsm_network_state last;
+    struct gsm_network_state state;
+
+    if (!gsm.get_network_state((GSMDevice)timer->data, &state))
+        return;
+    if (state.registration == last.registration && state.lac == last.lac &&
+        state.ci == last.ci && state.rssi == last.rssi && state.ber == last.ber)
+        return;
+    last = state;
+    LOG_INFO("network: reg=%d lac=%04X ci=%X rssi=%u ber=%u",
+             state.registration, state.lac, state.ci, state.rssi, state.ber);
+}
+
+void check_replay(uv_timer_t *timer) {
+    struct trace_replay_stats stats;
+
+    if (!trace.get_replay_stats((TraceReplay)timer->data, &stats))
+        return;
+    if (stats.stalled || stats.tx_mismatched > 0)
+        LOG_ERROR("replay: diverged after %zu records, %zu of %zu written bytes differ",
+                  stats.records, stats.tx_mismatched, stats.tx_bytes);
+    else
+        LOG_INFO("replay: %zu records matched in %.3fs", stats.records, (double)stats.elapsed / 1e6);
+    uv_stop(timer->loop);
+}
+
+struct startup {
+    Wal journal;
+    Store inbox;
+    Trace recorder;
+    GPtrArray *devices;
+    const struct gsm_rate_limit *rate_limit;
+};
+
+GSMDevice start_device(const char *port, enum gsm_vendor_model vendor, struct startup *startup) {
+    GSMDevice device;
+
+    device = gsm.init(port, vendor);
+    if (device == NULL)
+        return NULL;
+    gsm.set_trace(device, startup->recorder);
+    gsm.set_rate_limit(device, startup->rate_limit);
+    //journal resends would not be in the recording, a replay runs without one
+    if (startup->journal != NULL)
+        gsm.set_wal(device, startup->journal);
+    if (startup->inbox != NULL)
+        gsm.set_store(device, startup->inbox);
+    fleet.add(device);
+    g_ptr_array_add(startup->devices, device);
+    return device;
+}
+
+bool print_stored(const struct store_message *message, void *user_data) {
+    char received[32];
+    time_t time;
+
+    (void)user_data;
+    time = (time_t)message->received;
+    strftime(received, sizeof(received), "%Y-%m-%dT%H:%M:%SZ", gmtime(&time));
+    printf("%" PRIu64 " %s %.*s %.*s: %.*s\n", message->id, received,
+           (int)message->port_len, message->port, (int)message->sender_len, message->sender,
+           (int)message->text_len, message->text);
+    return true;
+}
+
+//support lookup of received messages, <sender or -> <from> <to> in unix seconds
+int query_inbox(const char *sender, const char *from, const char *to) {
+    Store inbox;
+    size_t count;
+
+    //the gateway may be running and appending to the same store
+    inbox = store.open_readonly("gsmapp-store");
+    if (inbox == NULL)
+        return 1;
+    count = store.query(inbox, strcmp(sender, "-") == 0 ? NULL : sender,
+                        g_ascii_strtoll(from, NULL, 10), g_ascii_strtoll(to, NULL, 10), print_stored, NULL);
+    LOG_INFO("store: %zu of %zu messages matched", count, store.get_count(inbox));
+    store.close(&inbox);
+    return 0;
+}
+
+void start_discovered(const struct discovery_result *result, void *user_data) {
+    start_device(result->port, result->vendor, (struct startup *)user_data);
+}
+
 int main(int argc, char *argv[]) {
-    uv_tcp_t server;
-    struct sockaddr_in bind_addr;
+    uv_timer_t network_timer;
+    Server submit_server;
+    Smpp smpp_server;
+    ShmRing submit_ring;
+    Metrics metrics_server;
+    Hotplug port_watch;
+    uv_timer_t replay_timer;
+    const char *trace_path, *replay_path, *port;
+    struct startup startup;
+    struct gsm_rate_limit rate_limit;
+    GSMDevice gsm_device;
+    TraceReplay replay;
+    double replay_speed;
+    bool discover;
 
+    trace_path = NULL;
+    replay_path = NULL;
+    replay_speed = 1.0;
+    discover = false;
+    startup.rate_limit = NULL;
     for (int i = 1; i < argc; i++) {
         // Version checks
         if (strcmp(argv[i], "-v") == 0 || 
@@ -62,27 +178,109 @@ int main(int argc, char *argv[]) {
             print_version();
             return 0;
         }
+        if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            trace_path = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+            replay_path = argv[++i];
+        else if (strcmp(argv[i], "--replay-fast") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+            replay_speed = 0;
+        }
+        else if (strcmp(argv[i], "--discover") == 0)
+            discover = true;
+        else if (strcmp(argv[i], "--inbox") == 0 && i + 3 < argc)
+            return query_inbox(argv[i + 1], argv[i + 2], argv[i + 3]);
+        //per SIM, <per second>:<burst>:<per day>
+        else if (strcmp(argv[i], "--rate-limit") == 0 && i + 1 < argc) {
+            memset(&rate_limit, 0, sizeof(rate_limit));
+            if (sscanf(argv[++i], "%lf:%u:%u", &rate_limit.per_second, &rate_limit.burst,
+                       &rate_limit.per_day) < 1) {
+                LOG_ERROR("--rate-limit expects <per second>:<burst>:<per day>");
+                return 1;
+            }
+            startup.rate_limit = &rate_limit;
+        }
     }
     test_scope();
 
-    GSMDevice gsm_device = gsm.init("/dev/ttyUSB0", GSM_AI_A7);
-
-    gsm.send_sms(gsm_device,"gholi", "09214528198");
-    uv_sleep(200);
-    while (1) {
-//        buffer.push(ring_buffer, "GHOLI \r\n \r   i \n");
-//        gsm.send_sms(gsm_device,"aa","09214528198");
-        gsm.register_sim(gsm_device);
-        uv_sleep(400);
+    port = "/dev/ttyUSB0";
+    startup.recorder = NULL;
+    startup.journal = NULL;
+    startup.inbox = NULL;
+    startup.devices = g_ptr_array_new();
+    replay = NULL;
+    if (replay_path != NULL) {
+        //the recorded modem answers on a pseudo terminal
+        replay = trace.replay(replay_path, port, replay_speed);
+        if (replay == NULL)
+            return 1;
+        port = trace.get_replay_port(replay);
+    } else {
+        startup.journal = wal.open("gsmapp-wal");
+        if (startup.journal == NULL)
+            return 1;
+        startup.inbox = store.open("gsmapp-store");
+        if (startup.inbox == NULL)
+            return 1;
+    }
+    if (trace_path != NULL) {
+        startup.recorder = trace.open(trace_path);
+        if (startup.recorder == NULL)
+            return 1;
+    }
+    if (discover && replay == NULL)
+        discovery.scan(NULL, 5000, start_discovered, &startup);
+    else
+        start_device(port, GSM_AI_A7, &startup);
+    if (startup.devices->len == 0) {
+        LOG_ERROR("no modem to start");
+        return 1;
     }
+    gsm_device = g_ptr_array_index(startup.devices, 0);
 
+    SMSHandle handle = gsm.send_sms(gsm_device,"gholi", "09214528198");
+    sms_handle.free(&handle);
 
-    uv_tcp_init(uv_default_loop(), &server);
-    uv_ip4_addr("0.0.0.0", 2986, &bind_addr);
-    uv_tcp_bind(&server, (const struct sockaddr *)&bind_addr, 0);
-    uv_listen((uv_stream_t *)&server, 128, NULL);
+    uv_timer_init(uv_default_loop(), &network_timer);
+    network_timer.data = gsm_device;
+    uv_timer_start(&network_timer, print_network_state, 1000, 1000);
+    if (replay != NULL) {
+        uv_timer_init(uv_default_loop(), &replay_timer);
+        replay_timer.data = replay;
+        uv_timer_start(&replay_timer, check_replay, 100, 100);
+    }
+
+    submit_server = server.init(uv_default_loop(), "0.0.0.0", 2986);
+    if (submit_server == NULL)
+        return 1;
+    smpp_server = smpp.init(uv_default_loop(), "0.0.0.0", 2775, NULL, NULL);
+    if (smpp_server == NULL)
+        return 1;
+    for (guint i = 0; i < startup.devices->len; i++)
+        smpp.add_device(smpp_server, g_ptr_array_index(startup.devices, i));
+    submit_ring = shm_ring.serve(uv_default_loop(), "/tmp/gsmapp.sock");
+    if (submit_ring == NULL)
+        return 1;
+    metrics_server = metrics.init(uv_default_loop(), "0.0.0.0", 9100);
+    if (metrics_server == NULL)
+        return 1;
+    for (guint i = 0; i < startup.devices->len; i++)
+        metrics.add_device(metrics_server, g_ptr_array_index(startup.devices, i));
+    //unplugged modems come back on their own, a replayed one never leaves
+    port_watch = NULL;
+    if (replay == NULL) {
+        port_watch = hotplug.init(uv_default_loop());
+        for (guint i = 0; i < startup.devices->len; i++)
+            hotplug.add_device(port_watch, g_ptr_array_index(startup.devices, i));
+    }
     uv_run(uv_default_loop(), UV_RUN_DEFAULT);
     uv_loop_close(uv_default_loop());
+    wal.close(&startup.journal);
+    store.close(&startup.inbox);
+    for (guint i = 0; i < startup.devices->len; i++)
+        gsm.set_trace(g_ptr_array_index(startup.devices, i), NULL);
+    trace.close(&startup.recorder);
+    trace.free_replay(&replay);
 
 //    gsm.free(&gsm_device);
     return 0;
@@ -0,0 +1,342 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#include "metrics.h"
+#include "logger.h"
+
+#include <glib.h>
+#include <stddef.h>
+#include <string.h>
+
+#define METRICS_BACKLOG 16
+#define METRICS_REQUEST_LEN 1024
+
+typedef struct _t_scrape *Scrape;
+
+struct _t_metrics {
+    uv_loop_t *loop;
+    uv_tcp_t tcp;
+    GPtrArray *devices;
+    int handles;        //listener plus open scrapes, freed when it drops to zero
+    bool closing;
+};
+
+//one request, answered with a snapshot and closed
+struct _t_scrape {
+    Metrics metrics;
+    uv_tcp_t tcp;
+    uv_write_t write_req;
+    GString *text;
+    char rx[METRICS_REQUEST_LEN];
+    bool answered;
+};
+
+static void metrics_record (struct metrics_histogram *histogram, uint64_t value);
+static uint64_t metrics_get_percentile (struct metrics_histogram *histogram, double percentile);
+static Metrics metrics_init (uv_loop_t *loop, const char *address, int port);
+static void metrics_free (Metrics *metrics);
+static void metrics_add_device (Metrics metrics, GSMDevice device);
+static void metrics_release (Metrics metrics);
+static size_t bucket_index (uint64_t value);
+static uint64_t bucket_value (size_t index);
+static void on_connection (uv_stream_t *stream, int status);
+static void on_alloc (uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
+static void on_read (uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+static void on_write (uv_write_t *req, int status);
+static void on_scrape_close (uv_handle_t *handle);
+static void on_metrics_close (uv_handle_t *handle);
+static void render (Metrics metrics, GString *text);
+static void render_latency (GString *text, const char *port, const char *command, const char *stage,
+                            const struct gsm_latency *latency);
+
+const struct _metrics metrics = {
+    .record = &metrics_record,
+    .get_percentile = &metrics_get_percentile,
+    .init = &metrics_init,
+    .free = &metrics_free,
+    .add_device = &metrics_add_device
+};
+
+size_t bucket_index (uint64_t value)
+{
+    int magnitude;
+
+    if (value < METRICS_SUB_BUCKETS)
+        return (size_t)value;
+    //highest set bit picks the power of two, the next four bits the bucket inside it
+    magnitude = 63 - __builtin_clzll(value);
+    if (magnitude - 3 >= METRICS_MAGNITUDES)
+        return METRICS_BUCKETS - 1;
+    return (size_t)(magnitude - 3) * METRICS_SUB_BUCKETS +
+           (size_t)((value >> (magnitude - 4)) - METRICS_SUB_BUCKETS);
+}
+
+//middle of the range the bucket covers
+uint64_t bucket_value (size_t index)
+{
+    size_t magnitude, sub;
+
+    magnitude = index / METRICS_SUB_BUCKETS;
+    sub = index % METRICS_SUB_BUCKETS;
+    if (magnitude == 0)
+        return sub;
+    return ((uint64_t)(METRICS_SUB_BUCKETS + sub) << (magnitude - 1)) +
+           ((UINT64_C(1) << (magnitude - 1)) >> 1);
+}
+
+void metrics_record (struct metrics_histogram *histogram, uint64_t value)
+{
+    uint64_t max;
+
+    atomic_fetch_add_explicit(&histogram->counts[bucket_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+    max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while (value > max &&
+           !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value,
+                                                  memory_order_relaxed, memory_order_relaxed));
+}
+
+uint64_t metrics_get_percentile (struct metrics_histogram *histogram, double percentile)
+{
+    uint64_t total, rank, seen;
+
+    total = atomic_load_explicit(&histogram->total, memory_order_relaxed);
+    if (total == 0)
+        return 0;
+    rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+    rank = CLAMP(rank, 1, total);
+    seen = 0;
+    for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+        seen += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+        if (seen >= rank)
+            return MIN(bucket_value(i), atomic_load_explicit(&histogram->max, memory_order_relaxed));
+    }
+    //counts raced ahead of total while we were reading
+    return atomic_load_explicit(&histogram->max, memory_order_relaxed);
+}
+
+Metrics metrics_init (uv_loop_t *loop, const char *address, int port)
+{
+    struct sockaddr_in bind_addr;
+    Metrics srv;
+    int ret;
+
+    srv = g_new0(struct _t_metrics, 1);
+    g_assert(srv != NULL);
+    if (srv == NULL)
+        return NULL;
+    srv->loop = loop;
+    srv->devices = g_ptr_array_new();
+    uv_tcp_init(loop, &srv->tcp);
+    srv->tcp.data = srv;
+    srv->handles = 1;
+
+    ret = uv_ip4_addr(address, port, &bind_addr);
+    if (ret == 0)
+        ret = uv_tcp_bind(&srv->tcp, (const struct sockaddr *)&bind_addr, 0);
+    if (ret == 0)
+        ret = uv_listen((uv_stream_t *)&srv->tcp, METRICS_BACKLOG, on_connection);
+    if (ret != 0) {
+        LOG_ERROR("metrics: listen on %s:%d failed: %s", address, port, uv_strerror(ret));
+        metrics_free(&srv);
+        return NULL;
+    }
+    return srv;
+}
+
+void metrics_free (Metrics *srv)
+{
+    if (srv == NULL || (*srv) == NULL)
+        return;
+    (*srv)->closing = true;
+    uv_close((uv_handle_t *)&(*srv)->tcp, on_metrics_close);
+    *srv = NULL;
+}
+
+void metrics_add_device (Metrics srv, GSMDevice device)
+{
+    if (srv == NULL || device == NULL)
+        return;
+    g_ptr_array_add(srv->devices, device);
+}
+
+void metrics_release (Metrics srv)
+{
+    if (--srv->handles > 0)
+        return;
+    g_ptr_array_free(srv->devices, TRUE);
+    g_free(srv);
+}
+
+void on_metrics_close (uv_handle_t *handle)
+{
+    metrics_release(handle->data);
+}
+
+void on_connection (uv_stream_t *stream, int status)
+{
+    Scrape scrape;
+    Metrics srv;
+
+    srv = stream->data;
+    if (status < 0 || srv->closing)
+        return;
+    scrape = g_new0(struct _t_scrape, 1);
+    g_assert(scrape != NULL);
+    if (scrape == NULL)
+        return;
+    scrape->metrics = srv;
+    uv_tcp_init(srv->loop, &scrape->tcp);
+    scrape->tcp.data = scrape;
+    srv->handles++;
+    if (uv_accept(stream, (uv_stream_t *)&scrape->tcp) != 0 ||
+        uv_read_start((uv_stream_t *)&scrape->tcp, on_alloc, on_read) != 0)
+        uv_close((uv_handle_t *)&scrape->tcp, on_scrape_close);
+}
+
+void on_alloc (uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+{
+    Scrape scrape;
+
+    (void)suggested_size;
+    scrape = handle->data;
+    buf->base = scrape->rx;
+    buf->len = sizeof(scrape->rx);
+}
+
+//whatever the request says, the answer is the full snapshot
+void on_read (uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+    uv_buf_t out;
+    Scrape scrape;
+    GString *body;
+
+    (void)buf;
+    scrape = stream->data;
+    if (nread == 0)
+        return;
+    if (nread < 0 || scrape->answered) {
+        if (!uv_is_closing((uv_handle_t *)stream))
+            uv_close((uv_handle_t *)stream, on_scrape_close);
+        return;
+    }
+    scrape->answered = true;
+    uv_read_stop(stream);
+    body = g_string_sized_new(16384);
+    render(scrape->metrics, body);
+    scrape->text = g_string_sized_new(body->len + 128);
+    g_string_append_printf(scrape->text,
+                           "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: %zu\r\n\r\n", body->len);
+    g_string_append_len(scrape->text, body->str, (gssize)body->len);
+    g_string_free(body, TRUE);
+    scrape->write_req.data = scrape;
+    out = uv_buf_init(scrape->text->str, (unsigned int)scrape->text->len);
+    if (uv_write(&scrape->write_req, stream, &out, 1, on_write) != 0)
+        uv_close((uv_handle_t *)stream, on_scrape_close);
+}
+
+void on_write (uv_write_t *req, int status)
+{
+    Scrape scrape;
+
+    (void)status;
+    scrape = req->data;
+    if (!uv_is_closing((uv_handle_t *)&scrape->tcp))
+        uv_close((uv_handle_t *)&scrape->tcp, on_scrape_close);
+}
+
+void on_scrape_close (uv_handle_t *handle)
+{
+    Scrape scrape;
+    Metrics srv;
+
+    scrape = handle->data;
+    srv = scrape->metrics;
+    if (scrape->text != NULL)
+        g_string_free(scrape->text, TRUE);
+    g_free(scrape);
+    metrics_release(srv);
+}
+
+void render_latency (GString *text, const char *port, const char *command, const char *stage,
+                     const struct gsm_latency *latency)
+{
+    static const struct {
+        const char *name;
+        size_t offset;
+    } quantiles[] = {
+        {"0.5", offsetof(struct gsm_latency, p50)},
+        {"0.9", offsetof(struct gsm_latency, p90)},
+        {"0.99", offsetof(struct gsm_latency, p99)},
+        {"0.999", offsetof(struct gsm_latency, p999)},
+        {"1", offsetof(struct gsm_latency, max)},
+    };
+
+    if (latency->count == 0)
+        return;
+    for (size_t i = 0; i < G_N_ELEMENTS(quantiles); i++)
+        g_string_append_printf(text,
+                               "gsm_command_latency_microseconds{port=\"%s\",command=\"%s\",stage=\"%s\","
+                               "quantile=\"%s\"} %" G_GUINT64_FORMAT "\n", port, command, stage,
+                               quantiles[i].name,
+                               *(const uint64_t *)((const uint8_t *)latency + quantiles[i].offset));
+    g_string_append_printf(text,
+                           "gsm_command_latency_microseconds_sum{port=\"%s\",command=\"%s\",stage=\"%s\"} %"
+                           G_GUINT64_FORMAT "\n", port, command, stage, latency->sum);
+    g_string_append_printf(text,
+                           "gsm_command_latency_microseconds_count{port=\"%s\",command=\"%s\",stage=\"%s\"} %"
+                           G_GUINT64_FORMAT "\n", port, command, stage, latency->count);
+}
+
+void render (Metrics srv, GString *text)
+{
+    struct gsm_command_stats *command;
+    struct gsm_stats *stats;
+    const char *port, *name;
+
+    stats = g_new(struct gsm_stats, 1);
+    g_string_append(text, "# TYPE gsm_bytes_total counter\n"
+                          "# TYPE gsm_sms_pending gauge\n"
+                          "# TYPE gsm_commands_queued gauge\n"
+                          "# TYPE gsm_modem_resets_total counter\n"
+                          "# TYPE gsm_commands_total counter\n"
+                          "# TYPE gsm_command_timeouts_total counter\n"
+                          "# TYPE gsm_command_errors_total counter\n"
+                          "# TYPE gsm_command_latency_microseconds summary\n"
+                          "# TYPE gsm_error_codes_total counter\n");
+    for (guint i = 0; i < srv->devices->len; i++) {
+        if (!gsm.get_stats(g_ptr_array_index(srv->devices, i), stats))
+            continue;
+        port = gsm.get_port(g_ptr_array_index(srv->devices, i));
+        g_string_append_printf(text, "gsm_bytes_total{port=\"%s\",direction=\"tx\"} %" G_GUINT64_FORMAT "\n"
+                                     "gsm_bytes_total{port=\"%s\",direction=\"rx\"} %" G_GUINT64_FORMAT "\n"
+                                     "gsm_sms_pending{port=\"%s\"} %zu\n"
+                                     "gsm_commands_queued{port=\"%s\"} %zu\n"
+                                     "gsm_modem_resets_total{port=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                               port, stats->bytes_tx, port, stats->bytes_rx,
+                               port, stats->sms_pending, port, stats->commands_queued, port, stats->resets);
+        for (int c = 0; c < GSM_COMMAND_COUNT; c++) {
+            command = &stats->commands[c];
+            if (command->commands == 0)
+                continue;
+            name = gsm.get_command_name((enum gsm_command)c);
+            g_string_append_printf(text,
+                                   "gsm_commands_total{port=\"%s\",command=\"%s\"} %" G_GUINT64_FORMAT "\n"
+                                   "gsm_command_timeouts_total{port=\"%s\",command=\"%s\"} %" G_GUINT64_FORMAT "\n"
+                                   "gsm_command_errors_total{port=\"%s\",command=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                                   port, name, command->commands, port, name, command->timeouts,
+                                   port, name, command->errors);
+            render_latency(text, port, name, "queued", &command->queued);
+            render_latency(text, port, name, "response", &command->response);
+        }
+        for (int code = 0; code < GSM_STATS_ERROR_CODES; code++)
+            if (stats->error_codes[code] != 0)
+                g_string_append_printf(text, "gsm_error_codes_total{port=\"%s\",code=\"%d\"} %"
+                                       G_GUINT64_FORMAT "\n", port, code, stats->error_codes[code]);
+    }
+    g_free(stats);
+}
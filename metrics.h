@@ -0,0 +1,45 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_METRICS_H
+#define GSMAPP_METRICS_H
+
+#include "gsm.h"
+#include "uv.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * Log-linear histogram: values below 16 are exact, every power of two above
+ * is split into 16 buckets, so a recorded value is off by at most 1/16.
+ * Recording is a few relaxed atomic adds and safe from any thread.
+ */
+#define METRICS_SUB_BUCKETS 16
+#define METRICS_MAGNITUDES 40
+#define METRICS_BUCKETS (METRICS_SUB_BUCKETS * METRICS_MAGNITUDES)
+
+struct metrics_histogram {
+    _Atomic uint64_t counts[METRICS_BUCKETS];
+    _Atomic uint64_t total;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+};
+
+typedef struct _t_metrics *Metrics;
+
+struct _metrics {
+    void        (* record) (struct metrics_histogram *histogram, uint64_t value);
+    //percentile in 0-100, 0 when nothing was recorded
+    uint64_t    (* get_percentile) (struct metrics_histogram *histogram, double percentile);
+
+    //plain-text exposition of every added device for any request on address:port
+    Metrics     (* init) (uv_loop_t *loop, const char *address, int port);
+    void        (* free) (Metrics *metrics);
+    void        (* add_device) (Metrics metrics, GSMDevice device);
+};
+extern const struct _metrics metrics;
+
+#endif //GSMAPP_METRICS_H
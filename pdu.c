@@ -0,0 +1,620 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#include "pdu.h"
+
+#include <glib.h>
+#include <string.h>
+#include <time.h>
+
+#define GSM7_SINGLE_LEN 160
+#define GSM7_PART_LEN 153
+#define UCS2_SINGLE_LEN 70
+#define UCS2_PART_LEN 67
+#define GSM7_ESCAPE 0x1B
+#define UDH_CONCAT_LEN 6
+//first octet, MR, DA length, DA type, 10 DA octets, PID, DCS
+#define PDU_HEADER_MAX_LEN 16
+#define NUMBER_MAX_DIGITS 20
+
+#define REVERSE_BASIC 0x100
+#define REVERSE_EXTENDED 0x200
+#define REVERSE_TABLE_LEN 0x400
+
+static PduMessage pdu_init (const char *message, const char *number, uint8_t reference);
+static void pdu_free (PduMessage *pdu_message);
+static size_t pdu_get_part_count (PduMessage pdu_message);
+static enum pdu_encoding pdu_get_encoding (PduMessage pdu_message);
+static size_t pdu_get_part (PduMessage pdu_message, size_t index, char *hex);
+static bool pdu_fits_text_mode (const char *message);
+static bool pdu_decode (const char *hex, struct pdu_deliver *deliver);
+static void pdu_request_report (PduMessage pdu_message);
+static bool pdu_decode_status_report (const char *hex, struct pdu_status_report *report);
+
+static gpointer reverse_init (gpointer data);
+static uint16_t gsm7_lookup (gunichar c);
+static size_t build_header (uint8_t *header, const char *number, enum pdu_encoding encoding,
+                            bool concatenated);
+static size_t split_parts (PduMessage pdu_message);
+static size_t pack_septets (const uint16_t *septets, size_t count, unsigned fill, uint8_t *out);
+static size_t hex_to_octets (const char *hex, uint8_t *octets, size_t max);
+static size_t unpack_septets (const uint8_t *octets, size_t count, unsigned fill,
+                              char *text, size_t max);
+static size_t append_utf8 (char *text, size_t len, size_t max, gunichar c);
+static int64_t decode_timestamp (const uint8_t *scts);
+static void decode_address (const uint8_t *octets, size_t digits, uint8_t toa, char *number);
+
+struct _t_pdu_message {
+    enum pdu_encoding encoding;
+    uint8_t     reference;
+    uint8_t     header[PDU_HEADER_MAX_LEN];
+    size_t      header_len;
+    size_t      part_count;
+    uint16_t    part_start[PDU_MAX_PARTS + 1];
+    size_t      length;
+    uint16_t    units[];
+};
+
+const struct _pdu pdu = {
+    .init = &pdu_init,
+    .free = &pdu_free,
+    .get_part_count = &pdu_get_part_count,
+    .get_encoding = &pdu_get_encoding,
+    .get_part = &pdu_get_part,
+    .fits_text_mode = &pdu_fits_text_mode,
+    .decode = &pdu_decode,
+    .request_report = &pdu_request_report,
+    .decode_status_report = &pdu_decode_status_report
+};
+
+//GSM 03.38 default alphabet, indexed by septet
+static const uint16_t gsm7_basic[128] = {
+        0x0040, 0x00A3, 0x0024, 0x00A5, 0x00E8, 0x00E9, 0x00F9, 0x00EC,
+        0x00F2, 0x00C7, 0x000A, 0x00D8, 0x00F8, 0x000D, 0x00C5, 0x00E5,
+        0x0394, 0x005F, 0x03A6, 0x0393, 0x039B, 0x03A9, 0x03A0, 0x03A8,
+        0x03A3, 0x0398, 0x039E, 0xFFFF, 0x00C6, 0x00E6, 0x00DF, 0x00C9,
+        0x0020, 0x0021, 0x0022, 0x0023, 0x00A4, 0x0025, 0x0026, 0x0027,
+        0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+        0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+        0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+        0x00A1, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+        0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+        0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+        0x0058, 0x0059, 0x005A, 0x00C4, 0x00D6, 0x00D1, 0x00DC, 0x00A7,
+        0x00BF, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+        0x0068, 0x0069, 0x006A, 0x006B, 0x006C, 0x006D, 0x006E, 0x006F,
+        0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+        0x0078, 0x0079, 0x007A, 0x00E4, 0x00F6, 0x00F1, 0x00FC, 0x00E0,
+};
+
+//GSM 03.38 extension table, reached through the escape septet
+static const struct {
+    uint8_t     code;
+    uint16_t    unicode;
+} gsm7_extended[] = {
+        {0x0A, 0x000C}, {0x14, 0x005E}, {0x28, 0x007B}, {0x29, 0x007D}, {0x2F, 0x005C},
+        {0x3C, 0x005B}, {0x3D, 0x007E}, {0x3E, 0x005D}, {0x40, 0x007C}, {0x65, 0x20AC}
+};
+
+//unicode -> septet, tagged with REVERSE_BASIC or REVERSE_EXTENDED, zero when unmapped
+static uint16_t gsm7_reverse[REVERSE_TABLE_LEN];
+
+PduMessage pdu_init (const char *message, const char *number, uint8_t reference)
+{
+    static GOnce once = G_ONCE_INIT;
+    struct _t_pdu_message *pdu_message;
+    enum pdu_encoding encoding;
+    const char *p;
+    uint16_t code;
+    gunichar c;
+    size_t length;
+
+    if (message == NULL || number == NULL)
+        return NULL;
+    if (!g_utf8_validate(message, -1, NULL))
+        return NULL;
+    g_once(&once, reverse_init, NULL);
+    encoding = PDU_ENCODING_GSM7;
+    length = 0;
+    for (p = message; *p != '\0'; p = g_utf8_next_char(p)) {
+        code = gsm7_lookup(g_utf8_get_char(p));
+        if (code == 0) {
+            encoding = PDU_ENCODING_UCS2;
+            break;
+        }
+        length += (code & REVERSE_EXTENDED) ? 2 : 1;
+    }
+    if (encoding == PDU_ENCODING_UCS2) {
+        length = 0;
+        for (p = message; *p != '\0'; p = g_utf8_next_char(p))
+            length += (g_utf8_get_char(p) > 0xFFFF) ? 2 : 1;
+    }
+    if (length > (size_t)PDU_MAX_PARTS * GSM7_PART_LEN)
+        return NULL;
+    pdu_message = g_malloc(sizeof (struct _t_pdu_message) + length * sizeof (uint16_t));
+    if (pdu_message == NULL)
+        return NULL;
+    pdu_message->encoding = encoding;
+    pdu_message->reference = reference;
+    pdu_message->length = length;
+    length = 0;
+    for (p = message; *p != '\0'; p = g_utf8_next_char(p)) {
+        c = g_utf8_get_char(p);
+        if (encoding == PDU_ENCODING_GSM7) {
+            code = gsm7_lookup(c);
+            if (code & REVERSE_EXTENDED)
+                pdu_message->units[length++] = GSM7_ESCAPE;
+            pdu_message->units[length++] = code & 0x7F;
+        } else if (c > 0xFFFF) {
+            c -= 0x10000;
+            pdu_message->units[length++] = 0xD800 | (c >> 10);
+            pdu_message->units[length++] = 0xDC00 | (c & 0x3FF);
+        } else {
+            pdu_message->units[length++] = (uint16_t)c;
+        }
+    }
+    pdu_message->part_count = split_parts(pdu_message);
+    pdu_message->header_len = build_header(pdu_message->header, number, encoding,
+                                           pdu_message->part_count > 1);
+    if (pdu_message->part_count == 0 || pdu_message->header_len == 0)
+        pdu_free(&pdu_message);
+    return pdu_message;
+}
+
+void pdu_free (PduMessage *pdu_message)
+{
+    if (pdu_message == NULL)
+        return;
+    if ((*pdu_message) == NULL)
+        return;
+    g_free(*pdu_message);
+    *pdu_message = NULL;
+}
+
+size_t pdu_get_part_count (PduMessage pdu_message)
+{
+    if (pdu_message == NULL)
+        return 0;
+    return pdu_message->part_count;
+}
+
+enum pdu_encoding pdu_get_encoding (PduMessage pdu_message)
+{
+    if (pdu_message == NULL)
+        return PDU_ENCODING_GSM7;
+    return pdu_message->encoding;
+}
+
+size_t pdu_get_part (PduMessage pdu_message, size_t index, char *hex)
+{
+    static const char hex_digits[] = "0123456789ABCDEF";
+    uint8_t tpdu[PDU_TPDU_MAX_LEN];
+    size_t len, udl, start, count;
+    bool concatenated;
+
+    if (pdu_message == NULL || hex == NULL)
+        return 0;
+    if (index >= pdu_message->part_count)
+        return 0;
+    concatenated = pdu_message->part_count > 1;
+    start = pdu_message->part_start[index];
+    count = pdu_message->part_start[index + 1] - start;
+    memcpy(tpdu, pdu_message->header, pdu_message->header_len);
+    len = pdu_message->header_len;
+    udl = len++;
+    if (concatenated) {
+        tpdu[len++] = UDH_CONCAT_LEN - 1;
+        tpdu[len++] = 0x00; //IEI: concatenated short message, 8-bit reference
+        tpdu[len++] = 0x03;
+        tpdu[len++] = pdu_message->reference;
+        tpdu[len++] = (uint8_t)pdu_message->part_count;
+        tpdu[len++] = (uint8_t)(index + 1);
+    }
+    if (pdu_message->encoding == PDU_ENCODING_GSM7) {
+        //the 6 octet UDH is padded with one fill bit to a septet boundary
+        len += pack_septets(&pdu_message->units[start], count, concatenated ? 1 : 0, &tpdu[len]);
+        tpdu[udl] = (uint8_t)(count + (concatenated ? 7 : 0));
+    } else {
+        for (size_t i = start; i < start + count; i++) {
+            tpdu[len++] = (uint8_t)(pdu_message->units[i] >> 8);
+            tpdu[len++] = (uint8_t)(pdu_message->units[i] & 0xFF);
+        }
+        tpdu[udl] = (uint8_t)(count * 2 + (concatenated ? UDH_CONCAT_LEN : 0));
+    }
+    //empty SCA, the modem uses the SMSC stored on the SIM
+    *hex++ = '0';
+    *hex++ = '0';
+    for (size_t i = 0; i < len; i++) {
+        *hex++ = hex_digits[tpdu[i] >> 4];
+        *hex++ = hex_digits[tpdu[i] & 0x0F];
+    }
+    *hex = '\0';
+    return len;
+}
+
+bool pdu_fits_text_mode (const char *message)
+{
+    static GOnce once = G_ONCE_INIT;
+    size_t length;
+
+    if (message == NULL)
+        return false;
+    g_once(&once, reverse_init, NULL);
+    for (length = 0; message[length] != '\0'; length++) {
+        if (message[length] & 0x80)
+            return false;
+        if (!(gsm7_reverse[(uint8_t)message[length]] & REVERSE_BASIC))
+            return false;
+        if (length >= GSM7_SINGLE_LEN)
+            return false;
+    }
+    return true;
+}
+
+bool pdu_decode (const char *hex, struct pdu_deliver *deliver)
+{
+    uint8_t tpdu[PDU_TPDU_MAX_LEN + 12];
+    size_t len, pos, digits, udl, udhl, start;
+    uint8_t first, toa, dcs;
+    unsigned fill;
+    gunichar c;
+
+    if (hex == NULL || deliver == NULL)
+        return false;
+    memset(deliver, 0, sizeof (struct pdu_deliver));
+    len = hex_to_octets(hex, tpdu, sizeof (tpdu));
+    if (len == 0 || (size_t)tpdu[0] + 1 >= len)
+        return false;
+    pos = tpdu[0] + 1; //skip SCA
+    first = tpdu[pos++];
+    if ((first & 0x03) != 0x00) //SMS-DELIVER only
+        return false;
+    digits = tpdu[pos++];
+    toa = tpdu[pos++];
+    if (pos + (digits + 1) / 2 + 10 > len)
+        return false;
+    decode_address(&tpdu[pos], digits, toa, deliver->sender);
+    pos += (digits + 1) / 2;
+    pos++; //TP-PID
+    dcs = tpdu[pos++];
+    deliver->timestamp = decode_timestamp(&tpdu[pos]);
+    pos += 7;
+    udl = tpdu[pos++];
+    if ((dcs & 0xC0) == 0x00 || (dcs & 0xC0) == 0x40)
+        deliver->encoding = ((dcs & 0x0C) == 0x08) ? PDU_ENCODING_UCS2 :
+                            ((dcs & 0x0C) == 0x04) ? PDU_ENCODING_8BIT : PDU_ENCODING_GSM7;
+    else if ((dcs & 0xF0) == 0xE0)
+        deliver->encoding = PDU_ENCODING_UCS2;
+    else if ((dcs & 0xF0) == 0xF0)
+        deliver->encoding = (dcs & 0x04) ? PDU_ENCODING_8BIT : PDU_ENCODING_GSM7;
+    else
+        deliver->encoding = PDU_ENCODING_GSM7;
+    udhl = 0;
+    if (first & 0x40) {
+        if (pos >= len)
+            return false;
+        udhl = tpdu[pos] + 1;
+        for (size_t i = pos + 1; i + 1 < pos + udhl && i + 1 < len; i += tpdu[i + 1] + 2) {
+            if (tpdu[i] == 0x00 && tpdu[i + 1] == 3 && i + 4 < len) {
+                deliver->concat_ref = tpdu[i + 2];
+                deliver->concat_total = tpdu[i + 3];
+                deliver->concat_seq = tpdu[i + 4];
+            } else if (tpdu[i] == 0x08 && tpdu[i + 1] == 4 && i + 5 < len) {
+                deliver->concat_ref = (uint16_t)(tpdu[i + 2] << 8 | tpdu[i + 3]);
+                deliver->concat_total = tpdu[i + 4];
+                deliver->concat_seq = tpdu[i + 5];
+            }
+        }
+    }
+    if (deliver->encoding == PDU_ENCODING_GSM7) {
+        //user data starts on the first septet boundary after the header
+        fill = (7 - (udhl * 8) % 7) % 7;
+        start = (udhl * 8 + fill) / 7;
+        if (udl < start || pos + (udl * 7 + 7) / 8 > len)
+            return false;
+        deliver->text_len = unpack_septets(&tpdu[pos + udhl], udl - start, fill,
+                                           deliver->text, PDU_TEXT_MAX_LEN);
+    } else if (deliver->encoding == PDU_ENCODING_UCS2) {
+        if (udl < udhl || pos + udl > len)
+            return false;
+        for (size_t i = pos + udhl; i + 1 < pos + udl; i += 2) {
+            c = (gunichar)(tpdu[i] << 8 | tpdu[i + 1]);
+            if ((c & 0xFC00) == 0xD800 && i + 3 < pos + udl) {
+                c = 0x10000 + ((c & 0x3FF) << 10) + ((tpdu[i + 2] << 8 | tpdu[i + 3]) & 0x3FF);
+                i += 2;
+            }
+            deliver->text_len = append_utf8(deliver->text, deliver->text_len, PDU_TEXT_MAX_LEN, c);
+        }
+    } else {
+        if (udl < udhl || pos + udl > len)
+            return false;
+        deliver->text_len = MIN(udl - udhl, (size_t)PDU_TEXT_MAX_LEN - 1);
+        memcpy(deliver->text, &tpdu[pos + udhl], deliver->text_len);
+        deliver->text[deliver->text_len] = '\0';
+    }
+    return true;
+}
+
+void pdu_request_report (PduMessage pdu_message)
+{
+    if (pdu_message == NULL)
+        return;
+    pdu_message->header[0] |= 0x20; //TP-SRR
+}
+
+bool pdu_decode_status_report (const char *hex, struct pdu_status_report *report)
+{
+    uint8_t tpdu[PDU_TPDU_MAX_LEN + 12];
+    size_t len, pos, digits;
+    uint8_t toa;
+
+    if (hex == NULL || report == NULL)
+        return false;
+    memset(report, 0, sizeof (struct pdu_status_report));
+    len = hex_to_octets(hex, tpdu, sizeof (tpdu));
+    if (len == 0 || (size_t)tpdu[0] + 4 >= len)
+        return false;
+    pos = tpdu[0] + 1; //skip SCA
+    if ((tpdu[pos++] & 0x03) != 0x02) //SMS-STATUS-REPORT only
+        return false;
+    report->reference = tpdu[pos++];
+    digits = tpdu[pos++];
+    toa = tpdu[pos++];
+    //SCTS, DT and ST follow the recipient
+    if (pos + (digits + 1) / 2 + 15 > len)
+        return false;
+    decode_address(&tpdu[pos], digits, toa, report->recipient);
+    pos += (digits + 1) / 2;
+    report->timestamp = decode_timestamp(&tpdu[pos]);
+    pos += 7;
+    report->discharge_time = decode_timestamp(&tpdu[pos]);
+    pos += 7;
+    report->status = tpdu[pos];
+    return true;
+}
+
+//digits is the address length field, in semi-octets or packed septets for alphanumerics
+void decode_address (const uint8_t *octets, size_t digits, uint8_t toa, char *number)
+{
+    size_t out;
+    uint8_t nibble;
+
+    if ((toa & 0x70) == 0x50) {
+        //alphanumeric, packed GSM 7-bit
+        unpack_septets(octets, digits * 4 / 7, 0, number, PDU_NUMBER_MAX_LEN);
+        return;
+    }
+    out = 0;
+    if ((toa & 0x70) == 0x10)
+        number[out++] = '+';
+    for (size_t i = 0; i < digits && out < PDU_NUMBER_MAX_LEN - 1; i++) {
+        nibble = (i % 2 == 0) ? (octets[i / 2] & 0x0F) : (octets[i / 2] >> 4);
+        if (nibble == 0x0F)
+            break;
+        number[out++] = "0123456789*#abc"[nibble];
+    }
+    number[out] = '\0';
+}
+
+gpointer reverse_init (gpointer data)
+{
+    (void)data;
+    for (uint16_t i = 0; i < G_N_ELEMENTS(gsm7_basic); i++) {
+        if (gsm7_basic[i] < REVERSE_TABLE_LEN)
+            gsm7_reverse[gsm7_basic[i]] = REVERSE_BASIC | i;
+    }
+    for (size_t i = 0; i < G_N_ELEMENTS(gsm7_extended); i++) {
+        if (gsm7_extended[i].unicode < REVERSE_TABLE_LEN)
+            gsm7_reverse[gsm7_extended[i].unicode] = REVERSE_EXTENDED | gsm7_extended[i].code;
+    }
+    return NULL;
+}
+
+uint16_t gsm7_lookup (gunichar c)
+{
+    if (c < REVERSE_TABLE_LEN)
+        return gsm7_reverse[c];
+    if (c == 0x20AC)
+        return REVERSE_EXTENDED | 0x65;
+    return 0;
+}
+
+size_t build_header (uint8_t *header, const char *number, enum pdu_encoding encoding,
+                     bool concatenated)
+{
+    size_t len, digits;
+    uint8_t nibble;
+
+    len = 0;
+    digits = 0;
+    header[len++] = 0x01 | (concatenated ? 0x40 : 0x00); //SMS-SUBMIT, UDHI
+    header[len++] = 0x00; //TP-MR, assigned by the modem
+    header[len++] = 0x00; //address length, in digits
+    header[len++] = (*number == '+') ? 0x91 : 0x81;
+    if (*number == '+')
+        number++;
+    for (; *number != '\0'; number++) {
+        if (*number >= '0' && *number <= '9')
+            nibble = *number - '0';
+        else if (*number == '*')
+            nibble = 0x0A;
+        else if (*number == '#')
+            nibble = 0x0B;
+        else
+            return 0;
+        if (digits == NUMBER_MAX_DIGITS)
+            return 0;
+        if (digits % 2 == 0) {
+            header[len] = 0xF0 | nibble;
+        } else {
+            header[len] = (header[len] & 0x0F) | (nibble << 4);
+            len++;
+        }
+        digits++;
+    }
+    if (digits == 0)
+        return 0;
+    if (digits % 2 != 0)
+        len++;
+    header[2] = (uint8_t)digits;
+    header[len++] = 0x00; //TP-PID
+    header[len++] = (encoding == PDU_ENCODING_UCS2) ? 0x08 : 0x00; //TP-DCS
+    return len;
+}
+
+size_t split_parts (PduMessage pdu_message)
+{
+    size_t single, part, start, end, count;
+
+    single = (pdu_message->encoding == PDU_ENCODING_GSM7) ? GSM7_SINGLE_LEN : UCS2_SINGLE_LEN;
+    part = (pdu_message->encoding == PDU_ENCODING_GSM7) ? GSM7_PART_LEN : UCS2_PART_LEN;
+    pdu_message->part_start[0] = 0;
+    if (pdu_message->length <= single) {
+        pdu_message->part_start[1] = (uint16_t)pdu_message->length;
+        return 1;
+    }
+    count = 0;
+    for (start = 0; start < pdu_message->length; start = end) {
+        if (count == PDU_MAX_PARTS)
+            return 0;
+        end = MIN(start + part, pdu_message->length);
+        //never split an escape sequence or a surrogate pair across parts
+        if (end < pdu_message->length) {
+            if (pdu_message->encoding == PDU_ENCODING_GSM7) {
+                if (pdu_message->units[end - 1] == GSM7_ESCAPE)
+                    end--;
+            } else if ((pdu_message->units[end - 1] & 0xFC00) == 0xD800) {
+                end--;
+            }
+        }
+        pdu_message->part_start[++count] = (uint16_t)end;
+    }
+    return count;
+}
+
+size_t pack_septets (const uint16_t *septets, size_t count, unsigned fill, uint8_t *out)
+{
+    uint64_t acc, word;
+    unsigned bits;
+    size_t len, i;
+
+    acc = 0;
+    bits = fill;
+    len = 0;
+    //eight septets fill exactly seven octets, so whole groups go through one 64-bit word
+    for (i = 0; count - i >= 8; i += 8) {
+        word = 0;
+        for (unsigned k = 0; k < 8; k++)
+            word |= (uint64_t)(septets[i + k] & 0x7F) << (7 * k);
+        acc |= word << bits;
+        for (unsigned k = 0; k < 7; k++) {
+            out[len++] = (uint8_t)acc;
+            acc >>= 8;
+        }
+    }
+    for (; i < count; i++) {
+        acc |= (uint64_t)(septets[i] & 0x7F) << bits;
+        bits += 7;
+        while (bits >= 8) {
+            out[len++] = (uint8_t)acc;
+            acc >>= 8;
+            bits -= 8;
+        }
+    }
+    if (bits > 0)
+        out[len++] = (uint8_t)acc;
+    return len;
+}
+
+size_t hex_to_octets (const char *hex, uint8_t *octets, size_t max)
+{
+    size_t len;
+    int high, low;
+
+    for (len = 0; hex[0] != '\0' && hex[1] != '\0'; hex += 2) {
+        high = g_ascii_xdigit_value(hex[0]);
+        low = g_ascii_xdigit_value(hex[1]);
+        if (high < 0 || low < 0 || len == max)
+            return 0;
+        octets[len++] = (uint8_t)(high << 4 | low);
+    }
+    return len;
+}
+
+size_t unpack_septets (const uint8_t *octets, size_t count, unsigned fill,
+                       char *text, size_t max)
+{
+    uint64_t acc;
+    unsigned bits;
+    size_t len;
+    uint8_t septet;
+    bool escape;
+
+    len = 0;
+    escape = false;
+    text[0] = '\0';
+    if (count == 0)
+        return 0;
+    //drop the fill bits in front of the first septet
+    acc = *octets++ >> fill;
+    bits = 8 - fill;
+    for (size_t i = 0; i < count; i++) {
+        if (bits < 7) {
+            acc |= (uint64_t)(*octets++) << bits;
+            bits += 8;
+        }
+        septet = acc & 0x7F;
+        acc >>= 7;
+        bits -= 7;
+        if (escape) {
+            gunichar c = gsm7_basic[septet];
+            for (size_t k = 0; k < G_N_ELEMENTS(gsm7_extended); k++) {
+                if (gsm7_extended[k].code == septet)
+                    c = gsm7_extended[k].unicode;
+            }
+            len = append_utf8(text, len, max, c);
+            escape = false;
+        } else if (septet == GSM7_ESCAPE) {
+            escape = true;
+        } else {
+            len = append_utf8(text, len, max, gsm7_basic[septet]);
+        }
+    }
+    return len;
+}
+
+size_t append_utf8 (char *text, size_t len, size_t max, gunichar c)
+{
+    char utf8[6];
+    gint n;
+
+    n = g_unichar_to_utf8(c, utf8);
+    if (len + (size_t)n >= max)
+        return len;
+    memcpy(&text[len], utf8, (size_t)n);
+    len += (size_t)n;
+    text[len] = '\0';
+    return len;
+}
+
+int64_t decode_timestamp (const uint8_t *scts)
+{
+    struct tm tm = {0};
+    int field[7];
+    int64_t offset;
+
+    for (int i = 0; i < 7; i++)
+        field[i] = (scts[i] & 0x0F) * 10 + ((scts[i] >> 4) & 0x0F);
+    tm.tm_year = 100 + field[0];
+    tm.tm_mon = field[1] - 1;
+    tm.tm_mday = field[2];
+    tm.tm_hour = field[3];
+    tm.tm_min = field[4];
+    tm.tm_sec = field[5];
+    //time zone in quarters of an hour, the sign is bit 3 of the first digit
+    offset = (int64_t)(((scts[6] & 0x07) * 10 + ((scts[6] >> 4) & 0x0F)) * 15 * 60);
+    if (scts[6] & 0x08)
+        offset = -offset;
+    return (int64_t)timegm(&tm) - offset;
+}
@@ -0,0 +1,65 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_PDU_H
+#define GSMAPP_PDU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define PDU_MAX_PARTS 255
+#define PDU_TPDU_MAX_LEN 164
+//SCA octet + TPDU as hex digits, room for Ctrl-Z and null terminator
+#define PDU_HEX_MAX_LEN ((PDU_TPDU_MAX_LEN + 1) * 2 + 2)
+#define PDU_NUMBER_MAX_LEN 32
+//160 septets or 70 UCS2 units as UTF-8
+#define PDU_TEXT_MAX_LEN 512
+
+enum pdu_encoding {
+    PDU_ENCODING_GSM7,
+    PDU_ENCODING_UCS2,
+    PDU_ENCODING_8BIT
+};
+
+//decoded SMS-DELIVER, a single part of a possibly concatenated message
+struct pdu_deliver {
+    char        sender[PDU_NUMBER_MAX_LEN];
+    int64_t     timestamp;  //service centre time stamp, unix seconds
+    enum pdu_encoding encoding;
+    uint16_t    concat_ref;
+    uint8_t     concat_total;//0 when the message is not concatenated
+    uint8_t     concat_seq;
+    size_t      text_len;
+    char        text[PDU_TEXT_MAX_LEN];
+};
+
+//decoded SMS-STATUS-REPORT, the fate of one submitted part
+struct pdu_status_report {
+    uint8_t     reference;  //TP-MR the modem gave the part in its +CMGS reply
+    char        recipient[PDU_NUMBER_MAX_LEN];
+    int64_t     timestamp;  //service centre time stamp of the submission, unix seconds
+    int64_t     discharge_time;
+    uint8_t     status;     //TP-ST: below 0x20 delivered, up to 0x3F still trying, above failed
+};
+
+typedef struct _t_pdu_message *PduMessage;
+
+struct _pdu {
+    PduMessage  (* init) (const char *message, const char *number, uint8_t reference);
+    void        (* free) (PduMessage *pdu_message);
+
+    size_t      (* get_part_count) (PduMessage pdu_message);
+    enum pdu_encoding (* get_encoding) (PduMessage pdu_message);
+    size_t      (* get_part) (PduMessage pdu_message, size_t index, char *hex);
+    bool        (* fits_text_mode) (const char *message);
+    bool        (* decode) (const char *hex, struct pdu_deliver *deliver);
+    //every part asks the service centre for a status report
+    void        (* request_report) (PduMessage pdu_message);
+    bool        (* decode_status_report) (const char *hex, struct pdu_status_report *report);
+};
+extern const struct _pdu pdu;
+
+#endif //GSMAPP_PDU_H
@@ -0,0 +1,367 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#include "reassembly.h"
+
+#include <glib.h>
+#include <string.h>
+
+//expiry granularity is timeout / REASSEMBLY_BUCKETS
+#define REASSEMBLY_BUCKETS 64
+#define NONE (-1)
+
+enum entry_state {
+    ENTRY_FREE,
+    ENTRY_PENDING,
+    ENTRY_DONE      //delivered, kept until it expires so repeated parts are recognized
+};
+
+struct fragment {
+    struct pdu_deliver part;
+    int32_t next;           //next part of the same message, or the next free fragment
+};
+
+struct entry {
+    char sender[PDU_NUMBER_MAX_LEN];
+    uint64_t hash;
+    uint64_t tick;          //of the first part, the entry expires with its bucket
+    uint32_t seen[8];       //bitmap of the sequence numbers received
+    int32_t fragments;      //received parts, latest first
+    int32_t chain;          //next entry of the hash bucket, or the next free entry
+    int32_t prev;           //neighbours in the expiry bucket
+    int32_t next;
+    uint16_t reference;
+    uint8_t total;
+    uint8_t received;
+    uint8_t state;
+};
+
+struct _t_reassembly {
+    struct entry *entries;
+    int32_t *table;         //hash buckets, heads of entry chains
+    size_t mask;
+    int32_t free_entries;
+    struct fragment *fragments;
+    int32_t free_fragments;
+    size_t pending;
+    int64_t bucket_width;   //microsecond
+    uint64_t tick;
+    int32_t buckets[REASSEMBLY_BUCKETS];     //oldest entry first
+    int32_t bucket_tails[REASSEMBLY_BUCKETS];
+    reassembly_cb complete;
+    void *user_data;
+};
+
+static Reassembly reassembly_init (size_t capacity, size_t fragments, uint32_t timeout, reassembly_cb complete,
+                                   void *user_data);
+static void reassembly_free (Reassembly *r);
+static void reassembly_add (Reassembly r, const struct pdu_deliver *part, int64_t now);
+static void reassembly_expire (Reassembly r, int64_t now);
+static size_t reassembly_get_size (Reassembly r);
+static uint64_t hash_key (const char *sender, uint16_t reference, uint8_t total);
+static int32_t lookup (Reassembly r, uint64_t hash, const char *sender, uint16_t reference, uint8_t total);
+static int32_t claim_entry (Reassembly r);
+static int32_t claim_fragment (Reassembly r);
+static void deliver (Reassembly r, struct entry *entry);
+static void release (Reassembly r, int32_t at);
+static void expire_bucket (Reassembly r, uint64_t tick);
+static bool evict_oldest (Reassembly r);
+
+const struct _reassembly reassembly = {
+    .init = &reassembly_init,
+    .free = &reassembly_free,
+    .add = &reassembly_add,
+    .expire = &reassembly_expire,
+    .get_size = &reassembly_get_size
+};
+
+Reassembly reassembly_init (size_t capacity, size_t fragments, uint32_t timeout, reassembly_cb complete,
+                            void *user_data)
+{
+    Reassembly r;
+    size_t size;
+
+    r = g_new0(struct _t_reassembly, 1);
+    g_assert(r != NULL);
+    if (r == NULL)
+        return NULL;
+    capacity = MAX(capacity, 1);
+    fragments = MAX(fragments, 1);
+    for (size = 16; size < capacity * 2; size <<= 1);
+    r->table = g_new(int32_t, size);
+    r->mask = size - 1;
+    for (size_t i = 0; i < size; i++)
+        r->table[i] = NONE;
+    r->entries = g_new0(struct entry, capacity);
+    for (size_t i = 0; i < capacity; i++)
+        r->entries[i].chain = (i + 1 < capacity) ? (int32_t)(i + 1) : NONE;
+    r->free_entries = 0;
+    r->fragments = g_new0(struct fragment, fragments);
+    for (size_t i = 0; i < fragments; i++)
+        r->fragments[i].next = (i + 1 < fragments) ? (int32_t)(i + 1) : NONE;
+    r->free_fragments = 0;
+    for (int i = 0; i < REASSEMBLY_BUCKETS; i++)
+        r->buckets[i] = r->bucket_tails[i] = NONE;
+    r->bucket_width = MAX((gint64)timeout * G_USEC_PER_SEC / REASSEMBLY_BUCKETS, 1);
+    r->tick = (uint64_t)(g_get_monotonic_time() / r->bucket_width);
+    r->complete = complete;
+    r->user_data = user_data;
+    return r;
+}
+
+void reassembly_free (Reassembly *r)
+{
+    if (r == NULL || (*r) == NULL)
+        return;
+    //waiting parts are dropped, nothing is delivered from here
+    g_free((*r)->table);
+    g_free((*r)->entries);
+    g_free((*r)->fragments);
+    g_free(*r);
+    *r = NULL;
+}
+
+void reassembly_add (Reassembly r, const struct pdu_deliver *part, int64_t now)
+{
+    const struct pdu_deliver *single[1];
+    struct reassembly_message message;
+    struct entry *entry;
+    struct fragment *fragment;
+    uint64_t hash;
+    int32_t at, index;
+    uint8_t seq;
+
+    if (r == NULL || part == NULL)
+        return;
+    reassembly_expire(r, now);
+    if (part->concat_total <= 1) {
+        single[0] = part;
+        message.sender = part->sender;
+        message.timestamp = part->timestamp;
+        message.text_len = part->text_len;
+        message.part_count = 1;
+        message.received = 1;
+        message.parts = single;
+        r->complete(&message, r->user_data);
+        return;
+    }
+    //sequence numbers start at 1, anything out of range is a broken header
+    seq = part->concat_seq;
+    if (seq == 0 || seq > part->concat_total)
+        return;
+    hash = hash_key(part->sender, part->concat_ref, part->concat_total);
+    at = lookup(r, hash, part->sender, part->concat_ref, part->concat_total);
+    //a part resent by the network, or one of a message delivered already
+    if (at != NONE && (r->entries[at].state == ENTRY_DONE ||
+                       (r->entries[at].seen[seq / 32] & (UINT32_C(1) << (seq % 32)))))
+        return;
+    //making room may deliver this very message early, the rest of it then starts over
+    while (r->free_fragments == NONE)
+        if (!evict_oldest(r))
+            return;
+    at = lookup(r, hash, part->sender, part->concat_ref, part->concat_total);
+    if (at == NONE) {
+        at = claim_entry(r);
+        if (at == NONE)
+            return;
+        entry = &r->entries[at];
+        g_strlcpy(entry->sender, part->sender, PDU_NUMBER_MAX_LEN);
+        entry->hash = hash;
+        entry->reference = part->concat_ref;
+        entry->total = part->concat_total;
+        entry->received = 0;
+        entry->fragments = NONE;
+        memset(entry->seen, 0, sizeof (entry->seen));
+        entry->state = ENTRY_PENDING;
+        entry->chain = r->table[hash & r->mask];
+        r->table[hash & r->mask] = at;
+        entry->tick = r->tick;
+        index = (int32_t)(r->tick % REASSEMBLY_BUCKETS);
+        entry->prev = r->bucket_tails[index];
+        entry->next = NONE;
+        if (entry->prev != NONE)
+            r->entries[entry->prev].next = at;
+        else
+            r->buckets[index] = at;
+        r->bucket_tails[index] = at;
+        r->pending++;
+    }
+    entry = &r->entries[at];
+    index = claim_fragment(r);
+    fragment = &r->fragments[index];
+    fragment->part = *part;
+    fragment->next = entry->fragments;
+    entry->fragments = index;
+    entry->seen[seq / 32] |= UINT32_C(1) << (seq % 32);
+    entry->received++;
+    if (entry->received == entry->total)
+        deliver(r, entry);
+}
+
+void reassembly_expire (Reassembly r, int64_t now)
+{
+    uint64_t tick;
+
+    if (r == NULL)
+        return;
+    tick = (uint64_t)(now / r->bucket_width);
+    //a bucket is reused once per timeout, whatever it still holds from the last round has expired
+    for (int i = 0; r->tick < tick && i < REASSEMBLY_BUCKETS; i++) {
+        r->tick++;
+        expire_bucket(r, r->tick - REASSEMBLY_BUCKETS);
+    }
+    r->tick = MAX(r->tick, tick);
+}
+
+size_t reassembly_get_size (Reassembly r)
+{
+    if (r == NULL)
+        return 0;
+    return r->pending;
+}
+
+//FNV-1a over the sender, the reference and part count folded in
+uint64_t hash_key (const char *sender, uint16_t reference, uint8_t total)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+    for (; *sender != '\0'; sender++) {
+        hash ^= (uint8_t)*sender;
+        hash *= UINT64_C(0x100000001b3);
+    }
+    hash ^= (uint64_t)reference << 8 | total;
+    hash *= UINT64_C(0x100000001b3);
+    return hash ^ (hash >> 32);
+}
+
+int32_t lookup (Reassembly r, uint64_t hash, const char *sender, uint16_t reference, uint8_t total)
+{
+    struct entry *entry;
+
+    for (int32_t at = r->table[hash & r->mask]; at != NONE; at = entry->chain) {
+        entry = &r->entries[at];
+        if (entry->hash == hash && entry->reference == reference && entry->total == total &&
+            strcmp(entry->sender, sender) == 0)
+            return at;
+    }
+    return NONE;
+}
+
+int32_t claim_entry (Reassembly r)
+{
+    int32_t at;
+
+    if (r->free_entries == NONE && !evict_oldest(r))
+        return NONE;
+    at = r->free_entries;
+    r->free_entries = r->entries[at].chain;
+    return at;
+}
+
+int32_t claim_fragment (Reassembly r)
+{
+    int32_t at;
+
+    at = r->free_fragments;
+    r->free_fragments = r->fragments[at].next;
+    return at;
+}
+
+//hands the parts out where they are stored, then returns them to the pool
+void deliver (Reassembly r, struct entry *entry)
+{
+    const struct pdu_deliver *parts[PDU_MAX_PARTS];
+    struct reassembly_message message;
+    struct fragment *fragment;
+    int32_t at, next;
+
+    memset(parts, 0, sizeof (parts[0]) * entry->total);
+    message.text_len = 0;
+    message.timestamp = 0;
+    for (at = entry->fragments; at != NONE; at = fragment->next) {
+        fragment = &r->fragments[at];
+        parts[fragment->part.concat_seq - 1] = &fragment->part;
+        message.text_len += fragment->part.text_len;
+    }
+    for (uint8_t i = 0; i < entry->total; i++) {
+        if (parts[i] != NULL) {
+            message.timestamp = parts[i]->timestamp;
+            break;
+        }
+    }
+    message.sender = entry->sender;
+    message.part_count = entry->total;
+    message.received = entry->received;
+    message.parts = parts;
+    r->complete(&message, r->user_data);
+    for (at = entry->fragments; at != NONE; at = next) {
+        next = r->fragments[at].next;
+        r->fragments[at].next = r->free_fragments;
+        r->free_fragments = at;
+    }
+    entry->fragments = NONE;
+    entry->state = ENTRY_DONE;
+    r->pending--;
+}
+
+//unlinks the entry from its hash chain and expiry bucket and frees it
+void release (Reassembly r, int32_t at)
+{
+    struct entry *entry;
+    int32_t *link, index;
+
+    entry = &r->entries[at];
+    for (link = &r->table[entry->hash & r->mask]; *link != at; link = &r->entries[*link].chain);
+    *link = entry->chain;
+    index = (int32_t)(entry->tick % REASSEMBLY_BUCKETS);
+    if (entry->prev != NONE)
+        r->entries[entry->prev].next = entry->next;
+    else
+        r->buckets[index] = entry->next;
+    if (entry->next != NONE)
+        r->entries[entry->next].prev = entry->prev;
+    else
+        r->bucket_tails[index] = entry->prev;
+    entry->state = ENTRY_FREE;
+    entry->chain = r->free_entries;
+    r->free_entries = at;
+}
+
+void expire_bucket (Reassembly r, uint64_t tick)
+{
+    int32_t at, next;
+
+    for (at = r->buckets[tick % REASSEMBLY_BUCKETS]; at != NONE; at = next) {
+        next = r->entries[at].next;
+        //incomplete messages go out with what they have
+        if (r->entries[at].state == ENTRY_PENDING)
+            deliver(r, &r->entries[at]);
+        release(r, at);
+    }
+}
+
+/*
+ * The table or the fragment pool is full of messages younger than the
+ * timeout. The oldest entry goes first, a finished one costs nothing to
+ * drop, an incomplete one is delivered early to give its parts back.
+ */
+bool evict_oldest (Reassembly r)
+{
+    struct entry *entry;
+    uint64_t tick;
+    int32_t at;
+
+    for (int i = REASSEMBLY_BUCKETS - 1; i >= 0; i--) {
+        tick = r->tick - (uint64_t)i;
+        at = r->buckets[tick % REASSEMBLY_BUCKETS];
+        if (at == NONE)
+            continue;
+        entry = &r->entries[at];
+        if (entry->state == ENTRY_PENDING)
+            deliver(r, entry);
+        release(r, at);
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,54 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_REASSEMBLY_H
+#define GSMAPP_REASSEMBLY_H
+
+#include "pdu.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _t_reassembly *Reassembly;
+
+//a received message, the parts of a concatenated one are handed out in place and in order
+struct reassembly_message {
+    const char  *sender;
+    int64_t     timestamp;  //service centre time stamp of the first part, unix seconds
+    size_t      text_len;   //of every received part together
+    uint8_t     part_count;
+    uint8_t     received;   //below part_count when the rest did not come in time
+    //part_count entries by sequence, NULL for a part that never came
+    const struct pdu_deliver *const *parts;
+};
+
+//the message and its parts are only valid during the call
+typedef void (* reassembly_cb) (const struct reassembly_message *message, void *user_data);
+
+/*
+ * Joins concatenated inbound parts keyed by sender, reference and part count.
+ * Memory is fixed at init: a full table or fragment pool makes room by
+ * delivering the oldest message early. Each message is delivered once, a
+ * part repeated within the timeout is dropped even after completion.
+ * Not thread safe, every instance belongs to the thread feeding it.
+ */
+struct _reassembly {
+    //capacity messages and fragments parts are held at most, an incomplete message is
+    //delivered with what it has timeout seconds after its first part
+    Reassembly  (* init) (size_t capacity, size_t fragments, uint32_t timeout, reassembly_cb complete,
+                          void *user_data);
+    void        (* free) (Reassembly *reassembly);
+
+    //a part that is not concatenated is delivered straight away; now is monotonic microseconds
+    void        (* add) (Reassembly reassembly, const struct pdu_deliver *part, int64_t now);
+    //delivers what timed out, cheap to call far more often than the timeout
+    void        (* expire) (Reassembly reassembly, int64_t now);
+    //messages waiting for parts
+    size_t      (* get_size) (Reassembly reassembly);
+};
+extern const struct _reassembly reassembly;
+
+#endif //GSMAPP_REASSEMBLY_H
@@ -0,0 +1,250 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#include "receipt.h"
+
+#include <glib.h>
+#include <string.h>
+
+//probe chains stay short below three quarters full, tombstones included
+#define RECEIPT_LOAD_NUM 3
+#define RECEIPT_LOAD_DEN 4
+//the tail of a number is the same whatever prefix the network reports it with
+#define RECEIPT_SUFFIX_MOD 1000000000
+
+enum slot_state {
+    SLOT_EMPTY,
+    SLOT_LIVE,
+    SLOT_TOMBSTONE
+};
+
+struct receipt_slot {
+    const void *device;
+    SMSHandle handle;
+    gint64 time;        //microsecond, when it was tracked
+    uint32_t recipient; //last nine digits
+    uint8_t reference;
+    uint8_t state;
+};
+
+struct _t_receipt_index {
+    GMutex mutex;
+    struct receipt_slot *slots;
+    size_t capacity;
+    size_t mask;
+    size_t live;
+    size_t tombstones;
+    gint64 ttl;         //microsecond
+};
+
+static ReceiptIndex receipt_init (size_t capacity, uint32_t ttl);
+static void receipt_free (ReceiptIndex *index);
+static void receipt_track (ReceiptIndex index, const void *device, uint8_t reference, const char *recipient,
+                           SMSHandle handle);
+static SMSHandle receipt_resolve (ReceiptIndex index, const void *device, uint8_t reference,
+                                  const char *recipient, bool final);
+static size_t receipt_get_size (ReceiptIndex index);
+static uint32_t number_suffix (const char *number);
+static uint64_t hash_key (const void *device, uint8_t reference, uint32_t recipient);
+static size_t probe (ReceiptIndex index, const void *device, uint8_t reference, uint32_t recipient, bool *found);
+static void rebuild (ReceiptIndex index, size_t capacity);
+
+const struct _receipt receipt = {
+    .init = &receipt_init,
+    .free = &receipt_free,
+    .track = &receipt_track,
+    .resolve = &receipt_resolve,
+    .get_size = &receipt_get_size
+};
+
+ReceiptIndex receipt_init (size_t capacity, uint32_t ttl)
+{
+    ReceiptIndex index;
+    size_t size;
+
+    index = g_new0(struct _t_receipt_index, 1);
+    g_assert(index != NULL);
+    if (index == NULL)
+        return NULL;
+    for (size = 16; size < capacity; size <<= 1);
+    g_mutex_init(&index->mutex);
+    index->capacity = size;
+    index->mask = size - 1;
+    index->slots = g_new0(struct receipt_slot, size);
+    index->ttl = (gint64)ttl * G_USEC_PER_SEC;
+    return index;
+}
+
+void receipt_free (ReceiptIndex *index)
+{
+    if (index == NULL || (*index) == NULL)
+        return;
+    for (size_t i = 0; i < (*index)->capacity; i++)
+        if ((*index)->slots[i].state == SLOT_LIVE)
+            sms_handle.free(&(*index)->slots[i].handle);
+    g_free((*index)->slots);
+    g_mutex_clear(&(*index)->mutex);
+    g_free(*index);
+    *index = NULL;
+}
+
+void receipt_track (ReceiptIndex index, const void *device, uint8_t reference, const char *recipient,
+                    SMSHandle handle)
+{
+    struct receipt_slot *slot;
+    uint32_t suffix;
+    size_t at;
+    bool found;
+
+    if (index == NULL || device == NULL || recipient == NULL || handle == NULL)
+        return;
+    suffix = number_suffix(recipient);
+    g_mutex_lock(&index->mutex);
+    at = probe(index, device, reference, suffix, &found);
+    if (found) {
+        //the modem went round all 256 references, the older report can not be told apart anymore
+        slot = &index->slots[at];
+        sms_handle.free(&slot->handle);
+        slot->handle = sms_handle.ref(handle);
+        slot->time = g_get_monotonic_time();
+        g_mutex_unlock(&index->mutex);
+        return;
+    }
+    if ((index->live + index->tombstones + 1) * RECEIPT_LOAD_DEN > index->capacity * RECEIPT_LOAD_NUM) {
+        //expired submissions and tombstones go first, the table doubles if that is not enough
+        rebuild(index, index->capacity);
+        if ((index->live + 1) * 2 > index->capacity)
+            rebuild(index, index->capacity * 2);
+        at = probe(index, device, reference, suffix, &found);
+    }
+    slot = &index->slots[at];
+    if (slot->state == SLOT_TOMBSTONE)
+        index->tombstones--;
+    slot->state = SLOT_LIVE;
+    slot->device = device;
+    slot->reference = reference;
+    slot->recipient = suffix;
+    slot->time = g_get_monotonic_time();
+    slot->handle = sms_handle.ref(handle);
+    index->live++;
+    g_mutex_unlock(&index->mutex);
+}
+
+SMSHandle receipt_resolve (ReceiptIndex index, const void *device, uint8_t reference, const char *recipient,
+                           bool final)
+{
+    struct receipt_slot *slot;
+    SMSHandle handle;
+    size_t at;
+    bool found;
+
+    if (index == NULL || device == NULL || recipient == NULL)
+        return NULL;
+    g_mutex_lock(&index->mutex);
+    at = probe(index, device, reference, number_suffix(recipient), &found);
+    if (!found) {
+        g_mutex_unlock(&index->mutex);
+        return NULL;
+    }
+    slot = &index->slots[at];
+    handle = sms_handle.ref(slot->handle);
+    if (final) {
+        sms_handle.free(&slot->handle);
+        slot->state = SLOT_TOMBSTONE;
+        index->live--;
+        index->tombstones++;
+    }
+    g_mutex_unlock(&index->mutex);
+    return handle;
+}
+
+size_t receipt_get_size (ReceiptIndex index)
+{
+    size_t size;
+
+    if (index == NULL)
+        return 0;
+    g_mutex_lock(&index->mutex);
+    size = index->live;
+    g_mutex_unlock(&index->mutex);
+    return size;
+}
+
+uint32_t number_suffix (const char *number)
+{
+    uint32_t suffix;
+
+    suffix = 0;
+    for (; *number != '\0'; number++)
+        if (*number >= '0' && *number <= '9')
+            suffix = (uint32_t)(((uint64_t)suffix * 10 + (uint64_t)(*number - '0')) % RECEIPT_SUFFIX_MOD);
+    return suffix;
+}
+
+//splitmix64 finalizer, references of one modem are consecutive and must not cluster
+uint64_t hash_key (const void *device, uint8_t reference, uint32_t recipient)
+{
+    uint64_t hash;
+
+    hash = (uint64_t)(uintptr_t)device ^ ((uint64_t)reference << 32 | recipient);
+    hash = (hash ^ (hash >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    hash = (hash ^ (hash >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return hash ^ (hash >> 31);
+}
+
+/*
+ * Linear probing. Returns the slot holding the key, or the slot it should be
+ * inserted at: the first tombstone on the chain, else the empty slot ending it.
+ */
+size_t probe (ReceiptIndex index, const void *device, uint8_t reference, uint32_t recipient, bool *found)
+{
+    struct receipt_slot *slot;
+    size_t i, insert_at;
+
+    insert_at = SIZE_MAX;
+    *found = false;
+    for (i = hash_key(device, reference, recipient) & index->mask;; i = (i + 1) & index->mask) {
+        slot = &index->slots[i];
+        if (slot->state == SLOT_EMPTY)
+            return insert_at != SIZE_MAX ? insert_at : i;
+        if (slot->state == SLOT_TOMBSTONE) {
+            if (insert_at == SIZE_MAX)
+                insert_at = i;
+            continue;
+        }
+        if (slot->device == device && slot->reference == reference && slot->recipient == recipient) {
+            *found = true;
+            return i;
+        }
+    }
+}
+
+void rebuild (ReceiptIndex index, size_t capacity)
+{
+    struct receipt_slot *old;
+    size_t old_capacity, at;
+    gint64 expired;
+    bool found;
+
+    old = index->slots;
+    old_capacity = index->capacity;
+    index->slots = g_new0(struct receipt_slot, capacity);
+    index->capacity = capacity;
+    index->mask = capacity - 1;
+    index->live = 0;
+    index->tombstones = 0;
+    expired = g_get_monotonic_time() - index->ttl;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].state != SLOT_LIVE)
+            continue;
+        if (old[i].time < expired) {
+            sms_handle.free(&old[i].handle);
+            continue;
+        }
+        at = probe(index, old[i].device, old[i].reference, old[i].recipient, &found);
+        index->slots[at] = old[i];
+        index->live++;
+    }
+    g_free(old);
+}
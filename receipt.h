@@ -0,0 +1,39 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_RECEIPT_H
+#define GSMAPP_RECEIPT_H
+
+#include "smshandle.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _t_receipt_index *ReceiptIndex;
+
+/*
+ * Submissions waiting for their delivery report, keyed by the modem that
+ * sent them, the TP-MR it assigned and the recipient. A modem hands out
+ * references 0-255 and starts over, the recipient keeps a reused reference
+ * apart from the older submissions still waiting on it.
+ */
+struct _receipt {
+    //capacity is rounded up to a power of two and grows as needed, a submission whose
+    //final report never comes is dropped ttl seconds after it was tracked
+    ReceiptIndex (* init) (size_t capacity, uint32_t ttl);
+    void        (* free) (ReceiptIndex *index);
+
+    //a reference reused for the same recipient replaces the older submission
+    void        (* track) (ReceiptIndex index, const void *device, uint8_t reference, const char *recipient,
+                           SMSHandle handle);
+    //a new reference to the handle of the submission, NULL if unknown; final forgets it
+    SMSHandle   (* resolve) (ReceiptIndex index, const void *device, uint8_t reference, const char *recipient,
+                             bool final);
+    size_t      (* get_size) (ReceiptIndex index);
+};
+extern const struct _receipt receipt;
+
+#endif //GSMAPP_RECEIPT_H
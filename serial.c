@@ -3,6 +3,7 @@
 // amin.khozaei@gmail.com
 //
 #include "serial.h"
+#include "logger.h"
 
 #include <termios.h>
 #include <string.h>
@@ -24,9 +25,11 @@ static void serial_open (SerialDevice device);
 static void serial_close (SerialDevice device);
 static intmax_t serial_write (SerialDevice device, const uint8_t *data, size_t length);
 static intmax_t serial_read (SerialDevice device,  uint8_t *data, size_t length, uint32_t  ms);
-static void serial_enable_async (SerialDevice device, void (* callback) (int fd, uint8_t *data, size_t length));
+static void serial_enable_async (SerialDevice device, serial_async_cb callback, void *user_data);
 static void serial_disable_async (SerialDevice device);
 static void *serial_read_async(void *device);
+static void close_epoll (void *epfd);
+static void serial_set_trace (SerialDevice device, Trace trace, uint16_t channel);
 
 static bool serial_set_baudrate (SerialDevice device, uint32_t baudrate);
 static void serial_set_parity (SerialDevice device,enum parity parity);
@@ -54,6 +57,7 @@ const struct _serial serial = {
         .read = &serial_read,
         .enable_async = &serial_enable_async,
         .disable_async = &serial_disable_async,
+        .set_trace = &serial_set_trace,
         .set_baudrate = &serial_set_baudrate,
         .set_parity = &serial_set_parity,
         .set_access_mode = &serial_set_access_mode,
@@ -79,7 +83,10 @@ struct _serial_device{
     struct termios      config;
     struct termios      old_config;
     pthread_t           *thread;
-    void (* callback) (int fd, uint8_t *data, size_t length);
+    serial_async_cb     callback;
+    void                *user_data;
+    Trace               trace;
+    uint16_t            trace_channel;
 };
 
 SerialDevice serial_init(const char *port)
@@ -104,6 +111,9 @@ SerialDevice serial_init(const char *port)
     device->config.c_cc[VTIME] = 0;
     device->config.c_cc[VMIN] = 1;
     device->thread = NULL;
+    device->callback = NULL;
+    device->user_data = NULL;
+    device->trace = NULL;
     return device;
 }
 
@@ -180,6 +190,8 @@ intmax_t serial_write (SerialDevice device, const uint8_t *data, size_t length)
     {
         res = write(device->fd, data, length);
         tcdrain(device->fd);
+        if (res > 0)
+            trace.record(device->trace, device->trace_channel, TRACE_TX, data, (size_t)res);
 //        tcflush(device->fd, TCIOFLUSH);
 //        sync();
     }
@@ -214,7 +226,7 @@ intmax_t serial_read (SerialDevice device,  uint8_t *data, size_t length, uint32
     return res;
 }
 
-void serial_enable_async (SerialDevice device, void (* callback) (int fd, uint8_t *data, size_t length))
+void serial_enable_async (SerialDevice device, serial_async_cb callback, void *user_data)
 {
     if (device == NULL)
         return;
@@ -222,11 +234,13 @@ void serial_enable_async (SerialDevice device, void (* callback) (int fd, uint8_
     {
         if (device->thread != NULL)
             serial_disable_async(device);
+        //set before the reader starts, its first chunk may arrive right away
+        device->callback = callback;
+        device->user_data = user_data;
         device->thread = malloc(sizeof (pthread_t));
         if (device->thread) {
             pthread_create(device->thread, NULL, serial_read_async,(void *)device);
         }
-        device->callback = callback;
     }
 }
 
@@ -237,16 +251,32 @@ void serial_disable_async (SerialDevice device)
     if (device->thread != NULL)
     {
         pthread_cancel(*device->thread);
+        if (!pthread_equal(*device->thread, pthread_self()))
+            pthread_join(*device->thread, NULL);
         free(device->thread);
         device->thread = NULL;
     }
 }
 
+void serial_set_trace (SerialDevice device, Trace t, uint16_t channel)
+{
+    if (device == NULL)
+        return;
+    device->trace_channel = channel;
+    device->trace = t;
+}
+
+void close_epoll (void *epfd)
+{
+    close(*(int *)epfd);
+}
+
 void *serial_read_async(void *device_void)
 {
     //read thread loop
     int epfd, ready;
     ssize_t len;
+    bool running;
     struct epoll_event ev, ev_list[MAX_EVENTS];
     uint8_t data[BUFFER_SIZE];
 
@@ -257,30 +287,37 @@ void *serial_read_async(void *device_void)
     epfd = epoll_create(1);
     if (epfd < 0)
         return NULL;
+    pthread_cleanup_push(close_epoll, &epfd);
     ev.events = EPOLLIN;
     ev.data.fd = device->fd;
-    if (epoll_ctl(epfd,EPOLL_CTL_ADD,device->fd,&ev) == -1)
-        return NULL;
-    while (device->thread != NULL && pthread_equal(*device->thread, pthread_self())) {
+    running = (epoll_ctl(epfd,EPOLL_CTL_ADD,device->fd,&ev) == 0);
+    while (running && device->thread != NULL && pthread_equal(*device->thread, pthread_self())) {
         ready = epoll_wait(epfd, ev_list, MAX_EVENTS,-1);
         if (ready == -1){
-            if (errno == EINTR)
-                continue;
-            else
-                return NULL;
+            running = (errno == EINTR);
+            continue;
         }
-        printf("ready: %d\n", ready);
+        LOG_TRACE("serial: %d ready", ready);
 
-        for (int i = 0; i < ready; i++) {
+        for (int i = 0; i < ready && running; i++) {
             if (ev_list[i].events & EPOLLIN) {
                 len = read(device->fd, data, BUFFER_SIZE);
-                if (len == -1)
-                    return NULL;
+                //an unplugged port reads as end of file or EIO, stop instead of spinning on it
+                if (len <= 0) {
+                    running = (len == -1 && (errno == EINTR || errno == EAGAIN));
+                    continue;
+                }
+                trace.record(device->trace, device->trace_channel, TRACE_RX, data, (size_t)len);
                 if (device->callback)
-                    device->callback(device->fd, data, len+1);
+                    device->callback(device->fd, data, len+1, device->user_data);
+            } else if (ev_list[i].events & (EPOLLHUP | EPOLLERR)) {
+                running = false;
             }
         }
     }
+    if (!running)
+        LOG_WARN("serial: %s hung up", device->port);
+    pthread_cleanup_pop(1);
 
     return NULL;
 }
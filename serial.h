@@ -5,6 +5,8 @@
 #ifndef GSMAPP_SERIAL_H
 #define GSMAPP_SERIAL_H
 
+#include "trace.h"
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
@@ -30,6 +32,8 @@ enum handshake {
 };
 
 typedef struct _serial_device *SerialDevice;
+//called on the reader thread with each chunk and the user_data given to enable_async
+typedef void (* serial_async_cb) (int fd, uint8_t *data, size_t length, void *user_data);
 
 struct _serial {
     SerialDevice (* init) (const char *port);
@@ -39,8 +43,10 @@ struct _serial {
     void (* close) (SerialDevice device);
     intmax_t (* write) (SerialDevice device,  const uint8_t *data, size_t length);
     intmax_t (* read) (SerialDevice device,  uint8_t *data, size_t length, uint32_t ms);
-    void (* enable_async) (SerialDevice device, void (* callback) (int fd, uint8_t *data, size_t length));
+    void (* enable_async) (SerialDevice device, serial_async_cb callback, void *user_data);
     void (* disable_async) (SerialDevice device);
+    //record every byte written and read on channel of trace, NULL stops recording
+    void (* set_trace) (SerialDevice device, Trace trace, uint16_t channel);
 
     bool (* set_baudrate) (SerialDevice device, const uint32_t baudrate);
     void (* set_parity) (SerialDevice device,enum parity parity);
@@ -0,0 +1,548 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#include "server.h"
+#include "logger.h"
+#include "fleet.h"
+#include "gsm.h"
+#include "dedup.h"
+
+#include <glib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SERVER_BACKLOG 1024
+#define CREDIT_INTERVAL 100
+#define CONNECTION_WINDOW 32
+#define CONNECTION_RX_LEN 16384
+#define CONNECTION_TX_LEN (CONNECTION_WINDOW * 64)
+#define FRAME_HEADER_LEN 4
+#define SUBMIT_RESP_LEN 14
+#define CREDIT_LEN 5
+
+typedef struct _t_connection *Connection;
+
+static Server server_init (uv_loop_t *loop, const char *address, int port);
+static void server_free (Server *srv);
+static void on_connection (uv_stream_t *stream, int status);
+static void on_alloc (uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
+static void on_read (uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+static void on_write (uv_write_t *req, int status);
+static void on_connection_close (uv_handle_t *handle);
+static void on_server_close (uv_handle_t *handle);
+static void on_completed (uv_async_t *async);
+static void on_credit_timer (uv_timer_t *timer);
+static void on_sms_complete (SMSHandle handle, const struct sms_completion *completion, void *user_data);
+static void connection_parse (Connection conn);
+static bool connection_submit (Connection conn, const uint8_t *body, size_t len, bool with_client_id);
+static void connection_respond (Connection conn, uint32_t id, const struct sms_completion *completion);
+static void connection_grant (Connection conn);
+static void connection_write (Connection conn, const uint8_t *frame, size_t len);
+static void connection_flush (Connection conn);
+static void connection_linger (Connection conn);
+static void connection_close (Connection conn);
+static void connection_destroy (Connection conn);
+
+struct request_slot {
+    Connection connection;
+    uint32_t id;
+    SMSHandle handle;
+    struct sms_completion completion;
+    struct request_slot *next;
+};
+
+struct _t_connection {
+    uv_tcp_t tcp;
+    Server server;
+    Connection prev;
+    Connection next;
+    uint8_t rx[CONNECTION_RX_LEN];
+    size_t rx_len;
+    //double buffered, one is on the wire while the other collects frames
+    uint8_t tx[2][CONNECTION_TX_LEN];
+    size_t tx_len;
+    int tx_index;
+    uv_write_t write_req;
+    struct request_slot slots[CONNECTION_WINDOW];
+    struct request_slot *free_slots;
+    //credits + in_flight + owed == CONNECTION_WINDOW
+    unsigned credits;
+    unsigned in_flight;
+    unsigned owed;
+    bool reading;
+    bool writing;
+    bool is_eof;    //the client half-closed, it still reads what it is owed
+    bool closing;
+    bool closed;
+};
+
+struct _t_server {
+    uv_loop_t *loop;
+    uv_tcp_t tcp;
+    uv_async_t async;
+    uv_timer_t timer;
+    Connection connections;
+    int handles;
+    bool closing;
+    //filled by device scheduler threads, drained on the loop
+    GMutex mutex_completed;
+    struct request_slot *completed_head;
+    struct request_slot *completed_tail;
+};
+
+const struct _server server = {
+    .init = &server_init,
+    .free = &server_free
+};
+
+static inline uint32_t read_u32 (const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint16_t read_u16 (const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline void write_u32 (uint8_t *p, uint32_t value)
+{
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+Server server_init (uv_loop_t *loop, const char *address, int port)
+{
+    struct sockaddr_in bind_addr;
+    Server srv;
+    int ret;
+
+    srv = g_new0(struct _t_server, 1);
+    g_assert(srv != NULL);
+    if (srv == NULL)
+        return NULL;
+    srv->loop = loop;
+    g_mutex_init(&srv->mutex_completed);
+    uv_tcp_init(loop, &srv->tcp);
+    uv_async_init(loop, &srv->async, on_completed);
+    uv_timer_init(loop, &srv->timer);
+    srv->tcp.data = srv;
+    srv->async.data = srv;
+    srv->timer.data = srv;
+    srv->handles = 3;
+
+    ret = uv_ip4_addr(address, port, &bind_addr);
+    if (ret == 0)
+        ret = uv_tcp_bind(&srv->tcp, (const struct sockaddr *)&bind_addr, 0);
+    if (ret == 0)
+        ret = uv_listen((uv_stream_t *)&srv->tcp, SERVER_BACKLOG, on_connection);
+    if (ret != 0) {
+        LOG_ERROR("server: listen on %s:%d failed: %s", address, port, uv_strerror(ret));
+        server_free(&srv);
+        return NULL;
+    }
+    uv_timer_start(&srv->timer, on_credit_timer, CREDIT_INTERVAL, CREDIT_INTERVAL);
+    return srv;
+}
+
+void server_free (Server *srv)
+{
+    Connection conn, next;
+
+    if (srv == NULL || (*srv) == NULL)
+        return;
+    (*srv)->closing = true;
+    uv_close((uv_handle_t *)&(*srv)->tcp, on_server_close);
+    uv_close((uv_handle_t *)&(*srv)->timer, on_server_close);
+    //the async handle stays open until in-flight messages of closed connections drain
+    for (conn = (*srv)->connections; conn != NULL; conn = next) {
+        next = conn->next;
+        connection_close(conn);
+    }
+    if ((*srv)->connections == NULL)
+        uv_close((uv_handle_t *)&(*srv)->async, on_server_close);
+    *srv = NULL;
+}
+
+void on_server_close (uv_handle_t *handle)
+{
+    Server srv;
+
+    srv = handle->data;
+    if (--srv->handles > 0)
+        return;
+    g_mutex_clear(&srv->mutex_completed);
+    g_free(srv);
+}
+
+void on_connection (uv_stream_t *stream, int status)
+{
+    uint8_t frame[FRAME_HEADER_LEN + CREDIT_LEN];
+    Connection conn;
+    Server srv;
+
+    srv = stream->data;
+    if (status < 0 || srv->closing)
+        return;
+    conn = g_new0(struct _t_connection, 1);
+    g_assert(conn != NULL);
+    if (conn == NULL)
+        return;
+    conn->server = srv;
+    uv_tcp_init(srv->loop, &conn->tcp);
+    conn->tcp.data = conn;
+    conn->next = srv->connections;
+    if (srv->connections != NULL)
+        srv->connections->prev = conn;
+    srv->connections = conn;
+    if (uv_accept(stream, (uv_stream_t *)&conn->tcp) != 0) {
+        connection_close(conn);
+        return;
+    }
+    uv_tcp_nodelay(&conn->tcp, 1);
+    for (int i = CONNECTION_WINDOW - 1; i >= 0; i--) {
+        conn->slots[i].connection = conn;
+        conn->slots[i].next = conn->free_slots;
+        conn->free_slots = &conn->slots[i];
+    }
+    conn->credits = CONNECTION_WINDOW;
+    write_u32(frame, CREDIT_LEN);
+    frame[4] = SERVER_FRAME_CREDIT;
+    write_u32(frame + 5, CONNECTION_WINDOW);
+    connection_write(conn, frame, sizeof(frame));
+    conn->reading = (uv_read_start((uv_stream_t *)&conn->tcp, on_alloc, on_read) == 0);
+    if (!conn->reading)
+        connection_close(conn);
+}
+
+//reads land straight behind whatever partial frame is already buffered
+void on_alloc (uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+{
+    Connection conn;
+
+    (void)suggested_size;
+    conn = handle->data;
+    buf->base = (char *)conn->rx + conn->rx_len;
+    buf->len = CONNECTION_RX_LEN - conn->rx_len;
+}
+
+void on_read (uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+    Connection conn;
+
+    (void)buf;
+    conn = stream->data;
+    if (nread == UV_EOF) {
+        if (conn->reading)
+            uv_read_stop((uv_stream_t *)&conn->tcp);
+        conn->reading = false;
+        conn->is_eof = true;
+        connection_linger(conn);
+        return;
+    }
+    if (nread < 0) {
+        connection_close(conn);
+        return;
+    }
+    conn->rx_len += (size_t)nread;
+    connection_parse(conn);
+}
+
+void connection_parse (Connection conn)
+{
+    size_t offset;
+    uint32_t len;
+    uint8_t type;
+
+    offset = 0;
+    while (!conn->closing && conn->rx_len - offset >= FRAME_HEADER_LEN) {
+        len = read_u32(conn->rx + offset);
+        if (len == 0 || len > CONNECTION_RX_LEN - FRAME_HEADER_LEN) {
+            connection_close(conn);
+            return;
+        }
+        if (conn->rx_len - offset < FRAME_HEADER_LEN + len)
+            break;
+        type = conn->rx[offset + FRAME_HEADER_LEN];
+        if (type != SERVER_FRAME_SUBMIT && type != SERVER_FRAME_SUBMIT_ID) {
+            connection_close(conn);
+            return;
+        }
+        //out of credit, leave the frame buffered and let TCP push back on the client
+        if (conn->credits == 0) {
+            if (conn->reading)
+                uv_read_stop((uv_stream_t *)&conn->tcp);
+            conn->reading = false;
+            break;
+        }
+        if (!connection_submit(conn, conn->rx + offset + FRAME_HEADER_LEN + 1, len - 1,
+                               type == SERVER_FRAME_SUBMIT_ID)) {
+            connection_close(conn);
+            return;
+        }
+        offset += FRAME_HEADER_LEN + len;
+    }
+    if (offset > 0) {
+        memmove(conn->rx, conn->rx + offset, conn->rx_len - offset);
+        conn->rx_len -= offset;
+    }
+}
+
+bool connection_submit (Connection conn, const uint8_t *body, size_t len, bool with_client_id)
+{
+    char client_id[DEDUP_CLIENT_ID_MAX_LEN + 1];
+    char number[SERVER_MAX_NUMBER_LEN + 1];
+    char text[SERVER_MAX_TEXT_LEN + 1];
+    struct sms_completion completion;
+    struct request_slot *slot;
+    size_t client_id_len, number_len, text_len;
+    GSMDevice device;
+    uint32_t id;
+
+    if (len < 4 + 1)
+        return false;
+    id = read_u32(body);
+    client_id_len = 0;
+    if (with_client_id) {
+        client_id_len = body[4];
+        if (client_id_len == 0 || client_id_len > DEDUP_CLIENT_ID_MAX_LEN ||
+            len < 4 + 1 + client_id_len + 1)
+            return false;
+        memcpy(client_id, body + 4 + 1, client_id_len);
+        client_id[client_id_len] = '\0';
+        //the rest of the frame is laid out as SUBMIT without its id
+        body += 1 + client_id_len;
+        len -= 1 + client_id_len;
+    }
+    number_len = body[4];
+    if (number_len == 0 || number_len > SERVER_MAX_NUMBER_LEN || len < 4 + 1 + number_len + 2)
+        return false;
+    text_len = read_u16(body + 4 + 1 + number_len);
+    if (text_len > SERVER_MAX_TEXT_LEN || len != 4 + 1 + number_len + 2 + text_len)
+        return false;
+    memcpy(number, body + 4 + 1, number_len);
+    number[number_len] = '\0';
+    memcpy(text, body + 4 + 1 + number_len + 2, text_len);
+    text[text_len] = '\0';
+
+    slot = conn->free_slots;
+    conn->free_slots = slot->next;
+    conn->credits--;
+    conn->in_flight++;
+    slot->id = id;
+    slot->handle = NULL;
+
+    device = NULL;
+    if (strlen(number) == number_len && strlen(text) == text_len &&
+        (!with_client_id || strlen(client_id) == client_id_len))
+        device = fleet.pick();
+    if (device != NULL && with_client_id)
+        slot->handle = gsm.send_sms_idempotent(device, client_id, text, number);
+    else if (device != NULL)
+        slot->handle = gsm.send_sms(device, text, number);
+    if (slot->handle == NULL) {
+        memset(&completion, 0, sizeof(completion));
+        completion.result = SMS_RESULT_FAILED;
+        completion.reference = -1;
+        completion.error = -1;
+        on_sms_complete(NULL, &completion, slot);
+        return true;
+    }
+    sms_handle.on_complete(slot->handle, on_sms_complete, slot);
+    return true;
+}
+
+//device scheduler thread
+void on_sms_complete (SMSHandle handle, const struct sms_completion *completion, void *user_data)
+{
+    struct request_slot *slot;
+    Server srv;
+
+    (void)handle;
+    slot = user_data;
+    srv = slot->connection->server;
+    slot->completion = *completion;
+    slot->next = NULL;
+    g_mutex_lock(&srv->mutex_completed);
+    if (srv->completed_tail != NULL)
+        srv->completed_tail->next = slot;
+    else
+        srv->completed_head = slot;
+    srv->completed_tail = slot;
+    g_mutex_unlock(&srv->mutex_completed);
+    uv_async_send(&srv->async);
+}
+
+void on_completed (uv_async_t *async)
+{
+    struct request_slot *slot, *next;
+    Connection conn;
+    Server srv;
+
+    srv = async->data;
+    g_mutex_lock(&srv->mutex_completed);
+    slot = srv->completed_head;
+    srv->completed_head = NULL;
+    srv->completed_tail = NULL;
+    g_mutex_unlock(&srv->mutex_completed);
+
+    for (; slot != NULL; slot = next) {
+        next = slot->next;
+        conn = slot->connection;
+        sms_handle.free(&slot->handle);
+        connection_respond(conn, slot->id, &slot->completion);
+        slot->next = conn->free_slots;
+        conn->free_slots = slot;
+        conn->in_flight--;
+        conn->owed++;
+        if (conn->closed && conn->in_flight == 0)
+            connection_destroy(conn);
+        else {
+            connection_grant(conn);
+            connection_linger(conn);
+        }
+    }
+}
+
+void on_credit_timer (uv_timer_t *timer)
+{
+    Connection conn;
+    Server srv;
+
+    srv = timer->data;
+    for (conn = srv->connections; conn != NULL; conn = conn->next)
+        connection_grant(conn);
+}
+
+void connection_respond (Connection conn, uint32_t id, const struct sms_completion *completion)
+{
+    uint8_t frame[FRAME_HEADER_LEN + SUBMIT_RESP_LEN];
+
+    write_u32(frame, SUBMIT_RESP_LEN);
+    frame[4] = SERVER_FRAME_SUBMIT_RESP;
+    write_u32(frame + 5, id);
+    frame[9] = (uint8_t)completion->result;
+    write_u32(frame + 10, (uint32_t)completion->reference);
+    write_u32(frame + 14, (uint32_t)completion->error);
+    connection_write(conn, frame, sizeof(frame));
+}
+
+//hands withheld credit back unless the modems or the client's socket are backed up
+void connection_grant (Connection conn)
+{
+    uint8_t frame[FRAME_HEADER_LEN + CREDIT_LEN];
+
+    if (conn->owed == 0 || conn->closing)
+        return;
+    if (conn->tx_len > CONNECTION_TX_LEN / 2 || fleet.is_saturated())
+        return;
+    write_u32(frame, CREDIT_LEN);
+    frame[4] = SERVER_FRAME_CREDIT;
+    write_u32(frame + 5, conn->owed);
+    conn->credits += conn->owed;
+    conn->owed = 0;
+    connection_write(conn, frame, sizeof(frame));
+    if (!conn->reading && !conn->closing) {
+        connection_parse(conn);
+        if (conn->credits > 0 && !conn->closing && !conn->is_eof)
+            conn->reading = (uv_read_start((uv_stream_t *)&conn->tcp, on_alloc, on_read) == 0);
+    }
+}
+
+void connection_write (Connection conn, const uint8_t *frame, size_t len)
+{
+    if (conn->closing)
+        return;
+    if (conn->tx_len + len > CONNECTION_TX_LEN) {
+        connection_close(conn);
+        return;
+    }
+    memcpy(conn->tx[conn->tx_index] + conn->tx_len, frame, len);
+    conn->tx_len += len;
+    connection_flush(conn);
+}
+
+void connection_flush (Connection conn)
+{
+    uv_buf_t buf;
+
+    if (conn->writing || conn->tx_len == 0 || conn->closing)
+        return;
+    buf = uv_buf_init((char *)conn->tx[conn->tx_index], (unsigned int)conn->tx_len);
+    if (uv_write(&conn->write_req, (uv_stream_t *)&conn->tcp, &buf, 1, on_write) != 0) {
+        connection_close(conn);
+        return;
+    }
+    conn->writing = true;
+    conn->tx_index ^= 1;
+    conn->tx_len = 0;
+}
+
+void on_write (uv_write_t *req, int status)
+{
+    Connection conn;
+
+    conn = req->handle->data;
+    conn->writing = false;
+    if (status < 0) {
+        connection_close(conn);
+        return;
+    }
+    connection_flush(conn);
+    connection_grant(conn);
+    connection_linger(conn);
+}
+
+//a half-closed connection stays open until its last response is on the wire
+void connection_linger (Connection conn)
+{
+    if (!conn->is_eof || conn->closing)
+        return;
+    if (conn->in_flight > 0 || conn->writing || conn->tx_len > 0)
+        return;
+    //a whole frame still buffered waits for credit, a partial one never completes
+    if (conn->rx_len >= FRAME_HEADER_LEN && conn->rx_len - FRAME_HEADER_LEN >= read_u32(conn->rx))
+        return;
+    connection_close(conn);
+}
+
+void connection_close (Connection conn)
+{
+    if (conn->closing)
+        return;
+    conn->closing = true;
+    if (conn->reading)
+        uv_read_stop((uv_stream_t *)&conn->tcp);
+    conn->reading = false;
+    uv_close((uv_handle_t *)&conn->tcp, on_connection_close);
+}
+
+void on_connection_close (uv_handle_t *handle)
+{
+    Connection conn;
+
+    conn = handle->data;
+    conn->closed = true;
+    //slots still reference the connection until their messages complete
+    if (conn->in_flight == 0)
+        connection_destroy(conn);
+}
+
+void connection_destroy (Connection conn)
+{
+    Server srv;
+
+    srv = conn->server;
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        srv->connections = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    g_free(conn);
+    if (srv->closing && srv->connections == NULL)
+        uv_close((uv_handle_t *)&srv->async, on_server_close);
+}
@@ -0,0 +1,42 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_SERVER_H
+#define GSMAPP_SERVER_H
+
+#include "uv.h"
+
+/*
+ * Submission protocol, all integers big endian. Every frame is
+ *   u32 length | u8 type | body[length - 1]
+ *
+ * SUBMIT       client -> server   u32 id | u8 number_len | number | u16 text_len | text (UTF-8)
+ * SUBMIT_ID    client -> server   u32 id | u8 client_id_len | client_id | u8 number_len | ...
+ *                                 as SUBMIT, a client_id seen in the last ten minutes is not
+ *                                 sent again and answers with the first submission's result
+ * SUBMIT_RESP  server -> client   u32 id | u8 result | i32 reference | i32 error
+ * CREDIT       server -> client   u32 count
+ *
+ * Clients may pipeline as many SUBMIT frames as they hold credits, responses
+ * arrive in completion order. The server grants credit back as messages
+ * complete and withholds it while the modems are saturated.
+ */
+#define SERVER_FRAME_SUBMIT 0x01
+#define SERVER_FRAME_CREDIT 0x02
+#define SERVER_FRAME_SUBMIT_ID 0x03
+#define SERVER_FRAME_SUBMIT_RESP 0x81
+
+#define SERVER_MAX_TEXT_LEN 4096
+#define SERVER_MAX_NUMBER_LEN 31
+
+typedef struct _t_server *Server;
+
+struct _server {
+    Server  (* init) (uv_loop_t *loop, const char *address, int port);
+    void    (* free) (Server *server);
+};
+extern const struct _server server;
+
+#endif //GSMAPP_SERVER_H
@@ -0,0 +1,758 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#define _GNU_SOURCE
+#include "shmring.h"
+#include "logger.h"
+#include "fleet.h"
+#include "gsm.h"
+
+#include <glib.h>
+#include <errno.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define SHM_RING_MAGIC 0x47534D52
+#define SHM_RING_VERSION 1
+#define SHM_RING_FDS 3
+//submissions taken from one producer per pass while others wait their turn
+#define SHM_RING_DRAIN_BATCH 32
+//claim attempts before a cell counts as unavailable, positions in shared memory may be garbage
+#define SHM_RING_CLAIM_TRIES 256
+
+struct shm_ring_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t submission_size;
+    uint32_t completion_size;
+    //each position on its own cache line, producers and consumers live in different processes
+    alignas(64) _Atomic uint64_t submit_enqueue;
+    alignas(64) _Atomic uint64_t submit_dequeue;
+    alignas(64) _Atomic uint64_t complete_enqueue;
+    alignas(64) _Atomic uint64_t complete_dequeue;
+};
+
+struct shm_submission {
+    _Atomic uint64_t sequence;
+    uint64_t user_data;
+    char number[SHM_RING_NUMBER_MAX];
+    uint16_t text_len;
+    uint8_t reserved[6];
+    char text[SHM_RING_TEXT_MAX];
+};
+
+struct shm_completion {
+    _Atomic uint64_t sequence;
+    uint64_t user_data;
+    int32_t result;
+    int32_t reference;
+    int32_t error;
+    uint32_t reserved;
+};
+
+_Static_assert(sizeof(struct shm_submission) == 1024, "submission slot must stay 1 KiB");
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "ring positions must be lock free to be shared");
+
+typedef struct _t_ring_channel *Channel;
+
+struct ring_map {
+    struct shm_ring_header *header;
+    struct shm_submission *submissions;
+    struct shm_completion *completions;
+    size_t len;
+    int memfd;
+    int submit_fd;
+    int complete_fd;
+};
+
+struct ring_request {
+    Channel channel;
+    uint64_t user_data;
+    SMSHandle handle;
+    struct sms_completion completion;
+    struct ring_request *next;
+};
+
+//one connected producer process and its private ring
+struct _t_ring_channel {
+    ShmRing ring;
+    Channel prev;
+    Channel next;
+    struct ring_map map;
+    uv_pipe_t pipe;
+    uv_poll_t poll;
+    int handles;
+    bool closing;
+    bool notify;
+    struct ring_request requests[SHM_RING_SLOTS];
+    struct ring_request *free_requests;
+    unsigned in_flight;
+};
+
+struct _t_shm_ring {
+    //producer side, the socket stays open for as long as the ring is in use
+    struct ring_map map;
+    int sock;
+    //gsmapp side
+    uv_loop_t *loop;
+    uv_pipe_t pipe;
+    uv_async_t async;
+    int handles;
+    bool closing;
+    char *path;
+    Channel channels;
+    Channel cursor;
+    GMutex mutex_completed;
+    struct ring_request *completed_head;
+    struct ring_request *completed_tail;
+};
+
+static ShmRing shm_ring_serve (uv_loop_t *loop, const char *path);
+static void shm_ring_free (ShmRing *ring);
+static ShmRing shm_ring_connect (const char *path);
+static bool shm_ring_submit (ShmRing ring, uint64_t user_data, const char *number, const char *text);
+static void shm_ring_doorbell (ShmRing ring);
+static size_t shm_ring_reap (ShmRing ring, struct shm_ring_completion *completions, size_t max);
+static int shm_ring_get_eventfd (ShmRing ring);
+static bool ring_map (struct ring_map *map, bool create);
+static void ring_unmap (struct ring_map *map);
+static bool channel_handoff (Channel channel);
+static void channel_drain (Channel channel, unsigned budget);
+static void channel_close (Channel channel);
+static void channel_destroy (Channel channel);
+static void on_connection (uv_stream_t *stream, int status);
+static void on_alloc (uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
+static void on_read (uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+static void on_doorbell (uv_poll_t *poll, int status, int events);
+static void on_async (uv_async_t *async);
+static void on_channel_close (uv_handle_t *handle);
+static void on_ring_close (uv_handle_t *handle);
+static void on_sms_complete (SMSHandle handle, const struct sms_completion *completion, void *user_data);
+
+const struct _shm_ring shm_ring = {
+    .serve = &shm_ring_serve,
+    .free = &shm_ring_free,
+    .connect = &shm_ring_connect,
+    .submit = &shm_ring_submit,
+    .doorbell = &shm_ring_doorbell,
+    .reap = &shm_ring_reap,
+    .get_eventfd = &shm_ring_get_eventfd
+};
+
+/*
+ * Bounded MPMC queue after Vyukov: every cell carries a sequence number that
+ * tells producers and consumers whose turn it is, so neither side takes a lock.
+ */
+static void *cell_at (void *cells, size_t size, uint64_t pos)
+{
+    return (uint8_t *)cells + (pos & (SHM_RING_SLOTS - 1)) * size;
+}
+
+static void *ring_claim_push (_Atomic uint64_t *enqueue, void *cells, size_t size, uint64_t *pos)
+{
+    _Atomic uint64_t *sequence;
+    int64_t diff;
+
+    *pos = atomic_load_explicit(enqueue, memory_order_relaxed);
+    for (int tries = 0; tries < SHM_RING_CLAIM_TRIES; tries++) {
+        sequence = cell_at(cells, size, *pos);
+        diff = (int64_t)(atomic_load_explicit(sequence, memory_order_acquire) - *pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(enqueue, pos, *pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                return sequence;
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            *pos = atomic_load_explicit(enqueue, memory_order_relaxed);
+        }
+    }
+    return NULL;
+}
+
+static void *ring_claim_pop (_Atomic uint64_t *dequeue, void *cells, size_t size, uint64_t *pos)
+{
+    _Atomic uint64_t *sequence;
+    int64_t diff;
+
+    *pos = atomic_load_explicit(dequeue, memory_order_relaxed);
+    for (int tries = 0; tries < SHM_RING_CLAIM_TRIES; tries++) {
+        sequence = cell_at(cells, size, *pos);
+        diff = (int64_t)(atomic_load_explicit(sequence, memory_order_acquire) - (*pos + 1));
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(dequeue, pos, *pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                return sequence;
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            *pos = atomic_load_explicit(dequeue, memory_order_relaxed);
+        }
+    }
+    return NULL;
+}
+
+static void ring_publish (void *cell, uint64_t pos)
+{
+    atomic_store_explicit((_Atomic uint64_t *)cell, pos + 1, memory_order_release);
+}
+
+static void ring_release (void *cell, uint64_t pos)
+{
+    atomic_store_explicit((_Atomic uint64_t *)cell, pos + SHM_RING_SLOTS, memory_order_release);
+}
+
+bool ring_map (struct ring_map *map, bool create)
+{
+    size_t submissions_off, completions_off;
+    struct stat st;
+    void *base;
+
+    submissions_off = (sizeof(struct shm_ring_header) + 63) & ~(size_t)63;
+    completions_off = submissions_off + SHM_RING_SLOTS * sizeof(struct shm_submission);
+    map->len = completions_off + SHM_RING_SLOTS * sizeof(struct shm_completion);
+    if (create) {
+        map->memfd = memfd_create("gsmapp-ring", MFD_CLOEXEC);
+        map->submit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        map->complete_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (map->memfd < 0 || map->submit_fd < 0 || map->complete_fd < 0)
+            return false;
+        if (ftruncate(map->memfd, (off_t)map->len) != 0)
+            return false;
+    } else if (fstat(map->memfd, &st) != 0 || (size_t)st.st_size != map->len) {
+        return false;
+    }
+    base = mmap(NULL, map->len, PROT_READ | PROT_WRITE, MAP_SHARED, map->memfd, 0);
+    if (base == MAP_FAILED)
+        return false;
+    map->header = base;
+    map->submissions = (struct shm_submission *)((uint8_t *)base + submissions_off);
+    map->completions = (struct shm_completion *)((uint8_t *)base + completions_off);
+    if (!create)
+        return map->header->magic == SHM_RING_MAGIC && map->header->version == SHM_RING_VERSION &&
+               map->header->slots == SHM_RING_SLOTS &&
+               map->header->submission_size == sizeof(struct shm_submission) &&
+               map->header->completion_size == sizeof(struct shm_completion);
+
+    map->header->magic = SHM_RING_MAGIC;
+    map->header->version = SHM_RING_VERSION;
+    map->header->slots = SHM_RING_SLOTS;
+    map->header->submission_size = sizeof(struct shm_submission);
+    map->header->completion_size = sizeof(struct shm_completion);
+    for (uint64_t i = 0; i < SHM_RING_SLOTS; i++) {
+        atomic_init(&map->submissions[i].sequence, i);
+        atomic_init(&map->completions[i].sequence, i);
+    }
+    atomic_init(&map->header->submit_enqueue, 0);
+    atomic_init(&map->header->submit_dequeue, 0);
+    atomic_init(&map->header->complete_enqueue, 0);
+    atomic_init(&map->header->complete_dequeue, 0);
+    return true;
+}
+
+void ring_unmap (struct ring_map *map)
+{
+    if (map->header != NULL)
+        munmap(map->header, map->len);
+    if (map->memfd >= 0)
+        close(map->memfd);
+    if (map->submit_fd >= 0)
+        close(map->submit_fd);
+    if (map->complete_fd >= 0)
+        close(map->complete_fd);
+    map->header = NULL;
+    map->memfd = map->submit_fd = map->complete_fd = -1;
+}
+
+ShmRing shm_ring_serve (uv_loop_t *loop, const char *path)
+{
+    ShmRing ring;
+    int ret;
+
+    ring = g_new0(struct _t_shm_ring, 1);
+    g_assert(ring != NULL);
+    if (ring == NULL)
+        return NULL;
+    ring->map.memfd = ring->map.submit_fd = ring->map.complete_fd = -1;
+    ring->loop = loop;
+    ring->path = g_strdup(path);
+    g_mutex_init(&ring->mutex_completed);
+    uv_pipe_init(loop, &ring->pipe, 0);
+    uv_async_init(loop, &ring->async, on_async);
+    ring->pipe.data = ring;
+    ring->async.data = ring;
+    ring->handles = 2;
+
+    unlink(path);
+    ret = uv_pipe_bind(&ring->pipe, path);
+    //only the gateway's own user may submit, nobody can connect before the listen
+    if (ret == 0 && chmod(path, S_IRUSR | S_IWUSR) != 0)
+        ret = -errno;
+    if (ret == 0)
+        ret = uv_listen((uv_stream_t *)&ring->pipe, 16, on_connection);
+    if (ret != 0) {
+        LOG_ERROR("shm ring: listen on %s failed: %s", path, uv_strerror(ret));
+        shm_ring_free(&ring);
+        return NULL;
+    }
+    return ring;
+}
+
+void shm_ring_free (ShmRing *ring)
+{
+    Channel channel, next;
+
+    if (ring == NULL || (*ring) == NULL)
+        return;
+    if ((*ring)->loop == NULL) {
+        ring_unmap(&(*ring)->map);
+        close((*ring)->sock);
+        g_free(*ring);
+        *ring = NULL;
+        return;
+    }
+    (*ring)->closing = true;
+    unlink((*ring)->path);
+    uv_close((uv_handle_t *)&(*ring)->pipe, on_ring_close);
+    //the async handle stays open until in-flight messages of closed channels drain
+    for (channel = (*ring)->channels; channel != NULL; channel = next) {
+        next = channel->next;
+        channel_close(channel);
+    }
+    if ((*ring)->channels == NULL)
+        uv_close((uv_handle_t *)&(*ring)->async, on_ring_close);
+    *ring = NULL;
+}
+
+void on_ring_close (uv_handle_t *handle)
+{
+    ShmRing ring;
+
+    ring = handle->data;
+    if (--ring->handles > 0)
+        return;
+    g_mutex_clear(&ring->mutex_completed);
+    g_free(ring->path);
+    g_free(ring);
+}
+
+void on_connection (uv_stream_t *stream, int status)
+{
+    Channel channel;
+    ShmRing ring;
+
+    ring = stream->data;
+    if (status < 0 || ring->closing)
+        return;
+    channel = g_new0(struct _t_ring_channel, 1);
+    g_assert(channel != NULL);
+    if (channel == NULL)
+        return;
+    channel->ring = ring;
+    channel->map.memfd = channel->map.submit_fd = channel->map.complete_fd = -1;
+    for (int i = SHM_RING_SLOTS - 1; i >= 0; i--) {
+        channel->requests[i].channel = channel;
+        channel->requests[i].next = channel->free_requests;
+        channel->free_requests = &channel->requests[i];
+    }
+    channel->next = ring->channels;
+    if (ring->channels != NULL)
+        ring->channels->prev = channel;
+    ring->channels = channel;
+
+    uv_pipe_init(ring->loop, &channel->pipe, 0);
+    channel->pipe.data = channel;
+    channel->handles = 1;
+    if (uv_accept(stream, (uv_stream_t *)&channel->pipe) != 0 || !ring_map(&channel->map, true) ||
+        uv_poll_init(ring->loop, &channel->poll, channel->map.submit_fd) != 0) {
+        LOG_ERROR("shm ring: cannot set up producer ring");
+        channel_close(channel);
+        return;
+    }
+    channel->poll.data = channel;
+    channel->handles = 2;
+    //the connection stays open only to notice the producer going away
+    if (!channel_handoff(channel) ||
+        uv_read_start((uv_stream_t *)&channel->pipe, on_alloc, on_read) != 0 ||
+        uv_poll_start(&channel->poll, UV_READABLE, on_doorbell) != 0)
+        channel_close(channel);
+}
+
+//hands the memfd and both eventfds to the producer
+bool channel_handoff (Channel channel)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SHM_RING_FDS)];
+        struct cmsghdr align;
+    } control;
+    int fds[SHM_RING_FDS];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    uv_os_fd_t fd;
+    char byte;
+
+    if (uv_fileno((uv_handle_t *)&channel->pipe, &fd) != 0)
+        return false;
+    fds[0] = channel->map.memfd;
+    fds[1] = channel->map.submit_fd;
+    fds[2] = channel->map.complete_fd;
+    byte = 'R';
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == 1;
+}
+
+void on_alloc (uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+{
+    static char discard[64];
+
+    (void)handle;
+    (void)suggested_size;
+    buf->base = discard;
+    buf->len = sizeof(discard);
+}
+
+void on_read (uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+    (void)buf;
+    if (nread < 0)
+        channel_close(stream->data);
+}
+
+void on_doorbell (uv_poll_t *poll, int status, int events)
+{
+    eventfd_t value;
+    Channel channel;
+
+    (void)events;
+    channel = poll->data;
+    if (status < 0)
+        return;
+    eventfd_read(channel->map.submit_fd, &value);
+    channel_drain(channel, SHM_RING_SLOTS);
+}
+
+/*
+ * Takes submissions off the shared ring as long as every message in flight
+ * is guaranteed a completion slot, the producer's doorbell after reaping
+ * resumes it.
+ */
+void channel_drain (Channel channel, unsigned budget)
+{
+    char number[SHM_RING_NUMBER_MAX];
+    char text[SHM_RING_TEXT_MAX + 1];
+    struct shm_ring_header *header;
+    struct shm_submission *cell;
+    struct ring_request *request;
+    struct sms_completion completion;
+    uint64_t pos, unreaped;
+    uint16_t text_len;
+    GSMDevice device;
+    bool valid;
+
+    header = channel->map.header;
+    while (!channel->closing && budget-- > 0) {
+        unreaped = atomic_load_explicit(&header->complete_enqueue, memory_order_relaxed) -
+                   atomic_load_explicit(&header->complete_dequeue, memory_order_relaxed);
+        if (channel->in_flight + unreaped >= SHM_RING_SLOTS || fleet.is_saturated())
+            break;
+        cell = ring_claim_pop(&header->submit_dequeue, channel->map.submissions,
+                              sizeof(struct shm_submission), &pos);
+        if (cell == NULL)
+            break;
+        request = channel->free_requests;
+        channel->free_requests = request->next;
+        channel->in_flight++;
+        request->user_data = cell->user_data;
+        request->handle = NULL;
+        //the producer can still write the cell, everything is copied out before it is checked
+        memcpy(number, cell->number, sizeof(number));
+        text_len = cell->text_len;
+        valid = (memchr(number, '\0', sizeof(number)) != NULL && number[0] != '\0' &&
+                 text_len <= SHM_RING_TEXT_MAX);
+        if (valid) {
+            memcpy(text, cell->text, text_len);
+            text[text_len] = '\0';
+        }
+        ring_release(cell, pos);
+
+        device = valid ? fleet.pick() : NULL;
+        if (device != NULL)
+            request->handle = gsm.send_sms(device, text, number);
+        if (request->handle == NULL) {
+            memset(&completion, 0, sizeof(completion));
+            completion.result = SMS_RESULT_FAILED;
+            completion.reference = -1;
+            completion.error = -1;
+            on_sms_complete(NULL, &completion, request);
+            continue;
+        }
+        sms_handle.on_complete(request->handle, on_sms_complete, request);
+    }
+}
+
+//device scheduler thread
+void on_sms_complete (SMSHandle handle, const struct sms_completion *completion, void *user_data)
+{
+    struct ring_request *request;
+    ShmRing ring;
+
+    (void)handle;
+    request = user_data;
+    ring = request->channel->ring;
+    request->completion = *completion;
+    request->next = NULL;
+    g_mutex_lock(&ring->mutex_completed);
+    if (ring->completed_tail != NULL)
+        ring->completed_tail->next = request;
+    else
+        ring->completed_head = request;
+    ring->completed_tail = request;
+    g_mutex_unlock(&ring->mutex_completed);
+    uv_async_send(&ring->async);
+}
+
+void on_async (uv_async_t *async)
+{
+    struct ring_request *request, *next;
+    struct shm_completion *cell;
+    Channel channel, start;
+    ShmRing ring;
+    uint64_t pos;
+
+    ring = async->data;
+    g_mutex_lock(&ring->mutex_completed);
+    request = ring->completed_head;
+    ring->completed_head = NULL;
+    ring->completed_tail = NULL;
+    g_mutex_unlock(&ring->mutex_completed);
+
+    for (; request != NULL; request = next) {
+        next = request->next;
+        channel = request->channel;
+        sms_handle.free(&request->handle);
+        if (!channel->closing) {
+            //drain reserved the slot, only a producer that corrupted its ring takes it away
+            cell = ring_claim_push(&channel->map.header->complete_enqueue, channel->map.completions,
+                                   sizeof(struct shm_completion), &pos);
+            if (cell == NULL) {
+                LOG_WARN("shm ring: producer corrupted its completion ring, dropping it");
+                channel_close(channel);
+            }
+        }
+        if (!channel->closing) {
+            cell->user_data = request->user_data;
+            cell->result = request->completion.result;
+            cell->reference = request->completion.reference;
+            cell->error = request->completion.error;
+            ring_publish(cell, pos);
+            channel->notify = true;
+        }
+        request->next = channel->free_requests;
+        channel->free_requests = request;
+        channel->in_flight--;
+        if (channel->handles == 0 && channel->in_flight == 0)
+            channel_destroy(channel);
+    }
+    //one wakeup per producer and batch
+    for (channel = ring->channels; channel != NULL; channel = channel->next) {
+        if (!channel->notify)
+            continue;
+        channel->notify = false;
+        eventfd_write(channel->map.complete_fd, 1);
+    }
+    //modem capacity freed up, hand it out starting with a different producer each time
+    if (ring->cursor == NULL)
+        ring->cursor = ring->channels;
+    start = ring->cursor;
+    for (channel = start; channel != NULL; ) {
+        channel_drain(channel, SHM_RING_DRAIN_BATCH);
+        channel = (channel->next != NULL) ? channel->next : ring->channels;
+        if (channel == start)
+            break;
+    }
+    if (ring->cursor != NULL)
+        ring->cursor = (ring->cursor->next != NULL) ? ring->cursor->next : ring->channels;
+}
+
+void channel_close (Channel channel)
+{
+    if (channel->closing)
+        return;
+    channel->closing = true;
+    uv_close((uv_handle_t *)&channel->pipe, on_channel_close);
+    if (channel->handles == 2)
+        uv_close((uv_handle_t *)&channel->poll, on_channel_close);
+}
+
+void on_channel_close (uv_handle_t *handle)
+{
+    Channel channel;
+
+    channel = handle->data;
+    if (--channel->handles > 0)
+        return;
+    //requests still reference the channel until their messages complete
+    if (channel->in_flight == 0)
+        channel_destroy(channel);
+}
+
+void channel_destroy (Channel channel)
+{
+    ShmRing ring;
+
+    ring = channel->ring;
+    if (ring->cursor == channel)
+        ring->cursor = channel->next;
+    if (channel->prev != NULL)
+        channel->prev->next = channel->next;
+    else
+        ring->channels = channel->next;
+    if (channel->next != NULL)
+        channel->next->prev = channel->prev;
+    ring_unmap(&channel->map);
+    g_free(channel);
+    if (ring->closing && ring->channels == NULL)
+        uv_close((uv_handle_t *)&ring->async, on_ring_close);
+}
+
+ShmRing shm_ring_connect (const char *path)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SHM_RING_FDS)];
+        struct cmsghdr align;
+    } control;
+    int fds[SHM_RING_FDS];
+    struct sockaddr_un addr;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ShmRing ring;
+    char byte;
+    int sock;
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return NULL;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        close(sock);
+        return NULL;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * SHM_RING_FDS)) {
+        close(sock);
+        return NULL;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    ring = g_new0(struct _t_shm_ring, 1);
+    g_assert(ring != NULL);
+    if (ring == NULL)
+        return NULL;
+    ring->sock = sock;
+    ring->map.memfd = fds[0];
+    ring->map.submit_fd = fds[1];
+    ring->map.complete_fd = fds[2];
+    if (!ring_map(&ring->map, false)) {
+        ring_unmap(&ring->map);
+        close(sock);
+        g_free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+bool shm_ring_submit (ShmRing ring, uint64_t user_data, const char *number, const char *text)
+{
+    struct shm_submission *cell;
+    size_t number_len, text_len;
+    uint64_t pos;
+
+    if (ring == NULL || number == NULL || text == NULL)
+        return false;
+    number_len = strlen(number);
+    text_len = strlen(text);
+    if (number_len >= SHM_RING_NUMBER_MAX || text_len > SHM_RING_TEXT_MAX)
+        return false;
+    cell = ring_claim_push(&ring->map.header->submit_enqueue, ring->map.submissions,
+                           sizeof(struct shm_submission), &pos);
+    if (cell == NULL)
+        return false;
+    cell->user_data = user_data;
+    memcpy(cell->number, number, number_len + 1);
+    cell->text_len = (uint16_t)text_len;
+    memcpy(cell->text, text, text_len);
+    ring_publish(cell, pos);
+    return true;
+}
+
+void shm_ring_doorbell (ShmRing ring)
+{
+    if (ring != NULL)
+        eventfd_write(ring->map.submit_fd, 1);
+}
+
+size_t shm_ring_reap (ShmRing ring, struct shm_ring_completion *completions, size_t max)
+{
+    struct shm_completion *cell;
+    eventfd_t value;
+    uint64_t pos;
+    size_t count;
+
+    if (ring == NULL || completions == NULL)
+        return 0;
+    eventfd_read(ring->map.complete_fd, &value);
+    for (count = 0; count < max; count++) {
+        cell = ring_claim_pop(&ring->map.header->complete_dequeue, ring->map.completions,
+                              sizeof(struct shm_completion), &pos);
+        if (cell == NULL)
+            break;
+        completions[count].user_data = cell->user_data;
+        completions[count].result = (enum sms_result)cell->result;
+        completions[count].reference = cell->reference;
+        completions[count].error = cell->error;
+        ring_release(cell, pos);
+    }
+    //freed completion slots may unblock the drain on the gsmapp side
+    if (count > 0)
+        shm_ring_doorbell(ring);
+    return count;
+}
+
+int shm_ring_get_eventfd (ShmRing ring)
+{
+    return (ring != NULL) ? ring->map.complete_fd : -1;
+}
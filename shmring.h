@@ -0,0 +1,57 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_SHMRING_H
+#define GSMAPP_SHMRING_H
+
+#include "smshandle.h"
+
+#include "uv.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Shared memory submission path for producers on the same host.
+ *
+ * Every producer process that connects to the unix socket gets its own
+ * memfd holding a ring of fixed size submission slots and a ring of
+ * completion slots, both safe for any number of threads in that process,
+ * plus two eventfds. Producers push any number of submissions and ring the
+ * doorbell once per batch. Completions are reaped from the second ring, its
+ * eventfd becomes readable when new ones are posted. The ring is dropped
+ * once the producer closes the connection and its messages have completed.
+ */
+#define SHM_RING_SLOTS 1024
+#define SHM_RING_NUMBER_MAX 32
+#define SHM_RING_TEXT_MAX 968
+
+typedef struct _t_shm_ring *ShmRing;
+
+struct shm_ring_completion {
+    uint64_t    user_data;
+    enum sms_result result;
+    int         reference;
+    int         error;
+};
+
+struct _shm_ring {
+    //gsmapp side, serves the ring on the loop and hands it out on a unix socket only its user can open
+    ShmRing (* serve) (uv_loop_t *loop, const char *path);
+    void    (* free) (ShmRing *ring);
+
+    //producer side
+    ShmRing (* connect) (const char *path);
+    //false if the ring is full or the message does not fit a slot
+    bool    (* submit) (ShmRing ring, uint64_t user_data, const char *number, const char *text);
+    void    (* doorbell) (ShmRing ring);
+    size_t  (* reap) (ShmRing ring, struct shm_ring_completion *completions, size_t max);
+    //readable when completions are posted
+    int     (* get_eventfd) (ShmRing ring);
+};
+extern const struct _shm_ring shm_ring;
+
+#endif //GSMAPP_SHMRING_H
@@ -4,16 +4,33 @@
 
 #include "smartpointer.h"
 
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK_SIZE 4096
+#define ARENA_CHUNK_MAX (256 * 1024)
+#define ARENA_ALIGN (_Alignof(max_align_t))
 
 static unique_ptr_t unique_ptr_make (void *ptr, free_func_ptr free);
 static unique_ptr_t unique_ptr_move (unique_ptr_t *src);
 static void *unique_ptr_get (unique_ptr_t ptr);
 static shared_ptr_t shared_ptr_make (void *ptr, free_func_ptr free);
+static shared_ptr_t shared_ptr_alloc (size_t size, free_func_ptr free);
 static shared_ptr_t shared_ptr_copy (shared_ptr_t ptr);
-static shared_ptr_t shared_ptr_move (shared_ptr_t src);
+static shared_ptr_t shared_ptr_move (shared_ptr_t *src);
 static void *shared_ptr_get (shared_ptr_t ptr);
 static int get_ref_count (shared_ptr_t ptr);
+static weak_ptr_t weak_ptr_make (shared_ptr_t ptr);
+static weak_ptr_t weak_ptr_copy (weak_ptr_t ptr);
+static shared_ptr_t weak_ptr_lock (weak_ptr_t ptr);
+static void weak_release (struct shared_ptr_s *block);
+static arena_ptr_t arena_ptr_make (size_t chunk_size);
+static void *arena_alloc (arena_ptr_t arena, size_t size);
+static char *arena_strdup (arena_ptr_t arena, const char *str);
+static char *arena_printf (arena_ptr_t arena, const char *format, ...);
 
 
 
@@ -22,21 +39,49 @@ struct unique_ptr_s{
     free_func_ptr free;
 };
 
+//strong references hold one weak reference between them, the block goes with the last weak
 struct shared_ptr_s {
+    atomic_int strong;
+    atomic_int weak;
     void *ptr;
     free_func_ptr free;
-    int *ref_count;
+    max_align_t payload[];
+};
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    max_align_t data[];
 };
 
+//the first chunk follows the header in the same allocation
+struct arena_ptr_s {
+    char *cursor;
+    char *limit;
+    size_t size;        //of the first chunk
+    size_t next_size;
+    struct arena_chunk *chunks;
+    max_align_t data[];
+};
+
+static _Thread_local arena_ptr_t spare_arena;
+
 const struct smartpointer_s smartpointer = {
         .unique_ptr_make = &unique_ptr_make,
         .unique_ptr_move = unique_ptr_move,
         .unique_ptr_get = unique_ptr_get,
         .shared_ptr_make = shared_ptr_make,
+        .shared_ptr_alloc = shared_ptr_alloc,
         .shared_ptr_copy = shared_ptr_copy,
         .shared_ptr_move = shared_ptr_move,
         .shared_ptr_get = shared_ptr_get,
         .get_ref_count = get_ref_count,
+        .weak_ptr_make = weak_ptr_make,
+        .weak_ptr_copy = weak_ptr_copy,
+        .weak_ptr_lock = weak_ptr_lock,
+        .arena_ptr_make = arena_ptr_make,
+        .arena_alloc = arena_alloc,
+        .arena_strdup = arena_strdup,
+        .arena_printf = arena_printf,
 };
 
 unique_ptr_t unique_ptr_make (void *ptr, free_func_ptr free)
@@ -59,7 +104,7 @@ unique_ptr_t unique_ptr_move (unique_ptr_t *src)
     if (src == NULL) return NULL;
     if (*src == NULL) return NULL;
 
-    target = malloc(sizeof(unique_ptr_t));
+    target = malloc(sizeof(struct unique_ptr_s));
     if (target == NULL) return NULL;
 
     target->ptr = (*src)->ptr;
@@ -79,47 +124,51 @@ void *unique_ptr_get (unique_ptr_t ptr)
 
 shared_ptr_t shared_ptr_make (void *ptr, free_func_ptr free)
 {
-    __attribute__((cleanup(shared_ptr_destroy))) shared_ptr_t new_ptr;
+    shared_ptr_t new_ptr;
 
-    new_ptr = malloc(sizeof(shared_ptr_t));
+    if (ptr == NULL) return NULL;
+    new_ptr = malloc(sizeof(struct shared_ptr_s));
     if (new_ptr == NULL) return NULL;
 
+    atomic_init(&new_ptr->strong, 1);
+    atomic_init(&new_ptr->weak, 1);
     new_ptr->ptr = ptr;
     new_ptr->free = free;
-    new_ptr->ref_count = malloc(sizeof(int));
-    *new_ptr->ref_count = 1;
     return new_ptr;
 }
 
-shared_ptr_t shared_ptr_copy (shared_ptr_t ptr)
+shared_ptr_t shared_ptr_alloc (size_t size, free_func_ptr free)
 {
-    shared_ptr_t copy;
-    if (ptr == NULL) return NULL;
+    shared_ptr_t new_ptr;
 
-    copy = malloc(sizeof(shared_ptr_t));
-    if (copy == NULL) return NULL;
+    new_ptr = malloc(sizeof(struct shared_ptr_s) + size);
+    if (new_ptr == NULL) return NULL;
 
-    copy->ptr = ptr->ptr;
-    copy->free = ptr->free;
-    copy->ref_count = ptr->ref_count;
-    ptr->ref_count++;
+    memset(new_ptr->payload, 0, size);
+    atomic_init(&new_ptr->strong, 1);
+    atomic_init(&new_ptr->weak, 1);
+    new_ptr->ptr = new_ptr->payload;
+    new_ptr->free = free;
+    return new_ptr;
+}
 
-    return copy;
+shared_ptr_t shared_ptr_copy (shared_ptr_t ptr)
+{
+    if (ptr == NULL) return NULL;
+
+    //a new reference can only come from a live one, nothing to order against
+    atomic_fetch_add_explicit(&ptr->strong, 1, memory_order_relaxed);
+    return ptr;
 }
 
-shared_ptr_t shared_ptr_move (shared_ptr_t src)
+shared_ptr_t shared_ptr_move (shared_ptr_t *src)
 {
     shared_ptr_t target;
-    if (src == NULL) return NULL;
-
-    target = malloc(sizeof(shared_ptr_t));
-    if (target == NULL) return NULL;
 
-    target->ptr = src->ptr;
-    target->free = src->free;
-    target->ref_count = src->ref_count;
+    if (src == NULL) return NULL;
 
-    free(src);
+    target = *src;
+    *src = NULL;
     return target;
 }
 
@@ -132,7 +181,140 @@ void *shared_ptr_get (shared_ptr_t ptr)
 int get_ref_count (shared_ptr_t ptr)
 {
     if (ptr == NULL) return -1;
-    return *ptr->ref_count;
+    return atomic_load_explicit(&ptr->strong, memory_order_relaxed);
+}
+
+weak_ptr_t weak_ptr_make (shared_ptr_t ptr)
+{
+    if (ptr == NULL) return NULL;
+
+    atomic_fetch_add_explicit(&ptr->weak, 1, memory_order_relaxed);
+    return (weak_ptr_t)ptr;
+}
+
+weak_ptr_t weak_ptr_copy (weak_ptr_t ptr)
+{
+    return weak_ptr_make((shared_ptr_t)ptr);
+}
+
+shared_ptr_t weak_ptr_lock (weak_ptr_t ptr)
+{
+    shared_ptr_t block;
+    int strong;
+
+    if (ptr == NULL) return NULL;
+
+    block = (shared_ptr_t)ptr;
+    //never resurrect, once the count reached zero the object is being freed
+    strong = atomic_load_explicit(&block->strong, memory_order_relaxed);
+    while (strong > 0) {
+        if (atomic_compare_exchange_weak_explicit(&block->strong, &strong, strong + 1,
+                                                  memory_order_acquire, memory_order_relaxed))
+            return block;
+    }
+    return NULL;
+}
+
+void weak_release (struct shared_ptr_s *block)
+{
+    if (atomic_fetch_sub_explicit(&block->weak, 1, memory_order_release) != 1)
+        return;
+    atomic_thread_fence(memory_order_acquire);
+    free(block);
+}
+
+arena_ptr_t arena_ptr_make (size_t chunk_size)
+{
+    arena_ptr_t arena;
+
+    if (chunk_size == 0) chunk_size = ARENA_CHUNK_SIZE;
+    chunk_size = (chunk_size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    arena = spare_arena;
+    if (arena != NULL && arena->size >= chunk_size) {
+        spare_arena = NULL;
+    } else {
+        arena = malloc(sizeof(struct arena_ptr_s) + chunk_size);
+        if (arena == NULL) return NULL;
+        arena->size = chunk_size;
+    }
+    arena->cursor = (char *)arena->data;
+    arena->limit = arena->cursor + arena->size;
+    arena->next_size = arena->size * 2;
+    arena->chunks = NULL;
+    return arena;
+}
+
+void *arena_alloc (arena_ptr_t arena, size_t size)
+{
+    struct arena_chunk *chunk;
+    size_t chunk_size;
+    void *ptr;
+
+    if (arena == NULL) return NULL;
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (size > (size_t)(arena->limit - arena->cursor)) {
+        chunk_size = (size > arena->next_size) ? size : arena->next_size;
+        chunk = malloc(sizeof(struct arena_chunk) + chunk_size);
+        if (chunk == NULL) return NULL;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->cursor = (char *)chunk->data;
+        arena->limit = arena->cursor + chunk_size;
+        if (arena->next_size < ARENA_CHUNK_MAX)
+            arena->next_size *= 2;
+    }
+    ptr = arena->cursor;
+    arena->cursor += size;
+    return ptr;
+}
+
+char *arena_strdup (arena_ptr_t arena, const char *str)
+{
+    char *copy;
+    size_t len;
+
+    if (str == NULL) return NULL;
+
+    len = strlen(str) + 1;
+    copy = arena_alloc(arena, len);
+    if (copy == NULL) return NULL;
+    memcpy(copy, str, len);
+    return copy;
+}
+
+char *arena_printf (arena_ptr_t arena, const char *format, ...)
+{
+    va_list args, retry;
+    size_t free_space, size;
+    char *str;
+    int len;
+
+    if (arena == NULL) return NULL;
+
+    //format straight into the free space, most strings fit and need no second pass
+    free_space = (size_t)(arena->limit - arena->cursor);
+    va_start(args, format);
+    va_copy(retry, args);
+    len = vsnprintf(arena->cursor, free_space, format, args);
+    va_end(args);
+    if (len < 0) {
+        va_end(retry);
+        return NULL;
+    }
+    if ((size_t)len < free_space) {
+        va_end(retry);
+        str = arena->cursor;
+        size = ((size_t)len + ARENA_ALIGN) & ~(ARENA_ALIGN - 1);
+        arena->cursor += (size < free_space) ? size : free_space;
+        return str;
+    }
+    str = arena_alloc(arena, (size_t)len + 1);
+    if (str != NULL)
+        vsnprintf(str, (size_t)len + 1, format, retry);
+    va_end(retry);
+    return str;
 }
 
 void unique_ptr_destroy(unique_ptr_t *ptr)
@@ -153,14 +335,41 @@ void shared_ptr_destroy(shared_ptr_t *ptr)
     if (ptr == NULL) return;
     if (*ptr == NULL) return;
 
-    (*ptr)->ref_count--;
-
-    if (get_ref_count(*ptr) <= 0) {
+    //release publishes this thread's writes, the acquire below sees all of them before free
+    if (atomic_fetch_sub_explicit(&(*ptr)->strong, 1, memory_order_release) == 1) {
+        atomic_thread_fence(memory_order_acquire);
         if ((*ptr)->free != NULL) {
             ((*ptr)->free)((*ptr)->ptr);
         }
-        free((*ptr)->ref_count);
-        free(*ptr);
-        *ptr = NULL;
+        weak_release(*ptr);
     }
-}
\ No newline at end of file
+    *ptr = NULL;
+}
+
+void weak_ptr_destroy(weak_ptr_t *ptr)
+{
+    if (ptr == NULL) return;
+    if (*ptr == NULL) return;
+
+    weak_release((shared_ptr_t)*ptr);
+    *ptr = NULL;
+}
+
+void arena_ptr_destroy(arena_ptr_t *ptr)
+{
+    struct arena_chunk *chunk;
+
+    if (ptr == NULL) return;
+    if (*ptr == NULL) return;
+
+    while ((*ptr)->chunks != NULL) {
+        chunk = (*ptr)->chunks;
+        (*ptr)->chunks = chunk->next;
+        free(chunk);
+    }
+    if (spare_arena == NULL)
+        spare_arena = *ptr;
+    else
+        free(*ptr);
+    *ptr = NULL;
+}
@@ -5,26 +5,54 @@
 #ifndef GSMAPP_SMARTPOINTER_H
 #define GSMAPP_SMARTPOINTER_H
 
+#include <stddef.h>
+
 #define unique_ptr __attribute__((cleanup(unique_ptr_destroy))) unique_ptr_t
 #define shared_ptr __attribute__((cleanup(shared_ptr_destroy))) shared_ptr_t
+#define weak_ptr __attribute__((cleanup(weak_ptr_destroy))) weak_ptr_t
+#define arena_ptr __attribute__((cleanup(arena_ptr_destroy))) arena_ptr_t
 
 typedef void (*free_func_ptr) (void *);
 typedef struct unique_ptr_s * unique_ptr_t;
 typedef struct shared_ptr_s * shared_ptr_t;
+typedef struct weak_ptr_s * weak_ptr_t;
+typedef struct arena_ptr_s * arena_ptr_t;
 
 struct smartpointer_s {
     unique_ptr_t (*unique_ptr_make) (void *ptr, free_func_ptr free);
     unique_ptr_t (*unique_ptr_move) (unique_ptr_t *src);
     void *(*unique_ptr_get) (unique_ptr_t ptr);
 
+    //takes ownership of ptr, the counts live in one block next to it
     shared_ptr_t (*shared_ptr_make) (void *ptr, free_func_ptr free);
+    //counts and a zeroed object of size bytes in a single allocation; free only releases
+    //what the object holds, its memory goes with the last strong or weak reference
+    shared_ptr_t (*shared_ptr_alloc) (size_t size, free_func_ptr free);
+    //every reference is the same block, copying one only counts it, safe across threads
     shared_ptr_t (*shared_ptr_copy) (shared_ptr_t ptr);
-    shared_ptr_t (*shared_ptr_move) (shared_ptr_t src);
+    shared_ptr_t (*shared_ptr_move) (shared_ptr_t *src);
     void *(*shared_ptr_get) (shared_ptr_t ptr);
     int (*get_ref_count) (shared_ptr_t ptr);
+
+    //observes the object without keeping it alive
+    weak_ptr_t (*weak_ptr_make) (shared_ptr_t ptr);
+    weak_ptr_t (*weak_ptr_copy) (weak_ptr_t ptr);
+    //a new strong reference, NULL once the object is gone
+    shared_ptr_t (*weak_ptr_lock) (weak_ptr_t ptr);
+
+    //bump allocator released as a whole when the scope ends, chunk_size 0 picks 4KB;
+    //the last released arena of each thread is kept for the next one
+    arena_ptr_t (*arena_ptr_make) (size_t chunk_size);
+    //aligned for any type, never freed on its own, NULL when out of memory
+    void *(*arena_alloc) (arena_ptr_t arena, size_t size);
+    char *(*arena_strdup) (arena_ptr_t arena, const char *str);
+    char *(*arena_printf) (arena_ptr_t arena, const char *format, ...)
+            __attribute__((format(printf, 2, 3)));
 };
 
 extern const struct smartpointer_s smartpointer;
 void unique_ptr_destroy(unique_ptr_t *ptr);
 void shared_ptr_destroy(shared_ptr_t *ptr);
+void weak_ptr_destroy(weak_ptr_t *ptr);
+void arena_ptr_destroy(arena_ptr_t *ptr);
 #endif //GSMAPP_SMARTPOINTER_H
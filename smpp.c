@@ -0,0 +1,810 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#include "smpp.h"
+#include "logger.h"
+#include "fleet.h"
+
+#include <glib.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SMPP_BACKLOG 256
+#define SMPP_SYSTEM_ID "gsmapp"
+#define SMPP_HEADER_LEN 16
+#define SMPP_RX_LEN 8192
+//outstanding submit_sm and deliver_sm per session
+#define SMPP_WINDOW 32
+#define SMPP_DELIVER_QUEUE_MAX 1024
+#define SMPP_SHORT_MESSAGE_MAX 254
+#define SMPP_ADDR_MAX 21
+#define SMPP_TIME_MAX 17
+#define SMPP_SERVICE_TYPE_MAX 6
+#define SMPP_SYSTEM_ID_MAX 16
+#define SMPP_PASSWORD_MAX 9
+#define SMPP_TLV_MESSAGE_PAYLOAD 0x0424
+#define SMPP_ESM_UDHI 0x40
+#define SMPP_ESME_RINVESMCLASS 0x00000043
+
+#define SMPP_DCS_DEFAULT 0x00
+#define SMPP_DCS_IA5 0x01
+#define SMPP_DCS_LATIN1 0x03
+#define SMPP_DCS_UCS2 0x08
+
+typedef struct _t_session *Session;
+
+enum session_state {
+    SESSION_OPEN,
+    SESSION_BOUND_TX,
+    SESSION_BOUND_RX,
+    SESSION_BOUND_TRX,
+    SESSION_UNBOUND
+};
+
+struct submit_slot {
+    Session session;
+    uint32_t sequence;
+    uint64_t message_id;
+    SMSHandle handle;
+    struct sms_completion completion;
+    struct submit_slot *next;
+};
+
+//an inbound message with its parts joined, waiting for a receiver
+struct inbound_message {
+    char sender[PDU_NUMBER_MAX_LEN];
+    size_t text_len;
+    char text[];
+};
+
+struct _t_session {
+    uv_tcp_t tcp;
+    Smpp smpp;
+    Session prev;
+    Session next;
+    enum session_state state;
+    uint8_t rx[SMPP_RX_LEN];
+    size_t rx_len;
+    //pdus are staged in tx while tx_wire is being written
+    GString *tx;
+    GString *tx_wire;
+    uv_write_t write_req;
+    struct submit_slot slots[SMPP_WINDOW];
+    struct submit_slot *free_slots;
+    unsigned in_flight;
+    unsigned deliver_pending;
+    uint32_t sequence;
+    bool writing;
+    bool closing;
+    bool closed;
+};
+
+struct _t_smpp {
+    uv_loop_t *loop;
+    uv_tcp_t tcp;
+    uv_async_t async;
+    int handles;
+    bool closing;
+    char *system_id;
+    char *password;
+    Session sessions;
+    GPtrArray *devices;
+    uint64_t message_id;
+    //loop only, inbound messages waiting for a receiver with room in its window
+    GQueue *deliver_queue;
+    //filled by device scheduler and reader threads, drained on the loop
+    GMutex mutex_async;
+    struct submit_slot *completed_head;
+    struct submit_slot *completed_tail;
+    GQueue *inbound;
+};
+
+static Smpp smpp_init (uv_loop_t *loop, const char *address, int port,
+                       const char *system_id, const char *password);
+static void smpp_free (Smpp *smpp);
+static void smpp_add_device (Smpp smpp, GSMDevice device);
+static void smpp_dispatch (Smpp smpp);
+static void on_connection (uv_stream_t *stream, int status);
+static void on_alloc (uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf);
+static void on_read (uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
+static void on_write (uv_write_t *req, int status);
+static void on_session_close (uv_handle_t *handle);
+static void on_smpp_close (uv_handle_t *handle);
+static void on_async (uv_async_t *async);
+static void on_sms_complete (SMSHandle handle, const struct sms_completion *completion, void *user_data);
+static void on_inbox (GSMDevice device, const struct reassembly_message *message, void *user_data);
+static void session_parse (Session session);
+static void session_command (Session session, uint32_t command, uint32_t sequence,
+                             const uint8_t *body, size_t len);
+static void session_bind (Session session, uint32_t command, uint32_t sequence,
+                          const uint8_t *body, size_t len);
+static void session_submit (Session session, uint32_t sequence, const uint8_t *body, size_t len);
+static void session_deliver (Session session, const struct inbound_message *inbound);
+static void session_send (Session session, uint32_t command, uint32_t status, uint32_t sequence,
+                          const uint8_t *body, size_t len);
+static void session_flush (Session session);
+static void session_close (Session session);
+static void session_destroy (Session session);
+static char *decode_short_message (uint8_t data_coding, const uint8_t *data, size_t len);
+
+const struct _smpp smpp = {
+    .init = &smpp_init,
+    .free = &smpp_free,
+    .add_device = &smpp_add_device
+};
+
+static inline uint32_t read_u32 (const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint16_t read_u16 (const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline void write_u32 (uint8_t *p, uint32_t value)
+{
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+//C-Octet String of at most max bytes including the terminator, NULL if malformed
+static const uint8_t *read_cstring (const uint8_t *p, const uint8_t *end, char *out, size_t max)
+{
+    for (size_t i = 0; p + i < end && i < max; i++) {
+        if (p[i] != '\0')
+            continue;
+        if (out != NULL) {
+            memcpy(out, p, i);
+            out[i] = '\0';
+        }
+        return p + i + 1;
+    }
+    return NULL;
+}
+
+Smpp smpp_init (uv_loop_t *loop, const char *address, int port,
+                const char *system_id, const char *password)
+{
+    struct sockaddr_in bind_addr;
+    Smpp srv;
+    int ret;
+
+    srv = g_new0(struct _t_smpp, 1);
+    g_assert(srv != NULL);
+    if (srv == NULL)
+        return NULL;
+    srv->loop = loop;
+    srv->system_id = (system_id != NULL) ? g_strdup(system_id) : NULL;
+    srv->password = (password != NULL) ? g_strdup(password) : NULL;
+    srv->devices = g_ptr_array_new();
+    srv->deliver_queue = g_queue_new();
+    srv->inbound = g_queue_new();
+    g_mutex_init(&srv->mutex_async);
+    uv_tcp_init(loop, &srv->tcp);
+    uv_async_init(loop, &srv->async, on_async);
+    srv->tcp.data = srv;
+    srv->async.data = srv;
+    srv->handles = 2;
+
+    ret = uv_ip4_addr(address, port, &bind_addr);
+    if (ret == 0)
+        ret = uv_tcp_bind(&srv->tcp, (const struct sockaddr *)&bind_addr, 0);
+    if (ret == 0)
+        ret = uv_listen((uv_stream_t *)&srv->tcp, SMPP_BACKLOG, on_connection);
+    if (ret != 0) {
+        LOG_ERROR("smpp: listen on %s:%d failed: %s", address, port, uv_strerror(ret));
+        smpp_free(&srv);
+        return NULL;
+    }
+    return srv;
+}
+
+void smpp_free (Smpp *srv)
+{
+    Session session, next;
+
+    if (srv == NULL || (*srv) == NULL)
+        return;
+    for (guint i = 0; i < (*srv)->devices->len; i++)
+        gsm.set_inbox_handler(g_ptr_array_index((*srv)->devices, i), NULL, NULL);
+    (*srv)->closing = true;
+    uv_close((uv_handle_t *)&(*srv)->tcp, on_smpp_close);
+    for (session = (*srv)->sessions; session != NULL; session = next) {
+        next = session->next;
+        session_close(session);
+    }
+    if ((*srv)->sessions == NULL)
+        uv_close((uv_handle_t *)&(*srv)->async, on_smpp_close);
+    *srv = NULL;
+}
+
+void on_smpp_close (uv_handle_t *handle)
+{
+    Smpp srv;
+
+    srv = handle->data;
+    if (--srv->handles > 0)
+        return;
+    g_queue_free_full(srv->deliver_queue, g_free);
+    g_queue_free_full(srv->inbound, g_free);
+    g_ptr_array_free(srv->devices, TRUE);
+    g_mutex_clear(&srv->mutex_async);
+    g_free(srv->system_id);
+    g_free(srv->password);
+    g_free(srv);
+}
+
+void smpp_add_device (Smpp srv, GSMDevice device)
+{
+    if (srv == NULL || device == NULL)
+        return;
+    g_ptr_array_add(srv->devices, device);
+    gsm.set_inbox_handler(device, on_inbox, srv);
+}
+
+void on_connection (uv_stream_t *stream, int status)
+{
+    Session session;
+    Smpp srv;
+
+    srv = stream->data;
+    if (status < 0 || srv->closing)
+        return;
+    session = g_new0(struct _t_session, 1);
+    g_assert(session != NULL);
+    if (session == NULL)
+        return;
+    session->smpp = srv;
+    session->state = SESSION_OPEN;
+    session->tx = g_string_sized_new(512);
+    session->tx_wire = g_string_sized_new(512);
+    uv_tcp_init(srv->loop, &session->tcp);
+    session->tcp.data = session;
+    session->next = srv->sessions;
+    if (srv->sessions != NULL)
+        srv->sessions->prev = session;
+    srv->sessions = session;
+    for (int i = SMPP_WINDOW - 1; i >= 0; i--) {
+        session->slots[i].session = session;
+        session->slots[i].next = session->free_slots;
+        session->free_slots = &session->slots[i];
+    }
+    if (uv_accept(stream, (uv_stream_t *)&session->tcp) != 0 ||
+        uv_read_start((uv_stream_t *)&session->tcp, on_alloc, on_read) != 0) {
+        session_close(session);
+        return;
+    }
+    uv_tcp_nodelay(&session->tcp, 1);
+}
+
+void on_alloc (uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+{
+    Session session;
+
+    (void)suggested_size;
+    session = handle->data;
+    buf->base = (char *)session->rx + session->rx_len;
+    buf->len = SMPP_RX_LEN - session->rx_len;
+}
+
+void on_read (uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+    Session session;
+
+    (void)buf;
+    session = stream->data;
+    if (nread < 0) {
+        session_close(session);
+        return;
+    }
+    session->rx_len += (size_t)nread;
+    session_parse(session);
+}
+
+void session_parse (Session session)
+{
+    size_t offset;
+    uint32_t len;
+
+    offset = 0;
+    while (!session->closing && session->rx_len - offset >= SMPP_HEADER_LEN) {
+        len = read_u32(session->rx + offset);
+        if (len < SMPP_HEADER_LEN || len > SMPP_RX_LEN) {
+            session_send(session, SMPP_GENERIC_NACK, SMPP_ESME_RINVCMDLEN,
+                         read_u32(session->rx + offset + 12), NULL, 0);
+            //framing is lost for good, nothing more is read and the session closes once flushed
+            uv_read_stop((uv_stream_t *)&session->tcp);
+            session->rx_len = 0;
+            session->state = SESSION_UNBOUND;
+            session_flush(session);
+            return;
+        }
+        if (session->rx_len - offset < len)
+            break;
+        session_command(session, read_u32(session->rx + offset + 4), read_u32(session->rx + offset + 12),
+                        session->rx + offset + SMPP_HEADER_LEN, len - SMPP_HEADER_LEN);
+        offset += len;
+    }
+    if (offset > 0) {
+        memmove(session->rx, session->rx + offset, session->rx_len - offset);
+        session->rx_len -= offset;
+    }
+}
+
+void session_command (Session session, uint32_t command, uint32_t sequence,
+                      const uint8_t *body, size_t len)
+{
+    //nothing but the unbind_resp goes out once unbound
+    if (session->state == SESSION_UNBOUND)
+        return;
+    switch (command) {
+        case SMPP_BIND_RECEIVER:
+        case SMPP_BIND_TRANSMITTER:
+        case SMPP_BIND_TRANSCEIVER:
+            session_bind(session, command, sequence, body, len);
+            break;
+        case SMPP_SUBMIT_SM:
+            if (session->state != SESSION_BOUND_TX && session->state != SESSION_BOUND_TRX)
+                session_send(session, SMPP_SUBMIT_SM | SMPP_RESP, SMPP_ESME_RINVBNDSTS, sequence, NULL, 0);
+            else
+                session_submit(session, sequence, body, len);
+            break;
+        case SMPP_DELIVER_SM | SMPP_RESP:
+            if (session->deliver_pending > 0)
+                session->deliver_pending--;
+            smpp_dispatch(session->smpp);
+            break;
+        case SMPP_ENQUIRE_LINK:
+            session_send(session, SMPP_ENQUIRE_LINK | SMPP_RESP, SMPP_ESME_ROK, sequence, NULL, 0);
+            break;
+        case SMPP_UNBIND:
+            session_send(session, SMPP_UNBIND | SMPP_RESP, SMPP_ESME_ROK, sequence, NULL, 0);
+            session->state = SESSION_UNBOUND;
+            session_flush(session);
+            break;
+        default:
+            if ((command & SMPP_RESP) == 0)
+                session_send(session, SMPP_GENERIC_NACK, SMPP_ESME_RINVCMDID, sequence, NULL, 0);
+            break;
+    }
+}
+
+void session_bind (Session session, uint32_t command, uint32_t sequence,
+                   const uint8_t *body, size_t len)
+{
+    char system_id[SMPP_SYSTEM_ID_MAX];
+    char password[SMPP_PASSWORD_MAX];
+    const uint8_t *p, *end;
+    Smpp srv;
+
+    srv = session->smpp;
+    end = body + len;
+    p = read_cstring(body, end, system_id, sizeof(system_id));
+    if (p != NULL)
+        p = read_cstring(p, end, password, sizeof(password));
+    if (p == NULL) {
+        session_send(session, command | SMPP_RESP, SMPP_ESME_RINVMSGLEN, sequence, NULL, 0);
+        return;
+    }
+    if (session->state != SESSION_OPEN) {
+        session_send(session, command | SMPP_RESP, SMPP_ESME_RALYBND, sequence, NULL, 0);
+        return;
+    }
+    if (srv->system_id != NULL && strcmp(srv->system_id, system_id) != 0) {
+        session_send(session, command | SMPP_RESP, SMPP_ESME_RINVSYSID, sequence, NULL, 0);
+        return;
+    }
+    if (srv->password != NULL && strcmp(srv->password, password) != 0) {
+        session_send(session, command | SMPP_RESP, SMPP_ESME_RINVPASWD, sequence, NULL, 0);
+        return;
+    }
+    if (command == SMPP_BIND_RECEIVER)
+        session->state = SESSION_BOUND_RX;
+    else if (command == SMPP_BIND_TRANSMITTER)
+        session->state = SESSION_BOUND_TX;
+    else
+        session->state = SESSION_BOUND_TRX;
+    session_send(session, command | SMPP_RESP, SMPP_ESME_ROK, sequence,
+                 (const uint8_t *)SMPP_SYSTEM_ID, sizeof(SMPP_SYSTEM_ID));
+    if (session->state != SESSION_BOUND_TX)
+        smpp_dispatch(srv);
+}
+
+void session_submit (Session session, uint32_t sequence, const uint8_t *body, size_t len)
+{
+    char number[SMPP_ADDR_MAX + 1];
+    const uint8_t *p, *end, *message;
+    uint8_t ton, esm_class, data_coding;
+    struct submit_slot *slot;
+    size_t message_len;
+    GSMDevice device;
+    char *text;
+
+    end = body + len;
+    p = read_cstring(body, end, NULL, SMPP_SERVICE_TYPE_MAX);
+    if (p != NULL && end - p >= 2)
+        p = read_cstring(p + 2, end, NULL, SMPP_ADDR_MAX);
+    else
+        p = NULL;
+    if (p != NULL && end - p >= 2) {
+        ton = p[0];
+        //international numbers arrive without the leading +
+        number[0] = '+';
+        p = read_cstring(p + 2, end, number + 1, SMPP_ADDR_MAX);
+    } else {
+        p = NULL;
+    }
+    if (p != NULL && end - p >= 3) {
+        esm_class = p[0];
+        p = read_cstring(p + 3, end, NULL, SMPP_TIME_MAX);
+    } else {
+        p = NULL;
+    }
+    if (p != NULL)
+        p = read_cstring(p, end, NULL, SMPP_TIME_MAX);
+    if (p == NULL || end - p < 5 || end - (p + 5) < p[4]) {
+        session_send(session, SMPP_SUBMIT_SM | SMPP_RESP, SMPP_ESME_RINVMSGLEN, sequence, NULL, 0);
+        return;
+    }
+    data_coding = p[2];
+    message_len = p[4];
+    message = p + 5;
+    for (p = message + message_len; end - p >= 4; p += 4 + read_u16(p + 2)) {
+        if (end - (p + 4) < read_u16(p + 2))
+            break;
+        if (read_u16(p) == SMPP_TLV_MESSAGE_PAYLOAD && message_len == 0) {
+            message = p + 4;
+            message_len = read_u16(p + 2);
+        }
+    }
+
+    if (number[1] == '\0') {
+        session_send(session, SMPP_SUBMIT_SM | SMPP_RESP, SMPP_ESME_RINVDSTADR, sequence, NULL, 0);
+        return;
+    }
+    //ESME side segmentation is not forwarded, long messages go in message_payload
+    if (esm_class & SMPP_ESM_UDHI) {
+        session_send(session, SMPP_SUBMIT_SM | SMPP_RESP, SMPP_ESME_RINVESMCLASS, sequence, NULL, 0);
+        return;
+    }
+    if (session->free_slots == NULL || fleet.is_saturated()) {
+        session_send(session, SMPP_SUBMIT_SM | SMPP_RESP, SMPP_ESME_RTHROTTLED, sequence, NULL, 0);
+        return;
+    }
+    device = fleet.pick();
+    text = decode_short_message(data_coding, message, message_len);
+    if (device == NULL || text == NULL) {
+        g_free(text);
+        session_send(session, SMPP_SUBMIT_SM | SMPP_RESP, SMPP_ESME_RSUBMITFAIL, sequence, NULL, 0);
+        return;
+    }
+
+    slot = session->free_slots;
+    slot->handle = gsm.send_sms(device, text, (ton == 1 && number[1] != '+') ? number : number + 1);
+    g_free(text);
+    if (slot->handle == NULL) {
+        session_send(session, SMPP_SUBMIT_SM | SMPP_RESP, SMPP_ESME_RSUBMITFAIL, sequence, NULL, 0);
+        return;
+    }
+    session->free_slots = slot->next;
+    session->in_flight++;
+    slot->sequence = sequence;
+    slot->message_id = ++session->smpp->message_id;
+    sms_handle.on_complete(slot->handle, on_sms_complete, slot);
+}
+
+//short_message bytes to the UTF-8 gsm.send_sms expects, NULL for unsupported data_coding
+char *decode_short_message (uint8_t data_coding, const uint8_t *data, size_t len)
+{
+    const char *charset;
+    size_t i;
+
+    switch (data_coding) {
+        case SMPP_DCS_DEFAULT:
+        case SMPP_DCS_IA5:
+            for (i = 0; i < len && data[i] != '\0' && data[i] < 0x80; i++);
+            if (i == len)
+                return g_strndup((const char *)data, len);
+            charset = "ISO-8859-1";
+            break;
+        case SMPP_DCS_LATIN1:
+            charset = "ISO-8859-1";
+            break;
+        case SMPP_DCS_UCS2:
+            charset = "UTF-16BE";
+            break;
+        default:
+            return NULL;
+    }
+    return g_convert((const char *)data, (gssize)len, "UTF-8", charset, NULL, NULL, NULL);
+}
+
+//device scheduler thread, or the loop when the handle was already done
+void on_sms_complete (SMSHandle handle, const struct sms_completion *completion, void *user_data)
+{
+    struct submit_slot *slot;
+    Smpp srv;
+
+    (void)handle;
+    slot = user_data;
+    srv = slot->session->smpp;
+    slot->completion = *completion;
+    slot->next = NULL;
+    g_mutex_lock(&srv->mutex_async);
+    if (srv->completed_tail != NULL)
+        srv->completed_tail->next = slot;
+    else
+        srv->completed_head = slot;
+    srv->completed_tail = slot;
+    g_mutex_unlock(&srv->mutex_async);
+    uv_async_send(&srv->async);
+}
+
+//device reader thread
+void on_inbox (GSMDevice device, const struct reassembly_message *message, void *user_data)
+{
+    struct inbound_message *copy;
+    size_t len;
+    Smpp srv;
+
+    (void)device;
+    srv = user_data;
+    //the parts are only lent for the call, they are joined once here for the loop
+    copy = g_malloc(sizeof (struct inbound_message) + message->text_len + 1);
+    g_strlcpy(copy->sender, message->sender, PDU_NUMBER_MAX_LEN);
+    len = 0;
+    for (uint8_t i = 0; i < message->part_count; i++) {
+        if (message->parts[i] == NULL)
+            continue;
+        memcpy(copy->text + len, message->parts[i]->text, message->parts[i]->text_len);
+        len += message->parts[i]->text_len;
+    }
+    copy->text[len] = '\0';
+    copy->text_len = len;
+    g_mutex_lock(&srv->mutex_async);
+    g_queue_push_tail(srv->inbound, copy);
+    g_mutex_unlock(&srv->mutex_async);
+    uv_async_send(&srv->async);
+}
+
+void on_async (uv_async_t *async)
+{
+    char message_id[24];
+    struct submit_slot *slot, *next;
+    struct inbound_message *deliver;
+    Session session;
+    GQueue *inbound;
+    Smpp srv;
+
+    srv = async->data;
+    g_mutex_lock(&srv->mutex_async);
+    slot = srv->completed_head;
+    srv->completed_head = NULL;
+    srv->completed_tail = NULL;
+    inbound = srv->inbound;
+    srv->inbound = g_queue_new();
+    g_mutex_unlock(&srv->mutex_async);
+
+    for (; slot != NULL; slot = next) {
+        next = slot->next;
+        session = slot->session;
+        sms_handle.free(&slot->handle);
+        if (slot->completion.result == SMS_RESULT_SENT) {
+            snprintf(message_id, sizeof(message_id), "%" PRIx64, slot->message_id);
+            session_send(session, SMPP_SUBMIT_SM | SMPP_RESP, SMPP_ESME_ROK, slot->sequence,
+                         (const uint8_t *)message_id, strlen(message_id) + 1);
+        } else {
+            session_send(session, SMPP_SUBMIT_SM | SMPP_RESP, SMPP_ESME_RSUBMITFAIL, slot->sequence,
+                         NULL, 0);
+        }
+        slot->next = session->free_slots;
+        session->free_slots = slot;
+        session->in_flight--;
+        if (session->closed && session->in_flight == 0)
+            session_destroy(session);
+        else if (session->state == SESSION_UNBOUND)
+            session_flush(session);
+    }
+
+    while ((deliver = g_queue_pop_head(inbound)) != NULL) {
+        if (g_queue_get_length(srv->deliver_queue) >= SMPP_DELIVER_QUEUE_MAX) {
+            LOG_WARN("smpp: no receiver bound, dropping message from %s", deliver->sender);
+            g_free(g_queue_pop_head(srv->deliver_queue));
+        }
+        g_queue_push_tail(srv->deliver_queue, deliver);
+    }
+    g_queue_free(inbound);
+    smpp_dispatch(srv);
+}
+
+//hands queued inbound messages to the bound receiver with the most room in its window
+void smpp_dispatch (Smpp srv)
+{
+    struct inbound_message *deliver;
+    Session session, best;
+
+    while (!g_queue_is_empty(srv->deliver_queue)) {
+        best = NULL;
+        for (session = srv->sessions; session != NULL; session = session->next) {
+            if (session->closing || session->deliver_pending >= SMPP_WINDOW)
+                continue;
+            if (session->state != SESSION_BOUND_RX && session->state != SESSION_BOUND_TRX)
+                continue;
+            if (best == NULL || session->deliver_pending < best->deliver_pending)
+                best = session;
+        }
+        if (best == NULL)
+            return;
+        deliver = g_queue_pop_head(srv->deliver_queue);
+        session_deliver(best, deliver);
+        g_free(deliver);
+    }
+}
+
+void session_deliver (Session session, const struct inbound_message *deliver)
+{
+    uint8_t *body;
+    const char *sender;
+    uint8_t ton, data_coding;
+    gsize message_len;
+    char *message;
+    size_t len, i;
+
+    sender = deliver->sender;
+    if (sender[0] == '+') {
+        ton = 1;
+        sender++;
+    } else {
+        for (i = 0; sender[i] >= '0' && sender[i] <= '9'; i++);
+        ton = (sender[i] == '\0') ? 0 : 5;
+    }
+    for (i = 0; i < deliver->text_len && (uint8_t)deliver->text[i] < 0x80; i++);
+    if (i == deliver->text_len) {
+        data_coding = SMPP_DCS_DEFAULT;
+        message = g_strndup(deliver->text, deliver->text_len);
+        message_len = deliver->text_len;
+    } else {
+        data_coding = SMPP_DCS_UCS2;
+        message = g_convert(deliver->text, (gssize)deliver->text_len, "UTF-16BE", "UTF-8",
+                            NULL, &message_len, NULL);
+    }
+    if (message == NULL)
+        return;
+
+    //a joined message may be far longer than one part, it goes in message_payload
+    body = g_malloc(64 + SMPP_ADDR_MAX + message_len);
+    len = 0;
+    body[len++] = '\0';                     //service_type
+    body[len++] = ton;
+    body[len++] = (ton == 1) ? 1 : 0;       //npi
+    memcpy(body + len, sender, strnlen(sender, SMPP_ADDR_MAX - 1));
+    len += strnlen(sender, SMPP_ADDR_MAX - 1);
+    body[len++] = '\0';
+    body[len++] = 0;                        //dest_addr_ton
+    body[len++] = 0;                        //dest_addr_npi
+    body[len++] = '\0';                     //destination_addr
+    body[len++] = 0;                        //esm_class
+    body[len++] = 0;                        //protocol_id
+    body[len++] = 0;                        //priority_flag
+    body[len++] = '\0';                     //schedule_delivery_time
+    body[len++] = '\0';                     //validity_period
+    body[len++] = 0;                        //registered_delivery
+    body[len++] = 0;                        //replace_if_present_flag
+    body[len++] = data_coding;
+    body[len++] = 0;                        //sm_default_msg_id
+    if (message_len <= SMPP_SHORT_MESSAGE_MAX) {
+        body[len++] = (uint8_t)message_len;
+    } else {
+        body[len++] = 0;
+        body[len++] = SMPP_TLV_MESSAGE_PAYLOAD >> 8;
+        body[len++] = SMPP_TLV_MESSAGE_PAYLOAD & 0xFF;
+        body[len++] = (uint8_t)(message_len >> 8);
+        body[len++] = (uint8_t)message_len;
+    }
+    memcpy(body + len, message, message_len);
+    len += message_len;
+    g_free(message);
+
+    session->deliver_pending++;
+    session_send(session, SMPP_DELIVER_SM, SMPP_ESME_ROK, ++session->sequence, body, len);
+    g_free(body);
+}
+
+void session_send (Session session, uint32_t command, uint32_t status, uint32_t sequence,
+                   const uint8_t *body, size_t len)
+{
+    uint8_t header[SMPP_HEADER_LEN];
+
+    if (session->closing)
+        return;
+    write_u32(header, (uint32_t)(SMPP_HEADER_LEN + len));
+    write_u32(header + 4, command);
+    write_u32(header + 8, status);
+    write_u32(header + 12, sequence);
+    g_string_append_len(session->tx, (const gchar *)header, SMPP_HEADER_LEN);
+    if (len > 0)
+        g_string_append_len(session->tx, (const gchar *)body, (gssize)len);
+    session_flush(session);
+}
+
+void session_flush (Session session)
+{
+    GString *swap;
+    uv_buf_t buf;
+
+    if (session->writing || session->closing)
+        return;
+    if (session->tx->len == 0) {
+        //outstanding submit_sm_resp still go out after unbind
+        if (session->state == SESSION_UNBOUND && session->in_flight == 0)
+            session_close(session);
+        return;
+    }
+    swap = session->tx_wire;
+    session->tx_wire = session->tx;
+    session->tx = swap;
+    buf = uv_buf_init(session->tx_wire->str, (unsigned int)session->tx_wire->len);
+    if (uv_write(&session->write_req, (uv_stream_t *)&session->tcp, &buf, 1, on_write) != 0) {
+        session_close(session);
+        return;
+    }
+    session->writing = true;
+}
+
+void on_write (uv_write_t *req, int status)
+{
+    Session session;
+
+    session = req->handle->data;
+    session->writing = false;
+    g_string_truncate(session->tx_wire, 0);
+    if (status < 0) {
+        session_close(session);
+        return;
+    }
+    session_flush(session);
+}
+
+void session_close (Session session)
+{
+    if (session->closing)
+        return;
+    session->closing = true;
+    uv_close((uv_handle_t *)&session->tcp, on_session_close);
+}
+
+void on_session_close (uv_handle_t *handle)
+{
+    Session session;
+
+    session = handle->data;
+    session->closed = true;
+    //slots still reference the session until their messages complete
+    if (session->in_flight == 0)
+        session_destroy(session);
+}
+
+void session_destroy (Session session)
+{
+    Smpp srv;
+
+    srv = session->smpp;
+    if (session->prev != NULL)
+        session->prev->next = session->next;
+    else
+        srv->sessions = session->next;
+    if (session->next != NULL)
+        session->next->prev = session->prev;
+    g_string_free(session->tx, TRUE);
+    g_string_free(session->tx_wire, TRUE);
+    g_free(session);
+    if (srv->closing && srv->sessions == NULL)
+        uv_close((uv_handle_t *)&srv->async, on_smpp_close);
+}
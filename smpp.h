@@ -0,0 +1,50 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_SMPP_H
+#define GSMAPP_SMPP_H
+
+#include "gsm.h"
+
+#include "uv.h"
+
+//SMPP 3.4 subset, ESME facing
+#define SMPP_BIND_RECEIVER 0x00000001
+#define SMPP_BIND_TRANSMITTER 0x00000002
+#define SMPP_SUBMIT_SM 0x00000004
+#define SMPP_DELIVER_SM 0x00000005
+#define SMPP_UNBIND 0x00000006
+#define SMPP_BIND_TRANSCEIVER 0x00000009
+#define SMPP_ENQUIRE_LINK 0x00000015
+#define SMPP_GENERIC_NACK 0x80000000
+#define SMPP_RESP 0x80000000
+
+#define SMPP_ESME_ROK 0x00000000
+#define SMPP_ESME_RINVMSGLEN 0x00000001
+#define SMPP_ESME_RINVCMDLEN 0x00000002
+#define SMPP_ESME_RINVCMDID 0x00000003
+#define SMPP_ESME_RINVBNDSTS 0x00000004
+#define SMPP_ESME_RALYBND 0x00000005
+#define SMPP_ESME_RSYSERR 0x00000008
+#define SMPP_ESME_RINVDSTADR 0x0000000B
+#define SMPP_ESME_RBINDFAIL 0x0000000D
+#define SMPP_ESME_RINVPASWD 0x0000000E
+#define SMPP_ESME_RINVSYSID 0x0000000F
+#define SMPP_ESME_RSUBMITFAIL 0x00000045
+#define SMPP_ESME_RTHROTTLED 0x00000058
+
+typedef struct _t_smpp *Smpp;
+
+struct _smpp {
+    //NULL system_id/password accept any bind
+    Smpp    (* init) (uv_loop_t *loop, const char *address, int port,
+                      const char *system_id, const char *password);
+    void    (* free) (Smpp *smpp);
+    //routes messages received on the device to bound receivers as deliver_sm
+    void    (* add_device) (Smpp smpp, GSMDevice device);
+};
+extern const struct _smpp smpp;
+
+#endif //GSMAPP_SMPP_H
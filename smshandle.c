@@ -0,0 +1,199 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#include "smshandle.h"
+
+#include <glib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+static SMSHandle sms_handle_init (void);
+static SMSHandle sms_handle_ref (SMSHandle handle);
+static void sms_handle_free (SMSHandle *handle);
+static void sms_handle_on_complete (SMSHandle handle, sms_handle_cb cb, void *user_data);
+static int sms_handle_get_eventfd (SMSHandle handle);
+static bool sms_handle_is_done (SMSHandle handle);
+static bool sms_handle_get_completion (SMSHandle handle, struct sms_completion *completion);
+static void sms_handle_mark_sent (SMSHandle handle);
+static bool sms_handle_complete (SMSHandle handle, const struct sms_completion *completion);
+
+struct handle_waiter {
+    sms_handle_cb cb;
+    void *user_data;
+    struct handle_waiter *next;
+};
+
+struct _t_sms_handle {
+    gint ref_count;
+    GMutex mutex;
+    struct sms_completion completion;
+    struct handle_waiter *waiters;
+    struct handle_waiter *waiters_tail;
+    int event_fd;
+};
+
+const struct _sms_handle sms_handle = {
+    .init = &sms_handle_init,
+    .ref = &sms_handle_ref,
+    .free = &sms_handle_free,
+    .on_complete = &sms_handle_on_complete,
+    .get_eventfd = &sms_handle_get_eventfd,
+    .is_done = &sms_handle_is_done,
+    .get_completion = &sms_handle_get_completion,
+    .mark_sent = &sms_handle_mark_sent,
+    .complete = &sms_handle_complete
+};
+
+SMSHandle sms_handle_init (void)
+{
+    struct _t_sms_handle *handle;
+
+    handle = g_new0(struct _t_sms_handle, 1);
+    g_assert(handle != NULL);
+    if (handle == NULL)
+        return NULL;
+    handle->ref_count = 1;
+    g_mutex_init(&handle->mutex);
+    handle->completion.result = SMS_RESULT_PENDING;
+    handle->completion.reference = -1;
+    handle->completion.error = -1;
+    handle->completion.queued_time = g_get_monotonic_time();
+    handle->event_fd = -1;
+    return handle;
+}
+
+SMSHandle sms_handle_ref (SMSHandle handle)
+{
+    if (handle == NULL)
+        return NULL;
+    g_atomic_int_inc(&handle->ref_count);
+    return handle;
+}
+
+void sms_handle_free (SMSHandle *handle)
+{
+    if (handle == NULL)
+        return;
+    if ((*handle) == NULL)
+        return;
+    if (g_atomic_int_dec_and_test(&(*handle)->ref_count)) {
+        if ((*handle)->event_fd >= 0)
+            close((*handle)->event_fd);
+        for (struct handle_waiter *waiter = (*handle)->waiters, *next; waiter != NULL; waiter = next) {
+            next = waiter->next;
+            g_free(waiter);
+        }
+        g_mutex_clear(&(*handle)->mutex);
+        g_free(*handle);
+    }
+    *handle = NULL;
+}
+
+void sms_handle_on_complete (SMSHandle handle, sms_handle_cb cb, void *user_data)
+{
+    struct sms_completion completion;
+    struct handle_waiter *waiter;
+    bool done;
+
+    if (handle == NULL)
+        return;
+    g_mutex_lock(&handle->mutex);
+    done = (handle->completion.result != SMS_RESULT_PENDING);
+    if (!done && cb != NULL) {
+        waiter = g_new0(struct handle_waiter, 1);
+        waiter->cb = cb;
+        waiter->user_data = user_data;
+        if (handle->waiters_tail != NULL)
+            handle->waiters_tail->next = waiter;
+        else
+            handle->waiters = waiter;
+        handle->waiters_tail = waiter;
+    }
+    completion = handle->completion;
+    g_mutex_unlock(&handle->mutex);
+    if (done && cb != NULL)
+        cb(handle, &completion, user_data);
+}
+
+int sms_handle_get_eventfd (SMSHandle handle)
+{
+    int fd;
+
+    if (handle == NULL)
+        return -1;
+    g_mutex_lock(&handle->mutex);
+    if (handle->event_fd < 0) {
+        handle->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (handle->event_fd >= 0 && handle->completion.result != SMS_RESULT_PENDING)
+            eventfd_write(handle->event_fd, 1);
+    }
+    fd = handle->event_fd;
+    g_mutex_unlock(&handle->mutex);
+    return fd;
+}
+
+bool sms_handle_is_done (SMSHandle handle)
+{
+    bool done;
+
+    if (handle == NULL)
+        return false;
+    g_mutex_lock(&handle->mutex);
+    done = (handle->completion.result != SMS_RESULT_PENDING);
+    g_mutex_unlock(&handle->mutex);
+    return done;
+}
+
+bool sms_handle_get_completion (SMSHandle handle, struct sms_completion *completion)
+{
+    if (handle == NULL || completion == NULL)
+        return false;
+    g_mutex_lock(&handle->mutex);
+    *completion = handle->completion;
+    g_mutex_unlock(&handle->mutex);
+    return completion->result != SMS_RESULT_PENDING;
+}
+
+void sms_handle_mark_sent (SMSHandle handle)
+{
+    if (handle == NULL)
+        return;
+    g_mutex_lock(&handle->mutex);
+    if (handle->completion.sent_time == 0)
+        handle->completion.sent_time = g_get_monotonic_time();
+    g_mutex_unlock(&handle->mutex);
+}
+
+bool sms_handle_complete (SMSHandle handle, const struct sms_completion *completion)
+{
+    struct sms_completion local;
+    struct handle_waiter *waiter, *next;
+
+    if (handle == NULL || completion == NULL)
+        return false;
+    g_mutex_lock(&handle->mutex);
+    //only the first result counts, later steps of a failed chain are ignored
+    if (handle->completion.result != SMS_RESULT_PENDING) {
+        g_mutex_unlock(&handle->mutex);
+        return false;
+    }
+    handle->completion.result = completion->result;
+    handle->completion.reference = completion->reference;
+    handle->completion.error = completion->error;
+    handle->completion.done_time = g_get_monotonic_time();
+    if (handle->event_fd >= 0)
+        eventfd_write(handle->event_fd, 1);
+    local = handle->completion;
+    waiter = handle->waiters;
+    handle->waiters = NULL;
+    handle->waiters_tail = NULL;
+    g_mutex_unlock(&handle->mutex);
+    for (; waiter != NULL; waiter = next) {
+        next = waiter->next;
+        waiter->cb(handle, &local, waiter->user_data);
+        g_free(waiter);
+    }
+    return true;
+}
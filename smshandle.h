@@ -0,0 +1,52 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_SMSHANDLE_H
+#define GSMAPP_SMSHANDLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum sms_result {
+    SMS_RESULT_PENDING,
+    SMS_RESULT_SENT,
+    SMS_RESULT_FAILED,
+    SMS_RESULT_TIMEOUT,
+    SMS_RESULT_CANCELLED
+};
+
+struct sms_completion {
+    enum sms_result result;
+    int         reference;  //+CMGS message reference of the last part, -1 if none
+    int         error;      //+CMS/+CME ERROR code, -1 if none
+    int64_t     queued_time;//monotonic, microseconds
+    int64_t     sent_time;
+    int64_t     done_time;
+};
+
+typedef struct _t_sms_handle *SMSHandle;
+typedef void (* sms_handle_cb) (SMSHandle handle, const struct sms_completion *completion,
+                                void *user_data);
+
+struct _sms_handle {
+    SMSHandle   (* init) (void);
+    SMSHandle   (* ref) (SMSHandle handle);
+    void        (* free) (SMSHandle *handle);
+
+    //runs on the device scheduler thread, or right away if the handle is already done,
+    //a handle shared by duplicate submissions calls every registered callback in order
+    void        (* on_complete) (SMSHandle handle, sms_handle_cb cb, void *user_data);
+    //readable once the handle is done, owned by the handle
+    int         (* get_eventfd) (SMSHandle handle);
+    bool        (* is_done) (SMSHandle handle);
+    bool        (* get_completion) (SMSHandle handle, struct sms_completion *completion);
+
+    void        (* mark_sent) (SMSHandle handle);
+    //true if this call resolved the handle, false if it was already done
+    bool        (* complete) (SMSHandle handle, const struct sms_completion *completion);
+};
+extern const struct _sms_handle sms_handle;
+
+#endif //GSMAPP_SMSHANDLE_H
@@ -0,0 +1,635 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#include "store.h"
+#include "logger.h"
+#include "logfile.h"
+
+#include <glib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define STORE_SEGMENT_MAX (64 * 1024 * 1024)
+#define STORE_BATCH_BYTES (256 * 1024)
+#define STORE_COMMIT_INTERVAL 20000 //microsecond, nothing waits on an inbound message being stored
+#define STORE_RETRY_INTERVAL 1000000 //microsecond, before a batch that failed to reach the disk goes out again
+//a time index entry every this many messages, a range query reads at most as many before its start
+#define STORE_SPARSE_INTERVAL 64
+//framed by logfile, host byte order
+//body is u64 id | i64 received | i64 timestamp | u8 len | port | u8 len | sender | u16 len | text
+#define STORE_BODY_MIN 28
+#define STORE_SUFFIX ".msg"
+#define LOCATION(SEGMENT, OFFSET) ((uint64_t)(SEGMENT) << 32 | (uint64_t)(OFFSET))
+#define LOCATION_SEGMENT(X) ((guint)((X) >> 32))
+#define LOCATION_OFFSET(X) ((size_t)((X) & 0xFFFFFFFF))
+
+struct store_segment {
+    uint64_t seq;
+    guint index;        //position in segments, the segment part of a location
+    char *path;
+    int fd;             //open while it is the active segment
+    size_t written;     //indexed bytes, everything a query may read
+    uint8_t *map;
+    size_t map_len;
+};
+
+struct store_mark {
+    int64_t received;
+    uint64_t location;
+};
+
+//the segment being indexed at open
+struct store_scan {
+    Store s;
+    struct store_segment *segment;
+};
+
+struct store_postings {
+    uint64_t hash;
+    GArray *locations;  //of every message from senders with this hash, in arrival order
+};
+
+struct _t_store {
+    char *dir;
+    GMutex mutex;       //the batch being filled
+    GCond cond_work;
+    GCond cond_durable;
+    pthread_t writer;
+    bool stop;
+    GString *pending;
+    GString *writing;
+    uint64_t appended;
+    uint64_t durable;
+    int64_t last_received;
+    bool read_only;
+    //taken by queries, and by the writer only to publish a batch it has written
+    GMutex index_mutex;
+    GPtrArray *segments;
+    struct store_segment *active;
+    GArray *marks;
+    GHashTable *senders;
+    uint64_t count;
+};
+
+static Store store_open (const char *dir);
+static Store store_open_readonly (const char *dir);
+static Store store_load (const char *dir, bool read_only);
+static void store_close (Store *s);
+static void store_append (Store s, const char *port, const struct reassembly_message *message);
+static void store_flush (Store s);
+static size_t store_query (Store s, const char *sender, int64_t from, int64_t to,
+                           store_query_cb cb, void *user_data);
+static size_t store_get_count (Store s);
+static void *store_writer (void *data);
+static size_t index_segment (Store s, struct store_segment *segment);
+static bool index_scanned (const uint8_t *body, size_t len, size_t offset, void *user_data);
+static void store_rewind (Store s, struct store_segment *segment);
+static bool index_record (Store s, struct store_segment *segment, size_t offset, const uint8_t *body,
+                          size_t len);
+static bool parse_record (const uint8_t *body, size_t len, struct store_message *message);
+static bool read_record (Store s, uint64_t location, struct store_message *message, size_t *next);
+static uint64_t hash_sender (const char *sender, size_t len);
+static struct store_segment *segment_create (Store s, uint64_t seq);
+static bool segment_view (struct store_segment *segment, size_t end);
+static void segment_free (gpointer data);
+static void postings_free (gpointer data);
+
+const struct _store store = {
+    .open = &store_open,
+    .open_readonly = &store_open_readonly,
+    .close = &store_close,
+    .append = &store_append,
+    .flush = &store_flush,
+    .query = &store_query,
+    .get_count = &store_get_count
+};
+
+Store store_open (const char *dir)
+{
+    return store_load(dir, false);
+}
+
+Store store_open_readonly (const char *dir)
+{
+    return store_load(dir, true);
+}
+
+//read only leaves every file as it is, the last segment may be one a running gateway appends to
+Store store_load (const char *dir, bool read_only)
+{
+    struct store_segment *segment;
+    uint64_t *seqs, seq;
+    size_t n, valid;
+    Store s;
+
+    if (!read_only && g_mkdir_with_parents(dir, 0755) != 0) {
+        LOG_ERROR("store: cannot create %s: %s", dir, strerror(errno));
+        return NULL;
+    }
+    if (!logfile.list(dir, STORE_SUFFIX, &seqs, &n))
+        return NULL;
+
+    s = g_new0(struct _t_store, 1);
+    g_assert(s != NULL);
+    s->dir = g_strdup(dir);
+    s->read_only = read_only;
+    g_mutex_init(&s->mutex);
+    g_mutex_init(&s->index_mutex);
+    g_cond_init(&s->cond_work);
+    g_cond_init(&s->cond_durable);
+    s->pending = g_string_sized_new(STORE_BATCH_BYTES);
+    s->writing = g_string_sized_new(STORE_BATCH_BYTES);
+    s->segments = g_ptr_array_new_with_free_func(segment_free);
+    s->marks = g_array_new(FALSE, FALSE, sizeof(struct store_mark));
+    s->senders = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, postings_free);
+
+    seq = 0;
+    for (size_t i = 0; i < n; i++) {
+        seq = seqs[i];
+        segment = g_new0(struct store_segment, 1);
+        segment->seq = seq;
+        segment->index = s->segments->len;
+        segment->path = logfile.path(dir, seq, STORE_SUFFIX);
+        segment->fd = -1;
+        if (!segment_view(segment, 0)) {
+            LOG_ERROR("store: cannot read %s", segment->path);
+            segment_free(segment);
+            continue;
+        }
+        //left by a restart that received nothing
+        if (segment->map_len == 0) {
+            if (!read_only)
+                unlink(segment->path);
+            segment_free(segment);
+            continue;
+        }
+        valid = index_segment(s, segment);
+        if (valid < segment->map_len && !read_only) {
+            LOG_WARN("store: %s is torn at %zu of %zu bytes", segment->path, valid, segment->map_len);
+            if (i + 1 == n && truncate(segment->path, (off_t)valid) != 0)
+                LOG_ERROR("store: cannot truncate %s", segment->path);
+        }
+        segment->written = valid;
+        g_ptr_array_add(s->segments, segment);
+    }
+    g_free(seqs);
+    s->durable = s->appended;
+    if (read_only)
+        return s;
+
+    s->active = segment_create(s, seq + 1);
+    if (s->active == NULL) {
+        store_close(&s);
+        return NULL;
+    }
+    LOG_INFO("store: %" PRIu64 " messages in %u segments", s->count, s->segments->len - 1);
+    pthread_create(&s->writer, NULL, store_writer, s);
+    return s;
+}
+
+void store_close (Store *s)
+{
+    if (s == NULL || (*s) == NULL)
+        return;
+    g_mutex_lock(&(*s)->mutex);
+    (*s)->stop = true;
+    g_cond_signal(&(*s)->cond_work);
+    g_mutex_unlock(&(*s)->mutex);
+    if ((*s)->writer != 0)
+        pthread_join((*s)->writer, NULL);
+    g_ptr_array_free((*s)->segments, TRUE);
+    g_array_free((*s)->marks, TRUE);
+    g_hash_table_destroy((*s)->senders);
+    g_string_free((*s)->pending, TRUE);
+    g_string_free((*s)->writing, TRUE);
+    g_cond_clear(&(*s)->cond_work);
+    g_cond_clear(&(*s)->cond_durable);
+    g_mutex_clear(&(*s)->index_mutex);
+    g_mutex_clear(&(*s)->mutex);
+    g_free((*s)->dir);
+    g_free(*s);
+    *s = NULL;
+}
+
+void store_append (Store s, const char *port, const struct reassembly_message *message)
+{
+    uint16_t text_len, part_len;
+    uint8_t port_len, sender_len;
+    int64_t received;
+    size_t start;
+
+    if (s == NULL || s->read_only || port == NULL || message == NULL)
+        return;
+    port_len = (uint8_t)MIN(strlen(port), UINT8_MAX);
+    sender_len = (uint8_t)MIN(strlen(message->sender), UINT8_MAX);
+    text_len = (uint16_t)MIN(message->text_len, UINT16_MAX);
+    g_mutex_lock(&s->mutex);
+    //arrival order is time order, the time index relies on it when the clock steps back
+    received = MAX(g_get_real_time() / G_USEC_PER_SEC, s->last_received);
+    s->last_received = received;
+    s->appended++;
+    start = s->pending->len;
+    g_string_set_size(s->pending, start + LOGFILE_FRAME_LEN);
+    g_string_append_len(s->pending, (const gchar *)&s->appended, sizeof(uint64_t));
+    g_string_append_len(s->pending, (const gchar *)&received, sizeof(int64_t));
+    g_string_append_len(s->pending, (const gchar *)&message->timestamp, sizeof(int64_t));
+    g_string_append_len(s->pending, (const gchar *)&port_len, 1);
+    g_string_append_len(s->pending, port, port_len);
+    g_string_append_len(s->pending, (const gchar *)&sender_len, 1);
+    g_string_append_len(s->pending, message->sender, sender_len);
+    g_string_append_len(s->pending, (const gchar *)&text_len, 2);
+    //the parts are joined straight into the batch
+    for (uint8_t i = 0; i < message->part_count && text_len > 0; i++) {
+        if (message->parts[i] == NULL)
+            continue;
+        part_len = (uint16_t)MIN(message->parts[i]->text_len, text_len);
+        g_string_append_len(s->pending, message->parts[i]->text, part_len);
+        text_len -= part_len;
+    }
+    logfile.frame((uint8_t *)s->pending->str + start, s->pending->len - start - LOGFILE_FRAME_LEN);
+    g_cond_signal(&s->cond_work);
+    g_mutex_unlock(&s->mutex);
+}
+
+void store_flush (Store s)
+{
+    uint64_t appended;
+
+    if (s == NULL)
+        return;
+    g_mutex_lock(&s->mutex);
+    appended = s->appended;
+    while (s->durable < appended && !s->stop)
+        g_cond_wait(&s->cond_durable, &s->mutex);
+    g_mutex_unlock(&s->mutex);
+}
+
+/*
+ * Batches go out with one write and one fdatasync, then get indexed. A
+ * query only sees a message once it is on disk.
+ */
+void *store_writer (void *data)
+{
+    struct store_segment *segment, *next;
+    const uint8_t *body;
+    uint64_t batch;
+    gint64 deadline;
+    GString *swap;
+    uint32_t len;
+    size_t off;
+    Store s;
+
+    s = data;
+    g_mutex_lock(&s->mutex);
+    while (true) {
+        while (s->pending->len == 0 && !s->stop)
+            g_cond_wait(&s->cond_work, &s->mutex);
+        if (s->pending->len == 0)
+            break;
+        deadline = g_get_monotonic_time() + STORE_COMMIT_INTERVAL;
+        while (s->pending->len < STORE_BATCH_BYTES && !s->stop)
+            if (!g_cond_wait_until(&s->cond_work, &s->mutex, deadline))
+                break;
+        swap = s->writing;
+        s->writing = s->pending;
+        s->pending = swap;
+        batch = s->appended;
+        g_mutex_unlock(&s->mutex);
+
+        //offsets are 32 bit, a batch never straddles two segments
+        segment = s->active;
+        if (segment->written > 0 && segment->written + s->writing->len > STORE_SEGMENT_MAX) {
+            g_mutex_lock(&s->index_mutex);
+            next = segment_create(s, segment->seq + 1);
+            g_mutex_unlock(&s->index_mutex);
+            if (next != NULL) {
+                close(segment->fd);
+                segment->fd = -1;
+                s->active = segment = next;
+            }
+        }
+        if (!logfile.write(segment->fd, segment->path, (const uint8_t *)s->writing->str, s->writing->len)) {
+            store_rewind(s, segment);
+            //nothing of the batch is indexed, it goes out again ahead of the rest
+            g_mutex_lock(&s->mutex);
+            g_string_prepend_len(s->pending, s->writing->str, (gssize)s->writing->len);
+            g_string_truncate(s->writing, 0);
+            deadline = g_get_monotonic_time() + STORE_RETRY_INTERVAL;
+            while (!s->stop)
+                if (!g_cond_wait_until(&s->cond_work, &s->mutex, deadline))
+                    break;
+            if (s->stop) {
+                LOG_ERROR("store: closing with %zu bytes never written", s->pending->len);
+                break;
+            }
+            continue;
+        }
+
+        g_mutex_lock(&s->index_mutex);
+        for (off = 0; off + LOGFILE_FRAME_LEN <= s->writing->len; off += LOGFILE_FRAME_LEN + len) {
+            memcpy(&len, s->writing->str + off, sizeof(len));
+            body = (const uint8_t *)s->writing->str + off + LOGFILE_FRAME_LEN;
+            index_record(s, segment, segment->written + off, body, len);
+        }
+        segment->written += s->writing->len;
+        g_mutex_unlock(&s->index_mutex);
+
+        g_mutex_lock(&s->mutex);
+        g_string_truncate(s->writing, 0);
+        s->durable = batch;
+        g_cond_broadcast(&s->cond_durable);
+    }
+    g_cond_broadcast(&s->cond_durable);
+    g_mutex_unlock(&s->mutex);
+    return NULL;
+}
+
+//indexes one segment read at open, returns the length of its valid prefix
+size_t index_segment (Store s, struct store_segment *segment)
+{
+    struct store_scan scan = {.s = s, .segment = segment};
+
+    return logfile.scan(segment->map, segment->map_len, STORE_BODY_MIN, index_scanned, &scan);
+}
+
+bool index_scanned (const uint8_t *body, size_t len, size_t offset, void *user_data)
+{
+    struct store_scan *scan = (struct store_scan *)user_data;
+    struct store_message message;
+    Store s;
+
+    s = scan->s;
+    if (!index_record(s, scan->segment, offset, body, len))
+        return false;
+    //new messages carry on where the log ends
+    parse_record(body, len, &message);
+    s->appended = MAX(s->appended, message.id);
+    s->last_received = MAX(s->last_received, message.received);
+    return true;
+}
+
+/*
+ * The batch did not reach segment. Whatever part of it did is cut off and
+ * the batch goes to a fresh segment, or to the same one again if it holds
+ * nothing yet or no segment can be created.
+ */
+void store_rewind (Store s, struct store_segment *segment)
+{
+    struct store_segment *next;
+
+    LOG_WARN("store: %zu bytes did not reach %s, writing them again", s->writing->len, segment->path);
+    if (ftruncate(segment->fd, (off_t)segment->written) != 0)
+        LOG_ERROR("store: cannot truncate %s: %s", segment->path, strerror(errno));
+    if (segment->written == 0)
+        return;
+    g_mutex_lock(&s->index_mutex);
+    next = segment_create(s, segment->seq + 1);
+    g_mutex_unlock(&s->index_mutex);
+    if (next == NULL)
+        return;
+    close(segment->fd);
+    segment->fd = -1;
+    s->active = next;
+}
+
+bool index_record (Store s, struct store_segment *segment, size_t offset, const uint8_t *body, size_t len)
+{
+    struct store_postings *postings;
+    struct store_message message;
+    struct store_mark mark;
+    uint64_t location, hash;
+
+    if (!parse_record(body, len, &message))
+        return false;
+    location = LOCATION(segment->index, offset);
+    if (s->count % STORE_SPARSE_INTERVAL == 0) {
+        mark.received = message.received;
+        mark.location = location;
+        g_array_append_val(s->marks, mark);
+    }
+    hash = hash_sender(message.sender, message.sender_len);
+    postings = g_hash_table_lookup(s->senders, &hash);
+    if (postings == NULL) {
+        postings = g_new(struct store_postings, 1);
+        postings->hash = hash;
+        postings->locations = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+        g_hash_table_insert(s->senders, &postings->hash, postings);
+    }
+    g_array_append_val(postings->locations, location);
+    s->count++;
+    return true;
+}
+
+bool parse_record (const uint8_t *body, size_t len, struct store_message *message)
+{
+    uint16_t len16;
+    size_t off;
+
+    if (len < STORE_BODY_MIN)
+        return false;
+    memcpy(&message->id, body, 8);
+    memcpy(&message->received, body + 8, 8);
+    memcpy(&message->timestamp, body + 16, 8);
+    off = 24;
+    message->port_len = body[off++];
+    message->port = (const char *)body + off;
+    off += message->port_len;
+    if (off + 1 > len)
+        return false;
+    message->sender_len = body[off++];
+    message->sender = (const char *)body + off;
+    off += message->sender_len;
+    if (off + 2 > len)
+        return false;
+    memcpy(&len16, body + off, 2);
+    off += 2;
+    message->text_len = len16;
+    message->text = (const char *)body + off;
+    return off + message->text_len == len;
+}
+
+//the record at location, next gets the offset of the one after it in the same segment
+bool read_record (Store s, uint64_t location, struct store_message *message, size_t *next)
+{
+    struct store_segment *segment;
+    size_t offset;
+    uint32_t len;
+
+    if (LOCATION_SEGMENT(location) >= s->segments->len)
+        return false;
+    segment = g_ptr_array_index(s->segments, LOCATION_SEGMENT(location));
+    offset = LOCATION_OFFSET(location);
+    if (offset + LOGFILE_FRAME_LEN > segment->written || !segment_view(segment, segment->written))
+        return false;
+    memcpy(&len, segment->map + offset, sizeof(len));
+    if (next != NULL)
+        *next = offset + LOGFILE_FRAME_LEN + len;
+    return parse_record(segment->map + offset + LOGFILE_FRAME_LEN, len, message);
+}
+
+size_t store_query (Store s, const char *sender, int64_t from, int64_t to, store_query_cb cb, void *user_data)
+{
+    struct store_postings *postings;
+    struct store_message message;
+    struct store_mark *mark;
+    uint64_t hash, location;
+    size_t count, sender_len, next;
+    guint lo, hi, mid;
+
+    if (s == NULL || cb == NULL || from >= to)
+        return 0;
+    count = 0;
+    g_mutex_lock(&s->index_mutex);
+    if (sender != NULL) {
+        sender_len = strlen(sender);
+        hash = hash_sender(sender, sender_len);
+        postings = g_hash_table_lookup(s->senders, &hash);
+        if (postings == NULL) {
+            g_mutex_unlock(&s->index_mutex);
+            return 0;
+        }
+        //the postings are in time order too, the first one in range is found by bisection
+        lo = 0;
+        hi = postings->locations->len;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (read_record(s, g_array_index(postings->locations, uint64_t, mid), &message, NULL) &&
+                message.received < from)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (guint i = lo; i < postings->locations->len; i++) {
+            if (!read_record(s, g_array_index(postings->locations, uint64_t, i), &message, NULL))
+                continue;
+            if (message.received >= to)
+                break;
+            if (message.sender_len != sender_len || memcmp(message.sender, sender, sender_len) != 0)
+                continue;
+            count++;
+            if (!cb(&message, user_data))
+                break;
+        }
+        g_mutex_unlock(&s->index_mutex);
+        return count;
+    }
+    if (s->marks->len == 0) {
+        g_mutex_unlock(&s->index_mutex);
+        return 0;
+    }
+    //the last mark before from, everything ahead of it is older
+    lo = 0;
+    hi = s->marks->len;
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (g_array_index(s->marks, struct store_mark, mid).received < from)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    mark = &g_array_index(s->marks, struct store_mark, lo);
+    location = mark->location;
+    while (LOCATION_SEGMENT(location) < s->segments->len) {
+        if (!read_record(s, location, &message, &next)) {
+            //end of the segment, the next one carries on
+            location = LOCATION(LOCATION_SEGMENT(location) + 1, 0);
+            continue;
+        }
+        location = LOCATION(LOCATION_SEGMENT(location), next);
+        if (message.received < from)
+            continue;
+        if (message.received >= to)
+            break;
+        count++;
+        if (!cb(&message, user_data))
+            break;
+    }
+    g_mutex_unlock(&s->index_mutex);
+    return count;
+}
+
+size_t store_get_count (Store s)
+{
+    size_t count;
+
+    if (s == NULL)
+        return 0;
+    g_mutex_lock(&s->index_mutex);
+    count = (size_t)s->count;
+    g_mutex_unlock(&s->index_mutex);
+    return count;
+}
+
+//FNV-1a
+uint64_t hash_sender (const char *sender, size_t len)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)sender[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+    return hash;
+}
+
+struct store_segment *segment_create (Store s, uint64_t seq)
+{
+    struct store_segment *segment;
+
+    segment = g_new0(struct store_segment, 1);
+    segment->seq = seq;
+    segment->index = s->segments->len;
+    segment->path = logfile.path(s->dir, seq, STORE_SUFFIX);
+    segment->fd = logfile.create(s->dir, segment->path);
+    if (segment->fd < 0) {
+        segment_free(segment);
+        return NULL;
+    }
+    g_ptr_array_add(s->segments, segment);
+    return segment;
+}
+
+//maps at least the first end bytes, the active segment is mapped again as it grows
+bool segment_view (struct store_segment *segment, size_t end)
+{
+    uint8_t *map;
+    size_t map_len;
+
+    if (segment->map != NULL && end <= segment->map_len)
+        return true;
+    if (!logfile.map(segment->path, end, &map, &map_len))
+        return false;
+    if (segment->map != NULL)
+        munmap(segment->map, segment->map_len);
+    segment->map = map;
+    segment->map_len = map_len;
+    return true;
+}
+
+void segment_free (gpointer data)
+{
+    struct store_segment *segment;
+
+    segment = data;
+    if (segment->map != NULL)
+        munmap(segment->map, segment->map_len);
+    if (segment->fd >= 0)
+        close(segment->fd);
+    g_free(segment->path);
+    g_free(segment);
+}
+
+void postings_free (gpointer data)
+{
+    struct store_postings *postings;
+
+    postings = data;
+    g_array_free(postings->locations, TRUE);
+    g_free(postings);
+}
@@ -0,0 +1,57 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_STORE_H
+#define GSMAPP_STORE_H
+
+#include "reassembly.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _t_store *Store;
+
+//a stored message, the strings point into the mapped segment and are not null terminated
+struct store_message {
+    uint64_t    id;         //arrival order, starting at 1
+    int64_t     received;   //unix seconds the gateway got it, never decreasing
+    int64_t     timestamp;  //service centre time stamp of the first part
+    const char  *port;
+    size_t      port_len;
+    const char  *sender;
+    size_t      sender_len;
+    const char  *text;
+    size_t      text_len;
+};
+
+//return false to stop the query; runs with the index locked, it must not call into the store
+typedef bool (* store_query_cb) (const struct store_message *message, void *user_data);
+
+/*
+ * Append-only log of received messages in segment files, indexed in memory
+ * by sender and by arrival time. Appends are batched to a writer thread,
+ * queries read the segments through mmap and never scan what is outside
+ * their range.
+ */
+struct _store {
+    //indexes the segments in dir, a torn tail of the last one is cut off
+    Store       (* open) (const char *dir);
+    //for lookups next to a running gateway: indexes what is intact and never writes, appends are dropped
+    Store       (* open_readonly) (const char *dir);
+    void        (* close) (Store *store);
+
+    //copies the message to the next batch and returns at once, its parts are joined
+    void        (* append) (Store store, const char *port, const struct reassembly_message *message);
+    //blocks until every message appended so far is on disk and visible to queries
+    void        (* flush) (Store store);
+    //messages received in [from, to), oldest first; a NULL sender matches every sender
+    size_t      (* query) (Store store, const char *sender, int64_t from, int64_t to,
+                           store_query_cb cb, void *user_data);
+    size_t      (* get_count) (Store store);
+};
+extern const struct _store store;
+
+#endif //GSMAPP_STORE_H
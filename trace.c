@@ -0,0 +1,469 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#define _GNU_SOURCE
+#include "trace.h"
+#include "logger.h"
+
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TRACE_MAGIC "GSMTRACE"
+#define TRACE_VERSION 1
+#define TRACE_RING_SLOTS 1024 //power of two
+#define TRACE_CHUNK_MAX 1024
+#define TRACE_DRAIN_INTERVAL 10000 //microsecond
+#define TRACE_REPLAY_TIMEOUT 5000 //millisecond, wait for an expected write
+
+struct trace_slot {
+    _Atomic uint64_t sequence;
+    int64_t time;
+    uint16_t channel;
+    uint8_t kind;
+    uint16_t length;
+    uint8_t data[TRACE_CHUNK_MAX];
+};
+
+struct _t_trace {
+    int fd;
+    int64_t start;
+    pthread_t writer;
+    _Atomic bool stop;
+    _Atomic uint16_t channels;
+    _Atomic uint64_t dropped;
+    _Atomic uint64_t enqueue_pos;
+    uint64_t dequeue_pos;
+    struct trace_slot slots[TRACE_RING_SLOTS];
+};
+
+struct replay_record {
+    uint8_t kind;
+    uint64_t channel;
+    uint64_t time;
+    const uint8_t *data;
+    size_t length;
+};
+
+struct _t_trace_replay {
+    gchar *contents;
+    gsize length;
+    GArray *records;
+    double speed;
+    int master;
+    char *port;
+    pthread_t thread;
+    GMutex mutex;
+    struct trace_replay_stats stats;
+    bool done;
+};
+
+static Trace trace_open (const char *path);
+static void trace_close (Trace *trace);
+static uint16_t trace_add_channel (Trace trace, const char *port);
+static void trace_record (Trace trace, uint16_t channel, enum trace_kind kind, const uint8_t *data,
+                          size_t length);
+static uint64_t trace_get_dropped (Trace trace);
+static TraceReplay trace_replay (const char *path, const char *port, double speed);
+static const char *trace_get_replay_port (TraceReplay replay);
+static bool trace_get_replay_stats (TraceReplay replay, struct trace_replay_stats *stats);
+static void trace_free_replay (TraceReplay *replay);
+static bool enqueue (Trace trace, uint16_t channel, enum trace_kind kind, const uint8_t *data, size_t length);
+static void *trace_writer (void *data);
+static void drain (Trace trace, GString *out);
+static void write_all (int fd, const char *data, size_t len);
+static void put_varint (GString *out, uint64_t value);
+static bool get_varint (const uint8_t **p, const uint8_t *end, uint64_t *value);
+static bool parse (TraceReplay replay, const char *port);
+static void *replay_run (void *data);
+static bool expect_tx (TraceReplay replay, const uint8_t *data, size_t length);
+
+const struct _trace trace = {
+    .open = &trace_open,
+    .close = &trace_close,
+    .add_channel = &trace_add_channel,
+    .record = &trace_record,
+    .get_dropped = &trace_get_dropped,
+    .replay = &trace_replay,
+    .get_replay_port = &trace_get_replay_port,
+    .get_replay_stats = &trace_get_replay_stats,
+    .free_replay = &trace_free_replay
+};
+
+Trace trace_open (const char *path)
+{
+    Trace t;
+    uint8_t version;
+
+    t = g_new0(struct _t_trace, 1);
+    g_assert(t != NULL);
+    if (t == NULL)
+        return NULL;
+    t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (t->fd < 0) {
+        LOG_ERROR("trace: cannot create %s: %s", path, strerror(errno));
+        g_free(t);
+        return NULL;
+    }
+    version = TRACE_VERSION;
+    write_all(t->fd, TRACE_MAGIC, strlen(TRACE_MAGIC));
+    write_all(t->fd, (const char *)&version, 1);
+    for (uint64_t i = 0; i < TRACE_RING_SLOTS; i++)
+        atomic_init(&t->slots[i].sequence, i);
+    t->start = g_get_monotonic_time();
+    pthread_create(&t->writer, NULL, trace_writer, t);
+    return t;
+}
+
+void trace_close (Trace *t)
+{
+    if (t == NULL || (*t) == NULL)
+        return;
+    atomic_store(&(*t)->stop, true);
+    pthread_join((*t)->writer, NULL);
+    close((*t)->fd);
+    g_free(*t);
+    *t = NULL;
+}
+
+uint16_t trace_add_channel (Trace t, const char *port)
+{
+    uint16_t channel;
+
+    channel = atomic_fetch_add(&t->channels, 1);
+    //rare and must not be lost, wait for room instead of dropping
+    while (!enqueue(t, channel, TRACE_CHANNEL, (const uint8_t *)port, strlen(port)))
+        g_usleep(TRACE_DRAIN_INTERVAL);
+    return channel;
+}
+
+void trace_record (Trace t, uint16_t channel, enum trace_kind kind, const uint8_t *data, size_t length)
+{
+    size_t chunk;
+
+    if (t == NULL)
+        return;
+    for (size_t offset = 0; offset < length; offset += chunk) {
+        chunk = MIN(length - offset, TRACE_CHUNK_MAX);
+        if (!enqueue(t, channel, kind, data + offset, chunk))
+            atomic_fetch_add_explicit(&t->dropped, 1, memory_order_relaxed);
+    }
+}
+
+uint64_t trace_get_dropped (Trace t)
+{
+    if (t == NULL)
+        return 0;
+    return atomic_load_explicit(&t->dropped, memory_order_relaxed);
+}
+
+//bounded MPMC queue (Vyukov), the device threads produce and the writer consumes
+bool enqueue (Trace t, uint16_t channel, enum trace_kind kind, const uint8_t *data, size_t length)
+{
+    struct trace_slot *slot;
+    uint64_t pos, sequence;
+    int64_t dif;
+
+    pos = atomic_load_explicit(&t->enqueue_pos, memory_order_relaxed);
+    while (true) {
+        slot = &t->slots[pos & (TRACE_RING_SLOTS - 1)];
+        sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        dif = (int64_t)(sequence - pos);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&t->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&t->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    slot->time = g_get_monotonic_time() - t->start;
+    slot->channel = channel;
+    slot->kind = (uint8_t)kind;
+    slot->length = (uint16_t)length;
+    memcpy(slot->data, data, length);
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+void *trace_writer (void *data)
+{
+    GString *out;
+    Trace t;
+    bool stop;
+
+    t = data;
+    out = g_string_sized_new(256 * 1024);
+    do {
+        stop = atomic_load(&t->stop);
+        drain(t, out);
+        if (out->len > 0) {
+            write_all(t->fd, out->str, out->len);
+            g_string_truncate(out, 0);
+        }
+        if (!stop)
+            g_usleep(TRACE_DRAIN_INTERVAL);
+    } while (!stop);
+    g_string_free(out, TRUE);
+    return NULL;
+}
+
+void drain (Trace t, GString *out)
+{
+    struct trace_slot *slot;
+    uint64_t sequence;
+
+    while (true) {
+        slot = &t->slots[t->dequeue_pos & (TRACE_RING_SLOTS - 1)];
+        sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence != t->dequeue_pos + 1)
+            return;
+        g_string_append_c(out, (gchar)slot->kind);
+        put_varint(out, slot->channel);
+        put_varint(out, (uint64_t)slot->time);
+        put_varint(out, slot->length);
+        g_string_append_len(out, (const gchar *)slot->data, slot->length);
+        atomic_store_explicit(&slot->sequence, t->dequeue_pos + TRACE_RING_SLOTS, memory_order_release);
+        t->dequeue_pos++;
+    }
+}
+
+void write_all (int fd, const char *data, size_t len)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = write(fd, data, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            LOG_ERROR("trace: write failed: %s", strerror(errno));
+            return;
+        }
+        data += ret;
+        len -= (size_t)ret;
+    }
+}
+
+void put_varint (GString *out, uint64_t value)
+{
+    while (value >= 0x80) {
+        g_string_append_c(out, (gchar)(value | 0x80));
+        value >>= 7;
+    }
+    g_string_append_c(out, (gchar)value);
+}
+
+bool get_varint (const uint8_t **p, const uint8_t *end, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        *value |= (uint64_t)(**p & 0x7F) << shift;
+        if ((*((*p)++) & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+TraceReplay trace_replay (const char *path, const char *port, double speed)
+{
+    TraceReplay replay;
+
+    replay = g_new0(struct _t_trace_replay, 1);
+    g_assert(replay != NULL);
+    if (replay == NULL)
+        return NULL;
+    replay->master = -1;
+    replay->speed = speed;
+    g_mutex_init(&replay->mutex);
+    replay->records = g_array_new(FALSE, FALSE, sizeof(struct replay_record));
+    if (!g_file_get_contents(path, &replay->contents, &replay->length, NULL) || !parse(replay, port)) {
+        LOG_ERROR("trace: cannot replay %s", path);
+        trace_free_replay(&replay);
+        return NULL;
+    }
+    replay->master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (replay->master < 0 || grantpt(replay->master) != 0 || unlockpt(replay->master) != 0) {
+        LOG_ERROR("trace: cannot open a pseudo terminal: %s", strerror(errno));
+        trace_free_replay(&replay);
+        return NULL;
+    }
+    replay->port = g_strdup(ptsname(replay->master));
+    pthread_create(&replay->thread, NULL, replay_run, replay);
+    return replay;
+}
+
+//keeps the RX and TX records of one channel, pointing into the file contents
+bool parse (TraceReplay replay, const char *port)
+{
+    struct replay_record record;
+    const uint8_t *p, *end;
+    uint64_t channel;
+    bool selected;
+
+    p = (const uint8_t *)replay->contents;
+    end = p + replay->length;
+    if (replay->length < strlen(TRACE_MAGIC) + 1 || memcmp(p, TRACE_MAGIC, strlen(TRACE_MAGIC)) != 0 ||
+        p[strlen(TRACE_MAGIC)] != TRACE_VERSION)
+        return false;
+    p += strlen(TRACE_MAGIC) + 1;
+    selected = false;
+    channel = 0;
+    while (p < end) {
+        record.kind = *p++;
+        if (!get_varint(&p, end, &record.channel) || !get_varint(&p, end, &record.time) ||
+            !get_varint(&p, end, &record.length) || record.length > (uint64_t)(end - p))
+            break;
+        record.data = p;
+        p += record.length;
+        if (record.kind == TRACE_CHANNEL && !selected &&
+            (port == NULL || (strlen(port) == record.length && memcmp(port, record.data, record.length) == 0))) {
+            channel = record.channel;
+            selected = true;
+        } else if (record.kind != TRACE_CHANNEL && selected && record.channel == channel) {
+            g_array_append_val(replay->records, record);
+        }
+    }
+    return selected;
+}
+
+/*
+ * The GSM layer drives the slave side. Every TX record has to be written by it
+ * before the RX records after it are released, so replies never run ahead of
+ * the commands they answer, whatever the speed. RX is paced from the last
+ * matched write, keeping the recorded modem latency rather than wall time.
+ */
+void *replay_run (void *data)
+{
+    struct replay_record *record;
+    TraceReplay replay;
+    int64_t start, due, now, anchor, anchor_time;
+    const uint8_t *p;
+    ssize_t ret;
+    size_t left;
+    bool stalled;
+
+    replay = data;
+    start = g_get_monotonic_time();
+    anchor = start;
+    anchor_time = 0;
+    stalled = false;
+    for (guint i = 0; i < replay->records->len && !stalled; i++) {
+        record = &g_array_index(replay->records, struct replay_record, i);
+        if (record->kind == TRACE_TX) {
+            stalled = !expect_tx(replay, record->data, record->length);
+            anchor = g_get_monotonic_time();
+            anchor_time = (int64_t)record->time;
+        } else if (record->kind == TRACE_RX) {
+            if (replay->speed > 0) {
+                due = anchor + (int64_t)((double)((int64_t)record->time - anchor_time) / replay->speed);
+                now = g_get_monotonic_time();
+                if (due > now)
+                    g_usleep((gulong)(due - now));
+            }
+            for (p = record->data, left = record->length; left > 0; p += ret, left -= (size_t)ret) {
+                ret = write(replay->master, p, left);
+                if (ret < 0 && errno == EINTR)
+                    ret = 0;
+                else if (ret < 0)
+                    break;
+            }
+            g_mutex_lock(&replay->mutex);
+            replay->stats.rx_bytes += record->length;
+            g_mutex_unlock(&replay->mutex);
+        }
+        g_mutex_lock(&replay->mutex);
+        replay->stats.records++;
+        g_mutex_unlock(&replay->mutex);
+    }
+    g_mutex_lock(&replay->mutex);
+    replay->stats.stalled = stalled;
+    replay->stats.elapsed = g_get_monotonic_time() - start;
+    replay->done = true;
+    g_mutex_unlock(&replay->mutex);
+    LOG_INFO("trace: replay finished, %zu records, %zu of %zu written bytes differ%s",
+             replay->stats.records, replay->stats.tx_mismatched, replay->stats.tx_bytes,
+             stalled ? ", stalled" : "");
+    return NULL;
+}
+
+//reads length bytes from the GSM layer and compares them with the recording
+bool expect_tx (TraceReplay replay, const uint8_t *data, size_t length)
+{
+    struct pollfd pfd = {.fd = replay->master, .events = POLLIN};
+    uint8_t buf[TRACE_CHUNK_MAX];
+    size_t mismatched, got;
+    ssize_t ret;
+
+    for (got = 0; got < length; got += (size_t)ret) {
+        ret = poll(&pfd, 1, TRACE_REPLAY_TIMEOUT);
+        if (ret < 0 && errno == EINTR) {
+            ret = 0;
+            continue;
+        }
+        if (ret <= 0)
+            return false;
+        ret = read(replay->master, buf, MIN(sizeof(buf), length - got));
+        if (ret < 0 && errno == EINTR) {
+            ret = 0;
+            continue;
+        }
+        if (ret <= 0)
+            return false;
+        mismatched = 0;
+        for (ssize_t i = 0; i < ret; i++)
+            mismatched += (buf[i] != data[got + (size_t)i]);
+        g_mutex_lock(&replay->mutex);
+        replay->stats.tx_bytes += (size_t)ret;
+        replay->stats.tx_mismatched += mismatched;
+        g_mutex_unlock(&replay->mutex);
+    }
+    return true;
+}
+
+const char *trace_get_replay_port (TraceReplay replay)
+{
+    if (replay == NULL)
+        return NULL;
+    return replay->port;
+}
+
+bool trace_get_replay_stats (TraceReplay replay, struct trace_replay_stats *stats)
+{
+    bool done;
+
+    if (replay == NULL || stats == NULL)
+        return false;
+    g_mutex_lock(&replay->mutex);
+    *stats = replay->stats;
+    done = replay->done;
+    g_mutex_unlock(&replay->mutex);
+    return done;
+}
+
+void trace_free_replay (TraceReplay *replay)
+{
+    if (replay == NULL || (*replay) == NULL)
+        return;
+    if ((*replay)->port != NULL) {
+        pthread_cancel((*replay)->thread);
+        pthread_join((*replay)->thread, NULL);
+    }
+    if ((*replay)->master >= 0)
+        close((*replay)->master);
+    g_array_free((*replay)->records, TRUE);
+    g_free((*replay)->contents);
+    g_free((*replay)->port);
+    g_mutex_clear(&(*replay)->mutex);
+    g_free(*replay);
+    *replay = NULL;
+}
@@ -0,0 +1,57 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_TRACE_H
+#define GSMAPP_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Trace file: "GSMTRACE" | u8 version, then records
+ *   u8 kind | varint channel | varint time | varint length | data[length]
+ * time is microseconds since the trace was opened, varints are LEB128.
+ * A CHANNEL record names the serial port of a channel id before its traffic.
+ */
+enum trace_kind {
+    TRACE_CHANNEL,
+    TRACE_RX,       //modem to host
+    TRACE_TX        //host to modem
+};
+
+struct trace_replay_stats {
+    size_t      records;
+    size_t      rx_bytes;
+    size_t      tx_bytes;
+    size_t      tx_mismatched;  //bytes written by the GSM layer that differ from the trace
+    bool        stalled;        //the GSM layer stopped writing what the trace expects
+    int64_t     elapsed;        //microsecond
+};
+
+typedef struct _t_trace *Trace;
+typedef struct _t_trace_replay *TraceReplay;
+
+struct _trace {
+    //recording is lock-free for the callers, a full ring drops the chunk
+    Trace       (* open) (const char *path);
+    void        (* close) (Trace *trace);
+    uint16_t    (* add_channel) (Trace trace, const char *port);
+    void        (* record) (Trace trace, uint16_t channel, enum trace_kind kind,
+                            const uint8_t *data, size_t length);
+    uint64_t    (* get_dropped) (Trace trace);
+
+    //plays the modem side of the port's channel (NULL for the first) on a pseudo terminal;
+    //speed 1 keeps the recorded timing, 0 answers as soon as the expected bytes were written
+    TraceReplay (* replay) (const char *path, const char *port, double speed);
+    //pass to gsm.init in place of the real port
+    const char *(* get_replay_port) (TraceReplay replay);
+    //true once the replay has finished
+    bool        (* get_replay_stats) (TraceReplay replay, struct trace_replay_stats *stats);
+    void        (* free_replay) (TraceReplay *replay);
+};
+extern const struct _trace trace;
+
+#endif //GSMAPP_TRACE_H
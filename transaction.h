@@ -0,0 +1,34 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_TRANSACTION_H
+#define GSMAPP_TRANSACTION_H
+
+#include <stdint.h>
+
+/*
+ * Multi-step AT transactions written as stackless coroutines, protothread
+ * style. A transaction is a function called again from the top every time
+ * what it waits for happened; TX_BEGIN jumps back behind the await it
+ * returned from. Locals do not survive an await, whatever the transaction
+ * needs later belongs in its context, and an await can not sit inside a
+ * switch of its own. The struct using these keeps the continuation in a
+ * uint16_t named resume, zero before the first call.
+ */
+enum tx_await {
+    TX_DONE,
+    TX_AWAIT_FINAL,     //the command goes out next and waits for OK or an error
+    TX_AWAIT_PROMPT,    //the command goes out next and waits for "> ", the payload follows at once
+    TX_AWAIT_TURN,      //like final, behind the work queued so far and charged to the rate limit
+    TX_AWAIT_URC        //nothing goes out, an unsolicited line or the timeout resumes it
+};
+
+#define TX_BEGIN(tx)        switch ((tx)->resume) { case 0:
+#define TX_AWAIT(tx, await) do { (tx)->resume = (uint16_t)__LINE__; return (await); \
+                                 case __LINE__:; } while (0)
+#define TX_EXIT(tx)         do { (tx)->resume = 0; return TX_DONE; } while (0)
+#define TX_END(tx)          } (tx)->resume = 0; return TX_DONE
+
+#endif //GSMAPP_TRANSACTION_H
@@ -0,0 +1,676 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+#include "wal.h"
+#include "logger.h"
+#include "logfile.h"
+
+#include <glib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define WAL_SEGMENT_MAX (64 * 1024 * 1024)
+#define WAL_BATCH_BYTES (256 * 1024)
+#define WAL_COMMIT_INTERVAL 2000 //microsecond
+#define WAL_RETRY_INTERVAL 1000000 //microsecond, before a batch that failed to reach the disk goes out again
+//the oldest segment is rewritten once less than a quarter of its submissions are live
+#define WAL_COMPACT_RATIO 4
+#define WAL_RECORD_SUBMIT 1
+#define WAL_RECORD_COMPLETE 2
+//framed by logfile, the body is u8 type | u64 id | payload, host byte order
+#define WAL_BODY_MIN 9
+#define WAL_SUFFIX ".wal"
+
+struct wal_segment {
+    uint64_t seq;
+    char *path;
+    int fd;
+    size_t size;        //bytes assigned to the segment, queued or written
+    size_t written;
+    uint8_t *map;
+    size_t map_len;
+    size_t total;       //submit records
+    size_t live;
+    uint64_t drop_lsn;
+    bool sealed;
+    bool dropping;
+};
+
+struct wal_entry {
+    uint64_t id;
+    struct wal_segment *segment;
+    size_t offset;
+};
+
+//the segment being replayed at open
+struct wal_replay {
+    Wal w;
+    struct wal_segment *segment;
+};
+
+struct wal_submit {
+    const char *port;
+    size_t port_len;
+    const char *number;
+    size_t number_len;
+    const char *message;
+    size_t message_len;
+};
+
+struct _t_wal {
+    char *dir;
+    GMutex mutex;
+    GCond cond_work;
+    GCond cond_durable;
+    pthread_t writer;
+    bool stop;
+    GString *pending;
+    GString *writing;
+    uint64_t next_id;
+    uint64_t appended_lsn;
+    uint64_t durable_lsn;
+    GPtrArray *segments;
+    struct wal_segment *active;
+    GHashTable *live;
+    GArray *recovered;
+};
+
+static Wal wal_open (const char *dir);
+static void wal_close (Wal *wal);
+static uint64_t wal_append_submit (Wal wal, const char *port, const char *number, const char *message,
+                                   uint64_t *lsn);
+static void wal_append_complete (Wal wal, uint64_t id, enum sms_result result);
+static void wal_sync (Wal wal, uint64_t lsn);
+static size_t wal_take_pending (Wal wal, const char *port, wal_pending_cb cb, void *user_data);
+static size_t wal_get_pending_count (Wal wal);
+static void *wal_writer (void *data);
+static size_t wal_replay (Wal wal, struct wal_segment *segment);
+static bool replay_record (const uint8_t *body, size_t len, size_t offset, void *user_data);
+static void wal_compact (Wal wal);
+static void wal_relocate (Wal wal, struct wal_segment *segment);
+static void wal_rewind (Wal wal, struct wal_segment *segment);
+static struct wal_segment *segment_create (Wal wal, uint64_t seq);
+static bool segment_map (struct wal_segment *segment);
+static bool segment_read (struct wal_segment *segment, size_t offset, void *dst, size_t len);
+static void segment_free (gpointer data);
+static bool parse_submit (const uint8_t *body, size_t len, struct wal_submit *submit);
+
+const struct _wal wal = {
+    .open = &wal_open,
+    .close = &wal_close,
+    .append_submit = &wal_append_submit,
+    .append_complete = &wal_append_complete,
+    .sync = &wal_sync,
+    .take_pending = &wal_take_pending,
+    .get_pending_count = &wal_get_pending_count
+};
+
+static gint compare_u64 (gconstpointer a, gconstpointer b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+//frames the body already appended at out[start + LOGFILE_FRAME_LEN], returns the record length
+static size_t frame_record (GString *out, size_t start)
+{
+    return logfile.frame((uint8_t *)out->str + start, out->len - start - LOGFILE_FRAME_LEN);
+}
+
+static void append_field (GString *out, const char *value, size_t len_size)
+{
+    size_t len;
+    uint8_t len8;
+    uint16_t len16;
+
+    len = strlen(value);
+    if (len_size == 1) {
+        len8 = (uint8_t)len;
+        g_string_append_len(out, (const gchar *)&len8, 1);
+    } else {
+        len16 = (uint16_t)len;
+        g_string_append_len(out, (const gchar *)&len16, 2);
+    }
+    g_string_append_len(out, value, (gssize)len);
+}
+
+bool parse_submit (const uint8_t *body, size_t len, struct wal_submit *submit)
+{
+    size_t off;
+    uint16_t len16;
+
+    off = WAL_BODY_MIN;
+    if (off + 1 > len)
+        return false;
+    submit->port_len = body[off++];
+    submit->port = (const char *)body + off;
+    off += submit->port_len;
+    if (off + 1 > len)
+        return false;
+    submit->number_len = body[off++];
+    submit->number = (const char *)body + off;
+    off += submit->number_len;
+    if (off + 2 > len)
+        return false;
+    memcpy(&len16, body + off, 2);
+    off += 2;
+    submit->message_len = len16;
+    submit->message = (const char *)body + off;
+    return off + submit->message_len == len;
+}
+
+Wal wal_open (const char *dir)
+{
+    struct wal_segment *segment;
+    GHashTableIter iter;
+    struct wal_entry *entry;
+    uint64_t *seqs, seq;
+    size_t n, valid;
+    Wal w;
+
+    if (g_mkdir_with_parents(dir, 0755) != 0) {
+        LOG_ERROR("wal: cannot create %s: %s", dir, strerror(errno));
+        return NULL;
+    }
+    if (!logfile.list(dir, WAL_SUFFIX, &seqs, &n))
+        return NULL;
+
+    w = g_new0(struct _t_wal, 1);
+    g_assert(w != NULL);
+    w->dir = g_strdup(dir);
+    g_mutex_init(&w->mutex);
+    g_cond_init(&w->cond_work);
+    g_cond_init(&w->cond_durable);
+    w->pending = g_string_sized_new(WAL_BATCH_BYTES);
+    w->writing = g_string_sized_new(WAL_BATCH_BYTES);
+    w->segments = g_ptr_array_new_with_free_func(segment_free);
+    w->live = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+    w->recovered = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+    w->next_id = 1;
+
+    seq = 0;
+    for (size_t i = 0; i < n; i++) {
+        seq = seqs[i];
+        segment = g_new0(struct wal_segment, 1);
+        segment->seq = seq;
+        segment->path = logfile.path(dir, seq, WAL_SUFFIX);
+        segment->fd = -1;
+        segment->sealed = true;
+        if (!segment_map(segment)) {
+            LOG_ERROR("wal: cannot read %s", segment->path);
+            segment_free(segment);
+            continue;
+        }
+        //left by a restart that appended nothing
+        if (segment->map_len == 0) {
+            unlink(segment->path);
+            segment_free(segment);
+            continue;
+        }
+        valid = wal_replay(w, segment);
+        if (valid < segment->map_len) {
+            LOG_WARN("wal: %s is torn at %zu of %zu bytes", segment->path, valid, segment->map_len);
+            if (i + 1 == n && truncate(segment->path, (off_t)valid) != 0)
+                LOG_ERROR("wal: cannot truncate %s", segment->path);
+        }
+        segment->size = segment->written = valid;
+        g_ptr_array_add(w->segments, segment);
+    }
+    g_free(seqs);
+
+    g_hash_table_iter_init(&iter, w->live);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&entry))
+        g_array_append_val(w->recovered, entry->id);
+    g_array_sort(w->recovered, compare_u64);
+
+    w->active = segment_create(w, seq + 1);
+    if (w->active == NULL) {
+        wal_close(&w);
+        return NULL;
+    }
+    wal_compact(w);
+    pthread_create(&w->writer, NULL, wal_writer, w);
+    return w;
+}
+
+//rebuilds the live index from one segment, returns the length of its valid prefix
+size_t wal_replay (Wal w, struct wal_segment *segment)
+{
+    struct wal_replay replay = {.w = w, .segment = segment};
+
+    return logfile.scan(segment->map, segment->map_len, WAL_BODY_MIN, replay_record, &replay);
+}
+
+bool replay_record (const uint8_t *body, size_t len, size_t offset, void *user_data)
+{
+    struct wal_replay *replay = (struct wal_replay *)user_data;
+    struct wal_entry *entry;
+    uint64_t id;
+    Wal w;
+
+    (void)len;
+    w = replay->w;
+    memcpy(&id, body + 1, sizeof(id));
+    if (id >= w->next_id)
+        w->next_id = id + 1;
+    entry = g_hash_table_lookup(w->live, &id);
+    if (body[0] == WAL_RECORD_SUBMIT) {
+        replay->segment->total++;
+        //a newer copy left behind by compaction replaces the older one
+        if (entry != NULL) {
+            entry->segment->live--;
+        } else {
+            entry = g_new(struct wal_entry, 1);
+            entry->id = id;
+            g_hash_table_insert(w->live, &entry->id, entry);
+        }
+        entry->segment = replay->segment;
+        entry->offset = offset;
+        replay->segment->live++;
+    } else if (body[0] == WAL_RECORD_COMPLETE && entry != NULL) {
+        entry->segment->live--;
+        g_hash_table_remove(w->live, &id);
+    }
+    return true;
+}
+
+void wal_close (Wal *w)
+{
+    if (w == NULL || (*w) == NULL)
+        return;
+    g_mutex_lock(&(*w)->mutex);
+    (*w)->stop = true;
+    g_cond_signal(&(*w)->cond_work);
+    g_mutex_unlock(&(*w)->mutex);
+    if ((*w)->writer != 0)
+        pthread_join((*w)->writer, NULL);
+    g_ptr_array_free((*w)->segments, TRUE);
+    g_hash_table_destroy((*w)->live);
+    g_array_free((*w)->recovered, TRUE);
+    g_string_free((*w)->pending, TRUE);
+    g_string_free((*w)->writing, TRUE);
+    g_cond_clear(&(*w)->cond_work);
+    g_cond_clear(&(*w)->cond_durable);
+    g_mutex_clear(&(*w)->mutex);
+    g_free((*w)->dir);
+    g_free(*w);
+    *w = NULL;
+}
+
+uint64_t wal_append_submit (Wal w, const char *port, const char *number, const char *message,
+                            uint64_t *lsn)
+{
+    struct wal_entry *entry;
+    uint8_t type;
+    uint64_t id;
+    size_t start, len;
+
+    if (w == NULL || strlen(port) > UINT8_MAX || strlen(number) > UINT8_MAX ||
+        strlen(message) > UINT16_MAX)
+        return 0;
+    g_mutex_lock(&w->mutex);
+    id = w->next_id++;
+    start = w->pending->len;
+    g_string_set_size(w->pending, start + LOGFILE_FRAME_LEN);
+    type = WAL_RECORD_SUBMIT;
+    g_string_append_len(w->pending, (const gchar *)&type, 1);
+    g_string_append_len(w->pending, (const gchar *)&id, sizeof(id));
+    append_field(w->pending, port, 1);
+    append_field(w->pending, number, 1);
+    append_field(w->pending, message, 2);
+    len = frame_record(w->pending, start);
+
+    entry = g_new(struct wal_entry, 1);
+    entry->id = id;
+    entry->segment = w->active;
+    entry->offset = w->active->size;
+    g_hash_table_insert(w->live, &entry->id, entry);
+    w->active->size += len;
+    w->active->total++;
+    w->active->live++;
+    w->appended_lsn += len;
+    if (lsn != NULL)
+        *lsn = w->appended_lsn;
+    g_cond_signal(&w->cond_work);
+    g_mutex_unlock(&w->mutex);
+    return id;
+}
+
+void wal_append_complete (Wal w, uint64_t id, enum sms_result result)
+{
+    struct wal_entry *entry;
+    uint8_t type, value;
+    size_t start, len;
+
+    if (w == NULL || id == 0)
+        return;
+    g_mutex_lock(&w->mutex);
+    entry = g_hash_table_lookup(w->live, &id);
+    if (entry == NULL) {
+        g_mutex_unlock(&w->mutex);
+        return;
+    }
+    entry->segment->live--;
+    g_hash_table_remove(w->live, &id);
+    start = w->pending->len;
+    g_string_set_size(w->pending, start + LOGFILE_FRAME_LEN);
+    type = WAL_RECORD_COMPLETE;
+    value = (uint8_t)result;
+    g_string_append_len(w->pending, (const gchar *)&type, 1);
+    g_string_append_len(w->pending, (const gchar *)&id, sizeof(id));
+    g_string_append_len(w->pending, (const gchar *)&value, 1);
+    len = frame_record(w->pending, start);
+    w->active->size += len;
+    w->appended_lsn += len;
+    g_cond_signal(&w->cond_work);
+    g_mutex_unlock(&w->mutex);
+}
+
+void wal_sync (Wal w, uint64_t lsn)
+{
+    if (w == NULL)
+        return;
+    g_mutex_lock(&w->mutex);
+    while (w->durable_lsn < lsn && !w->stop)
+        g_cond_wait(&w->cond_durable, &w->mutex);
+    g_mutex_unlock(&w->mutex);
+}
+
+/*
+ * Group commit: whatever was appended while the previous batch was being
+ * synced, plus a short grace period, goes out with one write and one fdatasync.
+ */
+void *wal_writer (void *data)
+{
+    struct wal_segment *segment;
+    uint64_t batch_lsn;
+    gint64 deadline;
+    GString *swap;
+    bool is_written;
+    Wal w;
+
+    w = data;
+    g_mutex_lock(&w->mutex);
+    while (true) {
+        while (w->pending->len == 0 && !w->stop)
+            g_cond_wait(&w->cond_work, &w->mutex);
+        if (w->pending->len == 0)
+            break;
+        deadline = g_get_monotonic_time() + WAL_COMMIT_INTERVAL;
+        while (w->pending->len < WAL_BATCH_BYTES && !w->stop)
+            if (!g_cond_wait_until(&w->cond_work, &w->mutex, deadline))
+                break;
+        swap = w->writing;
+        w->writing = w->pending;
+        w->pending = swap;
+        segment = w->active;
+        batch_lsn = w->appended_lsn;
+        //later appends go to the next segment, this batch still belongs to the old one
+        if (segment->size >= WAL_SEGMENT_MAX) {
+            w->active = segment_create(w, segment->seq + 1);
+            if (w->active == NULL)
+                w->active = segment;
+            else
+                segment->sealed = true;
+        }
+        g_mutex_unlock(&w->mutex);
+
+        is_written = logfile.write(segment->fd, segment->path, (const uint8_t *)w->writing->str,
+                                   w->writing->len);
+
+        g_mutex_lock(&w->mutex);
+        if (!is_written) {
+            //nothing of the batch counts as durable, it goes out again ahead of the rest
+            wal_rewind(w, segment);
+            deadline = g_get_monotonic_time() + WAL_RETRY_INTERVAL;
+            while (!w->stop)
+                if (!g_cond_wait_until(&w->cond_work, &w->mutex, deadline))
+                    break;
+            if (w->stop) {
+                LOG_ERROR("wal: closing with %zu bytes never written", w->pending->len);
+                break;
+            }
+            continue;
+        }
+        segment->written += w->writing->len;
+        g_string_truncate(w->writing, 0);
+        if (segment->sealed && segment != w->active) {
+            close(segment->fd);
+            segment->fd = -1;
+        }
+        w->durable_lsn = batch_lsn;
+        g_cond_broadcast(&w->cond_durable);
+        wal_compact(w);
+    }
+    g_cond_broadcast(&w->cond_durable);
+    g_mutex_unlock(&w->mutex);
+    return NULL;
+}
+
+/*
+ * The batch did not reach segment. Whatever part of it did is cut off, the
+ * segment is sealed at its last durable record and the batch, with every
+ * record queued behind it, moves to the start of a fresh segment; a segment
+ * rolled to meanwhile is that fresh one. Entries follow their records. If the
+ * segment holds nothing yet, or no segment can be created, the batch is
+ * written again in place.
+ */
+void wal_rewind (Wal w, struct wal_segment *segment)
+{
+    struct wal_segment *target;
+    struct wal_entry *entry;
+    GHashTableIter iter;
+    size_t batch;
+
+    batch = w->writing->len;
+    LOG_WARN("wal: %zu bytes did not reach %s, writing them again", batch, segment->path);
+    if (ftruncate(segment->fd, (off_t)segment->written) != 0)
+        LOG_ERROR("wal: cannot truncate %s: %s", segment->path, strerror(errno));
+    target = w->active;
+    //an empty segment is retried as it is, a full disk does not leave one file behind per attempt
+    if (target == segment)
+        target = segment->written > 0 ? segment_create(w, segment->seq + 1) : NULL;
+    if (target != NULL) {
+        g_hash_table_iter_init(&iter, w->live);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&entry)) {
+            if (entry->segment == target) {
+                entry->offset += batch;
+            } else if (entry->segment == segment && entry->offset >= segment->written) {
+                entry->segment = target;
+                entry->offset -= segment->written;
+                segment->live--;
+                segment->total--;
+                target->live++;
+                target->total++;
+            }
+        }
+        target->size += segment->size - segment->written;
+        segment->size = segment->written;
+        segment->sealed = true;
+        close(segment->fd);
+        segment->fd = -1;
+        w->active = target;
+    }
+    g_string_prepend_len(w->pending, w->writing->str, (gssize)batch);
+    g_string_truncate(w->writing, 0);
+}
+
+/*
+ * Segments go in order, a newer one may hold the completions of submissions
+ * in an older one. The oldest segment is deleted once nothing in it is live;
+ * while it is sparse its live submissions are copied forward first.
+ */
+void wal_compact (Wal w)
+{
+    struct wal_segment *segment;
+
+    while (w->segments->len > 0) {
+        segment = g_ptr_array_index(w->segments, 0);
+        if (segment == w->active)
+            return;
+        if (segment->live == 0 && segment->drop_lsn <= w->durable_lsn) {
+            unlink(segment->path);
+            g_ptr_array_remove_index(w->segments, 0);
+            continue;
+        }
+        if (!segment->dropping && segment->live * WAL_COMPACT_RATIO < segment->total)
+            wal_relocate(w, segment);
+        return;
+    }
+}
+
+void wal_relocate (Wal w, struct wal_segment *segment)
+{
+    struct wal_entry *entry;
+    uint32_t len;
+    uint64_t id;
+    size_t off;
+
+    if (!segment_map(segment))
+        return;
+    for (off = 0; off + LOGFILE_FRAME_LEN <= segment->written; off += LOGFILE_FRAME_LEN + len) {
+        memcpy(&len, segment->map + off, 4);
+        if (segment->map[off + LOGFILE_FRAME_LEN] != WAL_RECORD_SUBMIT)
+            continue;
+        memcpy(&id, segment->map + off + LOGFILE_FRAME_LEN + 1, sizeof(id));
+        entry = g_hash_table_lookup(w->live, &id);
+        if (entry == NULL || entry->segment != segment)
+            continue;
+        g_string_append_len(w->pending, (const gchar *)segment->map + off, LOGFILE_FRAME_LEN + len);
+        entry->segment = w->active;
+        entry->offset = w->active->size;
+        w->active->size += LOGFILE_FRAME_LEN + len;
+        w->active->total++;
+        w->active->live++;
+        w->appended_lsn += LOGFILE_FRAME_LEN + len;
+        segment->live--;
+    }
+    //deleted once the copies are durable
+    segment->dropping = true;
+    segment->drop_lsn = w->appended_lsn;
+    g_cond_signal(&w->cond_work);
+}
+
+size_t wal_take_pending (Wal w, const char *port, wal_pending_cb cb, void *user_data)
+{
+    struct wal_submit submit;
+    struct wal_entry *entry;
+    uint8_t *record;
+    uint64_t id, lsn;
+    uint32_t len;
+    size_t count;
+    char *number, *message;
+    bool match;
+
+    if (w == NULL || cb == NULL)
+        return 0;
+    count = 0;
+    for (guint i = 0; i < w->recovered->len; i++) {
+        g_mutex_lock(&w->mutex);
+        id = g_array_index(w->recovered, uint64_t, i);
+        entry = (id != 0) ? g_hash_table_lookup(w->live, &id) : NULL;
+        //compaction may have moved the record to a part of the log not written yet
+        while (entry != NULL && entry->segment->written <= entry->offset) {
+            lsn = w->appended_lsn;
+            g_mutex_unlock(&w->mutex);
+            wal_sync(w, lsn);
+            g_mutex_lock(&w->mutex);
+            entry = g_hash_table_lookup(w->live, &id);
+        }
+        if (entry == NULL) {
+            g_array_index(w->recovered, uint64_t, i) = 0;
+            g_mutex_unlock(&w->mutex);
+            continue;
+        }
+        record = NULL;
+        match = false;
+        if (segment_read(entry->segment, entry->offset, &len, sizeof(len))) {
+            record = g_malloc(LOGFILE_FRAME_LEN + len);
+            if (segment_read(entry->segment, entry->offset, record, LOGFILE_FRAME_LEN + len) &&
+                parse_submit(record + LOGFILE_FRAME_LEN, len, &submit))
+                match = (strlen(port) == submit.port_len &&
+                         memcmp(port, submit.port, submit.port_len) == 0);
+        }
+        if (match)
+            g_array_index(w->recovered, uint64_t, i) = 0;
+        g_mutex_unlock(&w->mutex);
+        if (match) {
+            number = g_strndup(submit.number, submit.number_len);
+            message = g_strndup(submit.message, submit.message_len);
+            cb(id, number, message, user_data);
+            g_free(number);
+            g_free(message);
+            count++;
+        }
+        g_free(record);
+    }
+    return count;
+}
+
+size_t wal_get_pending_count (Wal w)
+{
+    size_t count;
+
+    if (w == NULL)
+        return 0;
+    g_mutex_lock(&w->mutex);
+    count = g_hash_table_size(w->live);
+    g_mutex_unlock(&w->mutex);
+    return count;
+}
+
+struct wal_segment *segment_create (Wal w, uint64_t seq)
+{
+    struct wal_segment *segment;
+
+    segment = g_new0(struct wal_segment, 1);
+    segment->seq = seq;
+    segment->path = logfile.path(w->dir, seq, WAL_SUFFIX);
+    segment->fd = logfile.create(w->dir, segment->path);
+    if (segment->fd < 0) {
+        segment_free(segment);
+        return NULL;
+    }
+    g_ptr_array_add(w->segments, segment);
+    return segment;
+}
+
+bool segment_map (struct wal_segment *segment)
+{
+    if (segment->map != NULL)
+        return true;
+    if (!logfile.map(segment->path, 0, &segment->map, &segment->map_len))
+        return false;
+    if (segment->map != NULL)
+        madvise(segment->map, segment->map_len, MADV_SEQUENTIAL);
+    return true;
+}
+
+bool segment_read (struct wal_segment *segment, size_t offset, void *dst, size_t len)
+{
+    if (segment->fd >= 0)
+        return pread(segment->fd, dst, len, (off_t)offset) == (ssize_t)len;
+    if (!segment_map(segment) || offset + len > segment->map_len)
+        return false;
+    memcpy(dst, segment->map + offset, len);
+    return true;
+}
+
+void segment_free (gpointer data)
+{
+    struct wal_segment *segment;
+
+    segment = data;
+    if (segment->map != NULL)
+        munmap(segment->map, segment->map_len);
+    if (segment->fd >= 0)
+        close(segment->fd);
+    g_free(segment->path);
+    g_free(segment);
+}
@@ -0,0 +1,35 @@
+//
+// Created by Amin Khozaei on 10/19/26.
+// amin.khozaei@gmail.com
+//
+
+#ifndef GSMAPP_WAL_H
+#define GSMAPP_WAL_H
+
+#include "smshandle.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _t_wal *Wal;
+typedef void (* wal_pending_cb) (uint64_t id, const char *number, const char *message, void *user_data);
+
+struct _wal {
+    //replays the segments in dir, entries submitted but never completed become pending
+    Wal         (* open) (const char *dir);
+    void        (* close) (Wal *wal);
+
+    //returns the entry id, the record is durable once wal.sync(lsn) returns
+    uint64_t    (* append_submit) (Wal wal, const char *port, const char *number, const char *message,
+                                   uint64_t *lsn);
+    void        (* append_complete) (Wal wal, uint64_t id, enum sms_result result);
+    //blocks until everything up to lsn is on disk
+    void        (* sync) (Wal wal, uint64_t lsn);
+
+    //hands recovered entries of the port to cb in submission order, each entry only once
+    size_t      (* take_pending) (Wal wal, const char *port, wal_pending_cb cb, void *user_data);
+    size_t      (* get_pending_count) (Wal wal);
+};
+extern const struct _wal wal;
+
+#endif //GSMAPP_WAL_H